@@ -29,7 +29,7 @@ cbuffer constants : register(b0)
 Texture2D<float> rayDepth : register(t0);
 Buffer<float3> chunkMinMaxData : register(t1);
 
-Texture3D<float> volumes[512] : register(t0, space1);
+Texture3D<float> volumes[] : register(t0, space1);
 
 SamplerState vSampler : register(s0);
 
@@ -3,14 +3,20 @@
 
 #include <amdrdf.h>
 
+#include <chrono>
 #include <filesystem>
 namespace fs = std::filesystem;
 
 
 #undef CreateFile
 
-bool dataformat::SaveTo(std::string savePath, std::span<const RayTrace> traces, const Scene* scene)
+bool dataformat::SaveTo(std::string                 savePath,
+                        rayloader::TraceCollection& traces,
+                        const Scene*                scene,
+                        const SaveOptions&          options)
 {
+    const auto begin = std::chrono::steady_clock::now();
+
     fs::path filePath(savePath);
     if (fs::is_directory(filePath)) {
         return false;
@@ -23,17 +29,28 @@ bool dataformat::SaveTo(std::string savePath, std::span<const RayTrace> traces,
     fs::path parentPath = filePath.parent_path();
     fs::create_directories(parentPath);
 
+    // Traces are read lazily from their source, so it must not be overwritten
+    if (fs::exists(filePath) && fs::exists(traces.SourcePath()) && fs::equivalent(filePath, traces.SourcePath())) {
+        spdlog::error("RAYVIS::SAVING - \"{}\" is the source of the loaded traces and can not be overwritten",
+                      savePath);
+        return false;
+    }
+
     auto stream = rdf::Stream::CreateFile(filePath.string().c_str());
     auto writer = rdf::ChunkFileWriter(stream);
+    writer.SetCompressionOptions(options.compressionLevel, options.workerThreads);
 
     spdlog::info("RAYVIS::SAVING - Started dumping scene to memory.");
     scene->SaveTo(writer);
     spdlog::info("RAYVIS::SAVING - Scene dumped.");
 
     spdlog::info("RAYVIS::SAVING - Started dumping {} rayTrace(s) to memory.", traces.size());
-    bool success = true;
-    for (const auto& trace : traces) {
-        success &= trace.Save(writer);
+    const auto   transform      = options.shuffleRays ? RayBlockTransform::Shuffle : RayBlockTransform::None;
+    bool         success        = true;
+    std::int64_t traceByteCount = 0;
+    for (size_t i = 0; i < traces.size(); i++) {
+        success &= traces.Get(i)->Save(writer, transform);
+        traceByteCount += traces.Info(i).byteSize;
     }
     spdlog::info("RAYVIS::SAVING - {} rayTrace(s) dumped.", traces.size());
 
@@ -44,7 +61,19 @@ bool dataformat::SaveTo(std::string savePath, std::span<const RayTrace> traces,
 
     spdlog::info("RAYVIS::SAVING - Started saving RAYVIS file to disc.");
     writer.Close();
-    spdlog::info("RAYVIS::SAVING - Saved file to disc.");
+    stream.Close();
+
+    const auto end      = std::chrono::steady_clock::now();
+    const auto seconds  = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() / 1000.0;
+    const auto fileSize = fs::file_size(filePath);
+    spdlog::info(
+        "RAYVIS::SAVING - Saved file to disc in {}s (zstd level {}, {} threads, {}, {:.1f} MB/s, ratio {:.2f})",
+        seconds,
+        options.compressionLevel,
+        options.workerThreads,
+        options.shuffleRays ? "shuffled rays" : "raw rays",
+        0 < seconds ? traceByteCount / seconds / (1024.0 * 1024.0) : 0.0,
+        0 < fileSize ? static_cast<double>(traceByteCount) / fileSize : 0.0);
 
     return true;
 }
@@ -62,18 +91,23 @@ bool dataformat::CheckPathForVaildFile(std::string filename)
         return false;
     }
 
-    const auto chunkfile = rdf::ChunkFile(filename.c_str());
+    return Validate(*rayloader::RayVisFile::Open(filename));
+}
+
+bool dataformat::Validate(const rayloader::RayVisFile& file)
+{
+    const auto& chunkfile = file.Chunks();
     {  // Check for scene chunk
         if (chunkfile.GetChunkCount(SCENE_CHUNK_ID) == 0) {
             spdlog::error("RAYVIS_CHECK_PATH: A chunk of type {} is required, but not present in \"{}\"",
                           SCENE_CHUNK_ID,
-                          filename);
+                          file.Path());
             return false;
         }
         if (1 < chunkfile.GetChunkCount(SCENE_CHUNK_ID)) {
             spdlog::error("RAYVIS_CHECK_PATH: To many chunks of type {} found, only 1 should be present in \"{}\"",
                           SCENE_CHUNK_ID,
-                          filename);
+                          file.Path());
             return false;
         }
 
@@ -96,37 +130,5 @@ bool dataformat::CheckPathForVaildFile(std::string filename)
         }
     }
 
-    {  // Check for trace chunk
-        const auto chunkCount = chunkfile.GetChunkCount(RAY_TRACE_CHUNK_ID);
-        if (chunkCount == 0) {
-            spdlog::error("RAYVIS_CHECK_PATH: A chunk of type {} is required, but not present in \"{}\"",
-                          RAY_TRACE_CHUNK_ID,
-                          filename);
-            return false;
-        }
-
-        for (size_t i = 0; i < chunkCount; i++) {
-            const auto chunkVersion = chunkfile.GetChunkVersion(RAY_TRACE_CHUNK_ID, i);
-            if (chunkVersion != RAY_TRACE_VERSION) {
-                spdlog::error("RAYVIS_CHECK_PATH: Chunk {} ID {}: Version is {} but current required version is {}",
-                              RAY_TRACE_CHUNK_ID,
-                              i,
-                              chunkVersion,
-                              RAY_TRACE_VERSION);
-                return false;
-            }
-
-            const auto headerSize = chunkfile.GetChunkHeaderSize(RAY_TRACE_CHUNK_ID, i);
-            if (headerSize != sizeof(RayTraceHeader)) {
-                spdlog::error("RAYVIS_CHECK_PATH: Chunk {} ID {}: Header size is {} but was expected to be {}",
-                              RAY_TRACE_CHUNK_ID,
-                              i,
-                              headerSize,
-                              sizeof(RayTraceHeader));
-                return false;
-            }
-        }
-    }
-
-    return true;
+    return file.ValidateTraces();
 }
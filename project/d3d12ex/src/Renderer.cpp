@@ -7,12 +7,15 @@
 #include <imgui.h>
 #include <rayvis-utils/BreakAssert.h>
 #include <rayvis-utils/Color.h>
+#include <rayvis-utils/CpuRaytracing.h>
 #include <rayvis-utils/FileSystemUtils.h>
 #include <rayvis-utils/Keys.h>
 #include <rayvis-utils/Mouse.h>
 
 #include <spdlog/spdlog.h>
 
+#include <thread>
+
 namespace {
     constexpr std::string formatBytes(size_t byteCount)
     {
@@ -46,6 +49,12 @@ void Renderer::Init(HWND hwnd, const optionalRenderArgs& args)
     if (args.shaderSource.has_value()) {
         config_->Set<std::string>("shaders.source", *args.shaderSource);
     }
+    if (args.compressionLevel.has_value()) {
+        config_->Set<int>("export.compressionLevel", *args.compressionLevel);
+    }
+    if (args.compressionThreads.has_value()) {
+        config_->Set<int>("export.workerThreads", *args.compressionThreads);
+    }
 
     this->hwnd = hwnd;
     RECT rect;
@@ -240,17 +249,28 @@ void Renderer::InitShaders()
 void Renderer::LoadScene(bool dumpsourceChanged)
 {
     const auto begin = std::chrono::steady_clock::now();
+    // A background sampling job reads the trace that is replaced or rescaled below
+    if (vProvider) {
+        vProvider->CancelComputeData();
+    }
     if (dumpsourceChanged) {
         spdlog::info("Starting loading scene from \"{}\"", config_->Get<std::string>("dumpSource"));
 
-        traces = loader.Load(config_->Get<std::string>("dumpSource").c_str());
+        // Validation, scene and traces share one opened file and its chunk index
+        const auto file = rayloader::RayVisFile::Open(config_->Get<std::string>("dumpSource"));
+        if (!dataformat::Validate(*file)) {
+            throw std::runtime_error(fmt::format("\"{}\" is no valid {} file", file->Path(), dataformat::EXTENSION));
+        }
+
+        activeTrace.reset();
+        traces = loader.Open(file);
         assert(!traces.empty());
         if (traces.size() <= config_->Get<int32_t>("traceId")) {
             config_->Set<int32_t>("traceId", 0);
         }
 
         {  // Scene geometry
-            scene              = Scene::LoadFrom(device, config_->Get<std::string>("dumpSource"));
+            scene              = Scene::LoadFromRAYVIS(device, file->Chunks());
             auto colorIterator = color::DefaultPalettIterator();
             scene.OverrideMeshColors([&itr = colorIterator](const Scene::Node* node) {
                 Float3 result = *itr;
@@ -266,18 +286,19 @@ void Renderer::LoadScene(bool dumpsourceChanged)
             }
             scene.RecalculateMinMax();
 
-            for (auto& trace : traces) {
-                trace.ScaleBy(currentSceneScale);
-            }
+            traces.ScaleBy(currentSceneScale);
         }
     } else {
         spdlog::info("Changing trace to {}", config_->Get<int32_t>("traceId"));
     }
 
-    RayTrace* trace = &traces[config_->Get<int32_t>("traceId")];
+    // Only the visualized trace is decoded, the previous one stays resident until the memory budget is exceeded
+    auto      nextTrace = traces.Get(config_->Get<int32_t>("traceId"));
+    RayTrace* trace     = nextTrace.get();
 
     // Create Volume Data
-    vProvider = std::make_unique<VolumeProvider>(device, trace);
+    vProvider   = std::make_unique<VolumeProvider>(device, trace);
+    activeTrace = std::move(nextTrace);
 
     vProvider->SetFilter(static_cast<RayFilter>(config_->Get<int>("volumeData.filter")));
     vProvider->SetChunkSize(config_->Get<int>("volumeData.chunkSize"));
@@ -285,6 +306,13 @@ void Renderer::LoadScene(bool dumpsourceChanged)
     const float                maxT    = config_->Get<float>("volumeData.maxT");
     const std::optional<float> maxTopt = (0 < maxT) ? std::optional(maxT) : std::nullopt;
     vProvider->SetMaxT(maxTopt);
+    vProvider->SetMissTolerance(config_->Get<float>("volumeData.missTolerance"));
+    vProvider->SetMemoryBudget(static_cast<size_t>(config_->Get<int>("volumeData.memoryBudget")) * 1024 * 1024);
+    vProvider->SetDirectionEncoding(config_->Get<bool>("volumeData.compactDirections")
+                                        ? VolumetricSampler::DirectionEncoding::Octahedral
+                                        : VolumetricSampler::DirectionEncoding::Exact);
+    vProvider->SetWorkerCount(config_->Get<int>("volumeData.workerThreads"));
+    vProvider->SetProgressive(config_->Get<bool>("volumeData.progressive"));
 
     vProvider->SetMinPointValue(config_->Get<float>("arrows.minVisualizationValue"));
     vProvider->SetMaxPointValue(config_->Get<float>("arrows.maxVisualizationValue"));
@@ -579,9 +607,19 @@ void Renderer::AdvanceFrame()
     } else {
         bool reInitScene = false;
         if (config_->Get<bool>("recalculateVolume")) {
-            WaitForGpuIdle();
-            vpFootprint = vProvider->ComputeData(copyQueue);
             config_->Set("recalculateVolume", false);
+            if (vProvider->NeedsSampling()) {
+                // Sampled in the background, the current volume is rendered until the new one is ready
+                vProvider->ComputeDataAsync();
+            } else {
+                WaitForGpuIdle();
+                vpFootprint = vProvider->ComputeData(copyQueue);
+                reInitScene = true;
+            }
+        }
+        if (vProvider->IsComputedDataReady()) {
+            WaitForGpuIdle();
+            vpFootprint = vProvider->FinishComputeData(copyQueue);
             reInitScene = true;
         }
 
@@ -589,7 +627,7 @@ void Renderer::AdvanceFrame()
         if (config_->IsAnyEntryModified({"rayMesh.maxT", "rayMesh.thickness", "rayMesh.stride", "rayMesh.filter"})) {
             WaitForGpuIdle();
             SimpleRayMeshGenerator::LineDescription desc;
-            desc.raytraces = &traces[config_->Get<int32_t>("traceId")];
+            desc.raytraces = activeTrace.get();
             desc.thickness = config_->Get<float>("rayMesh.thickness");
             desc.rayStride = config_->Get<int>("rayMesh.stride");
             desc.filter    = static_cast<RayFilter>(config_->Get<int>("rayMesh.filter"));
@@ -616,8 +654,13 @@ void Renderer::AdvanceFrame()
         }
     }
     if (config_->IsEntryModified("volumeData.missTolerance")) {
+        // Only the rays changing class are moved between the layers in the background, unless the trace has to be
+        // sampled again
+        vProvider->SetMissTolerance(config_->Get<float>("volumeData.missTolerance"));
         Ray::missTolerance = config_->Get<float>("volumeData.missTolerance");
-        vProvider->MarkDirty();
+        if (vProvider->NeedsMovingRays()) {
+            config_->SetValue("recalculateVolume", true);
+        }
     }
 }
 
@@ -645,9 +688,16 @@ void Renderer::RenderWindow()
                     std::getline(std::cin, fileName);
                     savePath = std::filesystem::path(savePath).concat(fileName).string();
                 }
+                dataformat::SaveOptions saveOptions;
+                saveOptions.compressionLevel = config_->Get<int>("export.compressionLevel");
+                saveOptions.workerThreads    = config_->Get<int>("export.workerThreads");
+                saveOptions.shuffleRays      = config_->Get<bool>("export.shuffleRays");
+                if (saveOptions.workerThreads == 0) {
+                    saveOptions.workerThreads = std::thread::hardware_concurrency();
+                }
                 bool sucess = false;
                 try {
-                    sucess = dataformat::SaveTo(savePath, traces, &scene);
+                    sucess = dataformat::SaveTo(savePath, traces, &scene, saveOptions);
                 } catch (rdf::ApiException& rdfExcep) {
                     spdlog::error("Saving Failed with rdf::ApiException: {}", rdfExcep.what());
                 } catch (std::runtime_error& e) {
@@ -718,9 +768,9 @@ void Renderer::RenderWindow()
             }
             scene.RecalculateMinMax();
 
-            for (auto& trace : traces) {
-                trace.ScaleBy(relativeScale);
-            }
+            // A running background job reads the rays
+            vProvider->CancelComputeData();
+            traces.ScaleBy(relativeScale);
 
             config_->Set<float>("sceneScale.current", uiScale);
         }
@@ -729,33 +779,40 @@ void Renderer::RenderWindow()
     }
 
     if (RememberingTreeNode("Volume Data", false)) {
-        if (vProvider->IsDirty()) {
+        if (vProvider->IsComputingData()) {
+            ImGui::SameLine();
+            ImGui::TextColored(ImVec4(1, 1, 0, 1), "(sampling)");
+        } else if (vProvider->IsDirty()) {
             ImGui::SameLine();
             ImGui::TextColored(ImVec4(1, 0, 0, 1), "(dirty)");
         }
         if (RememberingTreeNode("Statistics", false)) {
             ImGui::Text(fmt::format("Max VoxelRayCount: {:>6d}", vProvider->MaxRays()).c_str());
             ImGui::Text(fmt::format("Chunk Count:       {:>6d}", vpFootprint.chunkCount).c_str());
-            const auto chunkSizeCpu =
-                cube(vpFootprint.chunkSize) * (sizeof(VolumetricSampler::rdType) + sizeof(Float3)) +
-                sizeof(VolumetricSampler::ChunkData);
+            const auto chunkSizeCpu = vProvider->ChunkByteSize();
             ImGui::Text(fmt::format("Chunk Size CPU:    {}", formatBytes(chunkSizeCpu)).c_str());
             const auto chunkSizeGpu = cube(vpFootprint.chunkSize + 2) * sizeof(VolumetricSampler::rdType);
             ImGui::Text(fmt::format("Chunk Size GPU:    {}", formatBytes(chunkSizeGpu)).c_str());
-            ImGui::Text(
-                fmt::format("Volume Size CPU:   {}", formatBytes(chunkSizeCpu * vpFootprint.chunkCount)).c_str());
+            ImGui::Text(fmt::format("Volume Size CPU:   {}", formatBytes(vProvider->DataByteSize())).c_str());
+            ImGui::Text(fmt::format("  of it Pyramid:   {}", formatBytes(vProvider->PyramidByteSize())).c_str());
             ImGui::Text(
                 fmt::format("Volume Size GPU:   {}", formatBytes(chunkSizeGpu * vpFootprint.chunkCount)).c_str());
+            const auto& coverage = vProvider->GetCoverage();
+            ImGui::Text(fmt::format("Kept Chunks:       {:>6d}/{}", coverage.keptChunks, coverage.chunkCount).c_str());
+            ImGui::Text(fmt::format("Ray Coverage:      {:>6.1f}%", coverage.Ratio() * 100.f).c_str());
 
             ImGui::Spacing();
-            const auto threads = std::max(std::thread::hardware_concurrency(), 1U);
-            const auto recalcCpuChunkSize =
-                cube(vProvider->ChunkSize()) * (sizeof(VolumetricSampler::rdType) + sizeof(Float3) + sizeof(Double3)) +
-                sizeof(VolumetricSampler::ChunkData);
+            const int  configuredThreads = config_->Get<int>("volumeData.workerThreads");
+            const auto threads           = 0 < configuredThreads ? static_cast<unsigned>(configuredThreads)
+                                                                 : std::max(std::thread::hardware_concurrency(), 1U);
+            // The task memory already covers the slices of all threads
+            const auto recalcTaskSize = vProvider->TaskByteSize();
             ImGui::Text("Recalculation (estimates):");
             ImGui::Text(fmt::format("Thread count:      {:>6d}", threads).c_str());
-            ImGui::Text(fmt::format("Chunk Memory Size: {}", formatBytes(recalcCpuChunkSize)).c_str());
-            ImGui::Text(fmt::format("Total Memory Size: {}", formatBytes(recalcCpuChunkSize * threads)).c_str());
+            ImGui::Text(fmt::format("Chunk Memory Size: {}", formatBytes(chunkSizeCpu)).c_str());
+            ImGui::Text(fmt::format("Task Memory Size:  {}", formatBytes(recalcTaskSize)).c_str());
+            const auto recalcTotalSize = chunkSizeCpu * vpFootprint.chunkCount + recalcTaskSize;
+            ImGui::Text(fmt::format("Total Memory Size: {}", formatBytes(recalcTotalSize)).c_str());
 
             ImGui::TreePop();
         }
@@ -770,6 +827,10 @@ void Renderer::RenderWindow()
                     if (ImGui::Selectable(display_name(filter).c_str(), is_selected)) {
                         config_->Set<int>("volumeData.filter", n);
                         vProvider->SetFilter(filter);
+                        // The filter is composed from the sampled layers, which is fast enough to apply right away
+                        if (!vProvider->NeedsSampling()) {
+                            config_->SetValue("recalculateVolume", true);
+                        }
                     }
                     if (is_selected) {
                         ImGui::SetItemDefaultFocus();
@@ -822,12 +883,26 @@ void Renderer::RenderWindow()
             auto  params   = std::get<core::ConfigurationEntry::FloatParameters>(
                 config_->GetEntry("volumeData.cellSize").GetParameters());
 
-            if (ImGui::DragFloat(
-                    "VoxelSize", &cellSize, 1.f, params.min, params.max, "%.3f", ImGuiSliderFlags_AlwaysClamp))
-            {
+            bool changed = ImGui::DragFloat(
+                "VoxelSize", &cellSize, 1.f, params.min, params.max, "%.3f", ImGuiSliderFlags_AlwaysClamp);
+            ImGui::SameLine();
+            if (ImGui::Button("/2##cellSize")) {
+                cellSize = std::max(cellSize / 2.f, params.min);
+                changed  = true;
+            }
+            ImGui::SameLine();
+            if (ImGui::Button("x2##cellSize")) {
+                cellSize = std::min(cellSize * 2.f, params.max);
+                changed  = true;
+            }
+            if (changed) {
                 config_->SetValue("volumeData.cellSize", cellSize);
                 vProvider->SetCellSize(cellSize);
                 config_->SetValue("arrows.maxScale", vProvider->MaxPointScale());
+                // Power of two multiples of the sampled cell size are composed from the pyramid right away
+                if (!vProvider->NeedsSampling()) {
+                    config_->SetValue("recalculateVolume", true);
+                }
             }
         }
 
@@ -852,13 +927,35 @@ void Renderer::RenderWindow()
             }
         }
 
+        bool compactDirections = config_->Get<bool>("volumeData.compactDirections");
+        if (ImGui::Checkbox("Compact Directions", &compactDirections)) {
+            config_->Set("volumeData.compactDirections", compactDirections);
+            vProvider->SetDirectionEncoding(compactDirections ? VolumetricSampler::DirectionEncoding::Octahedral
+                                                              : VolumetricSampler::DirectionEncoding::Exact);
+        }
+        if (ImGui::IsItemHovered()) {
+            ImGui::BeginTooltip();
+            ImGui::Text("Stores the mean ray direction of each cell in two bytes instead of a Float3.");
+            ImGui::Text("The octahedral encoding is lossy, directions are up to 1 degree (0.34 on average) off.");
+            ImGui::EndTooltip();
+        }
+
+        bool progressive = config_->Get<bool>("volumeData.progressive");
+        if (ImGui::Checkbox("Progressive Preview", &progressive)) {
+            config_->Set("volumeData.progressive", progressive);
+            vProvider->SetProgressive(progressive);
+        }
+
         // Recalculate Button
         if (ImGui::Button("Recalculate")) {
             config_->SetValue("recalculateVolume", true);
         }
         ImGui::TreePop();
     } else {
-        if (vProvider->IsDirty()) {
+        if (vProvider->IsComputingData()) {
+            ImGui::SameLine();
+            ImGui::TextColored(ImVec4(1, 1, 0, 1), "(sampling)");
+        } else if (vProvider->IsDirty()) {
             ImGui::SameLine();
             ImGui::TextColored(ImVec4(1, 0, 0, 1), "(dirty)");
         }
@@ -966,7 +1063,7 @@ void Renderer::RenderWindow()
                 }
             }
 
-            const auto rayCount     = traces[config_->Get<int32_t>("traceId")].rays.size();
+            const auto rayCount     = activeTrace->rays.size();
             const auto rayMeshCount = rayCount / stride;
             ImGui::Text(fmt::format("Ray Count:        {:>12}", rayCount).c_str());
             ImGui::Text(fmt::format("Ray Mesh Count:   {:>12}", rayMeshCount).c_str());
@@ -1294,6 +1391,13 @@ void Renderer::RenderWindow()
                     config_->SetValue("debug.chunkCount", count);
                 }
                 ImGui::Text(fmt::format("Current ChunkCount: {}", vpFootprint.chunkCount).c_str());
+
+                bool scalarIntersection = config_->Get<bool>("debug.scalarIntersection");
+                if (ImGui::Checkbox("Scalar Intersection", &scalarIntersection)) {
+                    config_->Set<bool>("debug.scalarIntersection", scalarIntersection);
+                    SelectIntersectAABBKernel(scalarIntersection ? "scalar" : IntersectAABBKernels().back().name);
+                }
+                ImGui::Text(fmt::format("Intersection Kernel: {}", IntersectAABBKernelName()).c_str());
                 ImGui::TreePop();
             }
         }
@@ -1564,6 +1668,34 @@ void Renderer::SetConfigurationImpl(std::unique_ptr<core::IConfiguration>&& conf
                                 "maxT for volume Sampling",
                                 "maxT for volume Sampling (negative Values get treated as no limit)",
                                 floatParams);
+
+        intParams.min = 0;
+        intParams.max = 1024 * 1024;
+        configuration->Register("volumeData.memoryBudget",
+                                16 * 1024,
+                                "Volume Memory Budget (MB)",
+                                "Memory for sampled chunks, the chunks crossed by the fewest rays are dropped beyond "
+                                "it (0 is unlimited)",
+                                intParams);
+
+        configuration->Register("volumeData.compactDirections",
+                                true,
+                                "Compact Directions",
+                                "Store the mean ray direction of each cell in two bytes (octahedral, at most 1 "
+                                "degree off) instead of a Float3");
+        configuration->Register("volumeData.progressive",
+                                true,
+                                "Progressive Preview",
+                                "Show previews of 1% and 10% of the rays while sampling large traces, the final volume "
+                                "is the same");
+
+        intParams.min = 0;
+        intParams.max = 256;
+        configuration->Register("volumeData.workerThreads",
+                                0,
+                                "Sampler Threads",
+                                "Number of threads sampling the volume (0 uses all hardware threads)",
+                                intParams);
     }
 
     intParams.min = 0;
@@ -1628,6 +1760,27 @@ void Renderer::SetConfigurationImpl(std::unique_ptr<core::IConfiguration>&& conf
     configuration->Register(
         "recalculateVolume", false, "Recalculate Volume", "Sets flag to recalculate volume after next frame");
 
+    {  // export
+        intParams.min = 1;
+        intParams.max = 22;
+        configuration->Register("export.compressionLevel",
+                                3,
+                                "Export Compression Level",
+                                "zstd compression level used when saving .rayvis files",
+                                intParams);
+        intParams.min = 0;
+        intParams.max = 256;
+        configuration->Register("export.workerThreads",
+                                0,
+                                "Export Compression Threads",
+                                "Threads compressing saved .rayvis files (0 uses all hardware threads)",
+                                intParams);
+        configuration->Register("export.shuffleRays",
+                                true,
+                                "Export Shuffled Rays",
+                                "Regroup ray bytes before compression, smaller files that decode faster");
+    }
+
     {  // VolumeShader
         floatParams.format = "%0.3f";
         floatParams.min    = 0.f;
@@ -1687,13 +1840,20 @@ void Renderer::SetConfigurationImpl(std::unique_ptr<core::IConfiguration>&& conf
     intParams.min = 1;
     intParams.max = 128;
     configuration->Register("debug.chunkCount", 5, "Debug chunk count", "", intParams);
+    configuration->Register("debug.scalarIntersection",
+                            false,
+                            "Scalar Intersection",
+                            "Intersect the rays of the sampler with the scalar kernel instead of the SIMD kernel");
 
     config_ = std::move(configuration);
 
     Ray::missTolerance = config_->Get<float>("volumeData.missTolerance");
     if (vProvider != nullptr) {
-        vProvider->MarkDirty();
+        vProvider->SetMissTolerance(Ray::missTolerance);
     }
+
+    SelectIntersectAABBKernel(config_->Get<bool>("debug.scalarIntersection") ? "scalar"
+                                                                               : IntersectAABBKernels().back().name);
 }
 
 core::IConfiguration& Renderer::GetConfigurationImpl()
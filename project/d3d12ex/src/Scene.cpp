@@ -104,7 +104,11 @@ Scene Scene::LoadFromRAYVIS(ComPtr<ID3D12Device5> device, std::string filename,
     }
 
     auto chunkfile = rdf::ChunkFile(filename.c_str());
+    return LoadFromRAYVIS(device, chunkfile, chunkIdx);
+}
 
+Scene Scene::LoadFromRAYVIS(ComPtr<ID3D12Device5> device, rdf::ChunkFile& chunkfile, size_t chunkIdx)
+{
     if (chunkfile.GetChunkCount(SCENE_CHUNK_ID) <= chunkIdx) {
         throw std::runtime_error(fmt::format("Scene Loading: missing chunk with SCENE_CHUNK_ID at index {}", chunkIdx));
     }
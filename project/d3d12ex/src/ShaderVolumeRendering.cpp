@@ -38,7 +38,8 @@ VolumeShader::VolumeShader(ID3D12Device5*     device,
     descriptorTableLayout[0].DescriptorTable.pDescriptorRanges   = descriptorRange;
     descriptorTableLayout[0].ShaderVisibility                    = D3D12_SHADER_VISIBILITY_ALL;
 
-    auto textureArrayDecriptorRange                              = TextureBuffer::GetDescriptorRange(0, 0, 512);
+    // Unbounded, the table holds one texture per sampled chunk
+    auto textureArrayDecriptorRange                              = TextureBuffer::GetDescriptorRange(0, 0, UINT_MAX);
     textureArrayDecriptorRange.RegisterSpace                     = 1;
     descriptorTableLayout[1].ParameterType                       = D3D12_ROOT_PARAMETER_TYPE_DESCRIPTOR_TABLE;
     descriptorTableLayout[1].DescriptorTable.NumDescriptorRanges = 1;
@@ -134,6 +134,7 @@ VolumeProvider::VolumeProvider(ComPtr<ID3D12Device5> deviceIn, RayTrace* trace)
     : device(std::move(deviceIn)), sampler(std::make_unique<VolumetricSampler>(trace))
 {
     assert(sampler->ChunkSize() % pointSampleSize_ == 0);
+    sampler->SetMaxChunkCount(MaxChunkTextures);
 
     pointCloudScene_.meshes.push_back(std::move(ArrowCross(device)));
     assert(pointCloudScene_.meshes.size() == 1);
@@ -148,8 +149,32 @@ VolumeProviderFootPrint VolumeProvider::ComputeData(ComPtr<ID3D12CommandQueue> c
         RecalulatePointCloud();
         return lastFootprint;
     }
-    sampler->Sample();
+    if (sampler->IsDirty()) {
+        sampler->Sample();
+    }
+    return UploadData(copyQueue);
+}
+
+void VolumeProvider::ComputeDataAsync()
+{
+    sampler->SampleAsync();
+}
 
+VolumeProviderFootPrint VolumeProvider::FinishComputeData(ComPtr<ID3D12CommandQueue> copyQueue)
+{
+    if (!sampler->FinishSampleAsync()) {
+        return lastFootprint;
+    }
+    return UploadData(copyQueue);
+}
+
+void VolumeProvider::CancelComputeData()
+{
+    sampler->Cancel();
+}
+
+VolumeProviderFootPrint VolumeProvider::UploadData(ComPtr<ID3D12CommandQueue> copyQueue)
+{
     if (sampler->Data()->size() == 0) {
         HWND consoleWindow = GetConsoleWindow();
         SetForegroundWindow(consoleWindow);
@@ -171,6 +196,8 @@ VolumeProviderFootPrint VolumeProvider::ComputeData(ComPtr<ID3D12CommandQueue> c
     textures_.clear();
     textures_.reserve(data->size());
     for (const auto& vol : *data) {
+        const std::vector<VolumetricSampler::rdType> density = vol.rayDensity.ToDense();
+
         // Create padding outside of volume
         const uint32_t                         chunkSizeWithPadding = chunkSize + 2;
         std::vector<VolumetricSampler::rdType> textureData;
@@ -197,7 +224,8 @@ VolumeProviderFootPrint VolumeProvider::ComputeData(ComPtr<ID3D12CommandQueue> c
                     const size_t rY  = getValue(y) - 1;
                     const size_t rZ  = getValue(z) - 1;
                     const size_t idx = (z)*chunkSizeWithPadding * chunkSizeWithPadding + (y)*chunkSizeWithPadding + (x);
-                    VolumetricSampler::rdType value = vol.RayDenity(rX, rY, rZ) * (1.f / edgeNode);
+                    VolumetricSampler::rdType value =
+                        density[(rX * chunkSize + rY) * chunkSize + rZ] * (1.f / edgeNode);
 
                     // rescale data
                     if (0 < value) {
@@ -373,6 +401,34 @@ void VolumeProvider::SetMaxT(std::optional<float> maxT)
     sampler->SetMaxT(maxT);
 }
 
+void VolumeProvider::SetMissTolerance(const float missTolerance)
+{
+    dirty_ = true;
+    sampler->SetMissTolerance(missTolerance);
+}
+
+void VolumeProvider::SetMemoryBudget(const size_t memoryBudget)
+{
+    dirty_ = true;
+    sampler->SetMemoryBudget(memoryBudget);
+}
+
+void VolumeProvider::SetDirectionEncoding(const VolumetricSampler::DirectionEncoding encoding)
+{
+    dirty_ = true;
+    sampler->SetDirectionEncoding(encoding);
+}
+
+void VolumeProvider::SetWorkerCount(const size_t workerCount)
+{
+    sampler->SetWorkerCount(workerCount);
+}
+
+void VolumeProvider::SetProgressive(const bool progressive)
+{
+    sampler->SetProgressive(progressive);
+}
+
 void VolumeProvider::SetMinPointValue(float minPointValue)
 {
     pointCloudDirty_ = true;
@@ -433,7 +489,7 @@ void VolumeProvider::CreateChunkMinMaxSRV(ComPtr<ID3D12Device5> device, D3D12_CP
 const Descriptor VolumeProvider::CreateTextureArrayDesciptorArray(ComPtr<ID3D12Device5> device,
                                                                   DescriptorHeap*       descHeap)
 {
-    assert(textures_.size() <= 512);
+    assert(textures_.size() <= MaxChunkTextures);
     const Descriptor descriptorTable = descHeap->AllocateDescriptorTable(textures_.size());
     for (size_t i = 0; i < textures_.size(); i++) {
         textures_[i].CreateShaderResourceView(device, descHeap->GetResourceView(descriptorTable.cpu, i));
@@ -451,6 +507,7 @@ void VolumeProvider::DumpToCSV(std::string path)
     auto chunkSize     = sampler->ChunkSize();
     auto itmesPerChunk = chunkSize * chunkSize * chunkSize;
     for (const auto& data : *sampler->Data()) {
+        const auto density = data.rayDensity.ToDense();
         const auto extends = data.max - data.min;
         const auto step    = extends / chunkSize;
         for (size_t i = 0; i < itmesPerChunk; i++) {
@@ -461,7 +518,7 @@ void VolumeProvider::DumpToCSV(std::string path)
             const auto y  = data.min.y + iy * step.y;
             const auto z  = data.min.z + iz * step.z;
             auto       f  = fmt::format("{},{},{}\n", x, y, z);
-            if (0 < data.rayDensity[i]) {
+            if (0 < density[i]) {
                 dataStream << f;
                 dataPoints++;
             } else {
@@ -262,10 +262,12 @@ class WindowContext : public IWindowProc {
 int main(int argc, char* argv[])
 {
     const std::filesystem::path defaultConfigPath = GetExeDirectory() + "\\config.json";
-    std::filesystem::path           configPath        = defaultConfigPath;
-    std::string                     input             = "";
-    std::string                     shaderSource      = "";
-    bool                            enableExport      = false;
+    std::filesystem::path           configPath         = defaultConfigPath;
+    std::string                     input              = "";
+    std::string                     shaderSource       = "";
+    bool                            enableExport       = false;
+    int                             compressionLevel   = 0;
+    int                             compressionThreads = -1;
 
     CLI::App app{WINDOW_TITEL};
 
@@ -283,6 +285,12 @@ int main(int argc, char* argv[])
         ->check(CLI::ExistingDirectory);
 
     app.add_flag("--enableExport", enableExport, "Enables export of files. (consumes more memory)");
+    app.add_option("--compression-level", compressionLevel, "zstd compression level used for exported files.")
+        ->check(CLI::Range(1, 22));
+    app.add_option("--compression-threads",
+                   compressionThreads,
+                   "Number of threads compressing exported files (0 uses all hardware threads).")
+        ->check(CLI::Range(0, 256));
 
     CLI11_PARSE(app, argc, argv);
 
@@ -295,6 +303,20 @@ int main(int argc, char* argv[])
         config::EnableFileSave = enableExport;
         anyFlags               = true;
     }
+    if (0 < compressionLevel) {
+        flagInfo += fmt::format(
+            "\n\t--compression-level\t- export compression level set to {} (This will be saved to config)!",
+            compressionLevel);
+        optArgs.compressionLevel = compressionLevel;
+        anyFlags                 = true;
+    }
+    if (0 <= compressionThreads) {
+        flagInfo += fmt::format(
+            "\n\t--compression-threads\t- export compression threads set to {} (This will be saved to config)!",
+            compressionThreads);
+        optArgs.compressionThreads = compressionThreads;
+        anyFlags                   = true;
+    }
     if (!input.empty()) {
         flagInfo +=
             fmt::format("\n\t--input\t\t- input source overridden to \"{}\" (This will be saved to config)!", input);
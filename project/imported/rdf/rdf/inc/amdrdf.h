@@ -3,6 +3,7 @@
 
 #include <cstddef>
 #include <cstring>
+#include <exception>
 #include <functional>
 #include <memory>
 #include <stdexcept>
@@ -25,7 +26,7 @@
      (static_cast<std::uint32_t>(minor) << 12) | \
      (static_cast<std::uint32_t>(patch)))
 
-#define RDF_INTERFACE_VERSION RDF_MAKE_VERSION(1, 1, 2)
+#define RDF_INTERFACE_VERSION RDF_MAKE_VERSION(1, 2, 1)
 
 extern "C" {
 struct rdfChunkFile;
@@ -196,6 +197,26 @@ int RDF_EXPORT rdfChunkFileReadChunkData(rdfChunkFile* handle,
                                          const int chunkIndex,
                                          void* buffer);
 
+/**
+ * @brief Receives the data of a chunk block by block
+ * @return rdfResult, anything but `rdfResultOk` stops reading
+ *
+ * - `data` is only valid for the duration of the call
+ * - The provided context will be passed into `ctx`
+ *
+ * @since 1.2
+ */
+typedef int (*rdfChunkDataReadCallback)(void* ctx, const std::int64_t size, const void* data);
+
+/**
+ * @since 1.2
+ */
+int RDF_EXPORT rdfChunkFileReadChunkDataStreaming(rdfChunkFile* handle,
+                                                  const char* chunkId,
+                                                  const int chunkIndex,
+                                                  rdfChunkDataReadCallback callback,
+                                                  void* ctx);
+
 int RDF_EXPORT rdfChunkFileGetChunkHeaderSize(rdfChunkFile* handle,
                                               const char* chunkId,
                                               const int chunkIndex,
@@ -243,6 +264,13 @@ int RDF_EXPORT rdfChunkFileWriterCreate2(const rdfChunkFileWriterCreateInfo* inf
                                          rdfChunkFileWriter** writer);
 int RDF_EXPORT rdfChunkFileWriterDestroy(rdfChunkFileWriter** writer);
 
+/**
+ * @since 1.2
+ */
+int RDF_EXPORT rdfChunkFileWriterSetCompressionOptions(rdfChunkFileWriter* writer,
+                                                       const int compressionLevel,
+                                                       const int workerCount);
+
 int RDF_EXPORT rdfChunkFileWriterBeginChunk(rdfChunkFileWriter* writer,
                                             const rdfChunkCreateInfo* info);
 int RDF_EXPORT rdfChunkFileWriterAppendToChunk(rdfChunkFileWriter* writer,
@@ -504,6 +532,10 @@ class ChunkFileIterator final
     rdfChunkFileIterator* it_;
 };
 
+/**
+ * Chunks of one ChunkFile can be read from several threads at once. Reads of
+ * the underlying stream are serialized, decompression runs in parallel.
+ */
 class ChunkFile final
 {
 public:
@@ -585,6 +617,51 @@ class ChunkFile final
         readCallback(size, buffer.data());
     }
 
+    /**
+     * Read the chunk data block by block, the callback is invoked with every
+     * decoded block. Only a small window of the chunk is held in memory at a
+     * time. Exceptions thrown by the callback stop reading and are rethrown.
+     */
+    void ReadChunkDataStreaming(
+        const char* chunkId,
+        const int chunkIndex,
+        const std::function<void(const std::int64_t dataSize, const void* data)>& blockCallback)
+    {
+        struct Context
+        {
+            const std::function<void(const std::int64_t, const void*)>* callback;
+            std::exception_ptr error;
+        } context = {&blockCallback, nullptr};
+
+        const auto result = rdfChunkFileReadChunkDataStreaming(
+            chunkFile_,
+            chunkId,
+            chunkIndex,
+            [](void* ctx, const std::int64_t size, const void* data) -> int {
+                auto context = static_cast<Context*>(ctx);
+                try {
+                    (*context->callback)(size, data);
+                } catch (...) {
+                    context->error = std::current_exception();
+                    return rdfResultError;
+                }
+                return rdfResultOk;
+            },
+            &context);
+
+        if (context.error) {
+            std::rethrow_exception(context.error);
+        }
+        RDF_CHECK_CALL(result);
+    }
+
+    void ReadChunkDataStreaming(
+        const char* chunkId,
+        const std::function<void(const std::int64_t dataSize, const void* data)>& blockCallback)
+    {
+        ReadChunkDataStreaming(chunkId, 0, blockCallback);
+    }
+
     void ReadChunkHeaderToBuffer(const char* chunkId, const int chunkIndex, void* buffer)
     {
         RDF_CHECK_CALL(rdfChunkFileReadChunkHeader(chunkFile_, chunkId, chunkIndex, buffer));
@@ -712,6 +789,17 @@ class ChunkFileWriter final
     ChunkFileWriter(const ChunkFileWriter&) = delete;
     ChunkFileWriter& operator=(const ChunkFileWriter&) = delete;
 
+    /**
+     * Set the zstd compression level and the number of compression worker
+     * threads for all chunks begun afterwards (0 compresses on the calling
+     * thread).
+     */
+    void SetCompressionOptions(const int compressionLevel, const int workerCount)
+    {
+        RDF_CHECK_CALL(
+            rdfChunkFileWriterSetCompressionOptions(writer_, compressionLevel, workerCount));
+    }
+
     int WriteChunk(const char* chunkId,
                    const std::int64_t chunkHeaderSize,
                    const void* chunkHeader,
@@ -13,6 +13,7 @@
 // We use map so we don't have to provide a hash function for chunkId, which
 // is a bit tricky with C++11 and old compilers
 #include <map>
+#include <mutex>
 #include <vector>
 
 #if RDF_PLATFORM_UNIX
@@ -397,11 +398,10 @@ namespace internal
             const auto& entry = GetChunkInfo(chunkId, chunkIndex);
 
             assert(entry.chunkHeaderOffset >= 0);
-            stream_->Seek(entry.chunkHeaderOffset);
             assert(entry.chunkHeaderSize >= 0);
             if (entry.chunkHeaderSize > 0) {
                 // TODO Check error?
-                stream_->Read(entry.chunkHeaderSize, buffer);
+                ReadAt(entry.chunkHeaderOffset, entry.chunkHeaderSize, buffer);
             }
         }
 
@@ -410,22 +410,72 @@ namespace internal
             const auto& entry = GetChunkInfo(chunkId, chunkIndex);
 
             assert(entry.chunkDataOffset >= 0);
-            stream_->Seek(entry.chunkDataOffset);
-
             assert(entry.chunkDataSize >= 0);
             if (entry.compression == Compression::Zstd) {
-                std::vector<unsigned char> compressedData;
-                compressedData.resize(entry.chunkDataSize);
-
-                // TODO Check error?
-                stream_->Read(entry.chunkDataSize, compressedData.data());
                 assert(entry.uncompressedChunkSize >= 0);
-                ZSTD_decompress(buffer,
-                                entry.uncompressedChunkSize,
-                                compressedData.data(),
-                                compressedData.size());
+                // Decompress straight into the target buffer, so only a
+                // small window of the compressed data is held in memory
+                ZSTD_outBuffer output = {
+                    buffer, static_cast<size_t>(entry.uncompressedChunkSize), 0};
+                DecompressChunkData(entry, output, [](ZSTD_outBuffer&) -> int {
+                    throw std::runtime_error(
+                        "Decompressed chunk data exceeds the size stored in the index");
+                });
             } else if (entry.compression == Compression::None) {
-                stream_->Read(entry.chunkDataSize, buffer);
+                ReadAt(entry.chunkDataOffset, entry.chunkDataSize, buffer);
+            } else {
+                throw std::runtime_error("Unsupported compression algorithm");
+            }
+        }
+
+        /**
+        Read the data of a chunk block by block.
+
+        At most StreamingBlockSize bytes of compressed and uncompressed data
+        are held in memory at a time. The callback is invoked for every
+        decoded block, any result but rdfResultOk stops reading and is
+        returned.
+        */
+        int ReadChunkDataStreaming(const char* chunkId,
+                                   const int chunkIndex,
+                                   rdfChunkDataReadCallback callback,
+                                   void* ctx)
+        {
+            const auto& entry = GetChunkInfo(chunkId, chunkIndex);
+
+            assert(entry.chunkDataOffset >= 0);
+            assert(entry.chunkDataSize >= 0);
+            std::vector<unsigned char> block(StreamingBlockSize);
+            if (entry.compression == Compression::Zstd) {
+                ZSTD_outBuffer output = {block.data(), block.size(), 0};
+                int result = rdfResultOk;
+                DecompressChunkData(entry, output, [&](ZSTD_outBuffer& full) -> int {
+                    result = callback(ctx, static_cast<std::int64_t>(full.pos), full.dst);
+                    full.pos = 0;
+                    return result;
+                });
+                if (result == rdfResultOk && output.pos > 0) {
+                    result = callback(ctx, static_cast<std::int64_t>(output.pos), output.dst);
+                }
+                return result;
+            } else if (entry.compression == Compression::None) {
+                std::int64_t offset = entry.chunkDataOffset;
+                std::int64_t remaining = entry.chunkDataSize;
+                while (remaining > 0) {
+                    const auto blockSize =
+                        std::min(remaining, static_cast<std::int64_t>(block.size()));
+                    if (ReadAt(offset, blockSize, block.data()) != blockSize) {
+                        throw std::runtime_error("Error while reading chunk data");
+                    }
+                    offset += blockSize;
+                    remaining -= blockSize;
+
+                    const int result = callback(ctx, blockSize, block.data());
+                    if (result != rdfResultOk) {
+                        return result;
+                    }
+                }
+                return rdfResultOk;
             } else {
                 throw std::runtime_error("Unsupported compression algorithm");
             }
@@ -452,6 +502,92 @@ namespace internal
         }
 
     private:
+        static constexpr size_t StreamingBlockSize = 1 << 20;
+
+        /**
+        Read from an absolute position of the stream.
+
+        Seeking and reading happen under one lock, so chunks can be read from
+        several threads at once. Decompression runs outside of the lock.
+        */
+        std::int64_t ReadAt(const std::int64_t offset, const std::int64_t size, void* buffer)
+        {
+            std::lock_guard<std::mutex> lock(streamMutex_);
+            stream_->Seek(offset);
+            return stream_->Read(size, buffer);
+        }
+
+        /**
+        Decompress the zstd compressed data of a chunk, reading at most
+        StreamingBlockSize bytes of compressed data at a time.
+
+        Whenever the decoder has more data than fits into output, onOutputFull
+        is called and has to make room in output. Decompression stops early if
+        onOutputFull returns anything but rdfResultOk.
+        */
+        template <typename OutputFullCallback>
+        void DecompressChunkData(const IndexEntry& entry,
+                                 ZSTD_outBuffer& output,
+                                 OutputFullCallback&& onOutputFull)
+        {
+            if (entry.uncompressedChunkSize == 0) {
+                return;
+            }
+
+            std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx*)> context(ZSTD_createDCtx(),
+                                                                      &ZSTD_freeDCtx);
+            if (!context) {
+                throw std::runtime_error("Could not create zstd decompression context");
+            }
+
+            const auto decompress = [&](ZSTD_inBuffer& input) -> size_t {
+                const auto result = ZSTD_decompressStream(context.get(), &output, &input);
+                if (ZSTD_isError(result)) {
+                    throw std::runtime_error(std::string("Error while decompressing chunk data: ") +
+                                             ZSTD_getErrorName(result));
+                }
+                return result;
+            };
+
+            std::vector<unsigned char> inputWindow(
+                std::min(static_cast<std::int64_t>(StreamingBlockSize), entry.chunkDataSize));
+            std::int64_t offset = entry.chunkDataOffset;
+            std::int64_t remaining = entry.chunkDataSize;
+            // Non-zero until the frame has been decoded and flushed completely
+            size_t pending = 1;
+            while (remaining > 0) {
+                const auto readSize =
+                    std::min(remaining, static_cast<std::int64_t>(inputWindow.size()));
+                if (ReadAt(offset, readSize, inputWindow.data()) != readSize) {
+                    throw std::runtime_error("Error while reading chunk data");
+                }
+                offset += readSize;
+                remaining -= readSize;
+
+                ZSTD_inBuffer input = {inputWindow.data(), static_cast<size_t>(readSize), 0};
+                while (input.pos < input.size) {
+                    if (output.pos == output.size && onOutputFull(output) != rdfResultOk) {
+                        return;
+                    }
+                    pending = decompress(input);
+                }
+            }
+
+            // All compressed data was consumed, but the decoder may still
+            // hold decoded data that did not fit into output
+            while (pending != 0) {
+                if (output.pos == output.size && onOutputFull(output) != rdfResultOk) {
+                    return;
+                }
+                const auto previousPos = output.pos;
+                ZSTD_inBuffer input = {nullptr, 0, 0};
+                pending = decompress(input);
+                if (pending != 0 && output.pos == previousPos) {
+                    throw std::runtime_error("Compressed chunk data is truncated");
+                }
+            }
+        }
+
         void BuildChunkIndex()
         {
             // We stable-sort this by index name. This allows us to index
@@ -505,6 +641,8 @@ namespace internal
         // If we own the stream, this will be non-null
         std::unique_ptr<IStream> streamPointer_;
         IStream* stream_ = nullptr;
+        // Guards the stream position, see ReadAt
+        std::mutex streamMutex_;
 
         class ChunkFileIterator final : public IChunkFileIterator
         {
@@ -615,6 +753,10 @@ namespace internal
 
             currentChunk_->chunkDataOffset = dataWriteOffset_;
             assert(currentChunk_->chunkDataOffset >= 0);
+
+            if (compression != Compression::None) {
+                BeginCompression();
+            }
         }
 
         void AppendToChunk(const std::int64_t chunkDataSize, const void* chunkData)
@@ -626,10 +768,24 @@ namespace internal
             }
 
             if (currentChunk_->compression != Compression::None) {
-                chunkDataBuffer_.insert(
-                    chunkDataBuffer_.end(),
-                    static_cast<const unsigned char*>(chunkData),
-                    static_cast<const unsigned char*>(chunkData) + chunkDataSize);
+                currentChunk_->uncompressedChunkSize += chunkDataSize;
+                assert(currentChunk_->uncompressedChunkSize >= 0);
+
+                // Small appends are gathered, so the compressor is not invoked
+                // for every few bytes. Larger ones are compressed right away.
+                const auto size = static_cast<size_t>(chunkDataSize);
+                if (chunkDataBuffer_.size() + size > StreamingBlockSize) {
+                    CompressChunkData(chunkDataBuffer_.data(), chunkDataBuffer_.size(), ZSTD_e_continue);
+                    chunkDataBuffer_.clear();
+                }
+                if (size >= StreamingBlockSize) {
+                    CompressChunkData(chunkData, size, ZSTD_e_continue);
+                } else {
+                    chunkDataBuffer_.insert(
+                        chunkDataBuffer_.end(),
+                        static_cast<const unsigned char*>(chunkData),
+                        static_cast<const unsigned char*>(chunkData) + chunkDataSize);
+                }
             } else {
                 if (stream_->Write(chunkDataSize, chunkData) != chunkDataSize) {
                     throw std::runtime_error("Error while writing to file.");
@@ -642,22 +798,12 @@ namespace internal
         int EndChunk()
         {
             if (currentChunk_->compression != Compression::None) {
-                std::vector<unsigned char> buffer;
-                buffer.resize(ZSTD_compressBound(chunkDataBuffer_.size()));
+                // Compress what is left and close the zstd frame
+                CompressChunkData(chunkDataBuffer_.data(), chunkDataBuffer_.size(), ZSTD_e_end);
 
-                const auto compressedSize = ZSTD_compress(buffer.data(),
-                                                          buffer.size(),
-                                                          chunkDataBuffer_.data(),
-                                                          chunkDataBuffer_.size(),
-                                                          ZSTD_CLEVEL_DEFAULT);
-
-                currentChunk_->chunkDataSize = compressedSize;
+                assert(currentChunk_->chunkDataOffset >= 0);
+                currentChunk_->chunkDataSize = dataWriteOffset_ - currentChunk_->chunkDataOffset;
                 assert(currentChunk_->chunkDataSize >= 0);
-                currentChunk_->uncompressedChunkSize = chunkDataBuffer_.size();
-                assert(currentChunk_->uncompressedChunkSize >= 0);
-
-                stream_->Write(compressedSize, buffer.data());
-                dataWriteOffset_ += compressedSize;
             } else {
                 assert(currentChunk_->chunkDataOffset >= 0);
                 currentChunk_->chunkDataSize = dataWriteOffset_ - currentChunk_->chunkDataOffset;
@@ -694,6 +840,25 @@ namespace internal
             return EndChunk();
         }
 
+        /**
+        Set the zstd compression level and the number of worker threads used
+        for chunks begun afterwards. A worker count of 0 compresses on the
+        calling thread.
+        */
+        void SetCompressionOptions(const int compressionLevel, const int workerCount)
+        {
+            if (compressionLevel < ZSTD_minCLevel() || compressionLevel > ZSTD_maxCLevel()) {
+                throw std::runtime_error("Compression level is out of range");
+            }
+
+            if (workerCount < 0) {
+                throw std::runtime_error("Worker count must be positive or null");
+            }
+
+            compressionLevel_ = compressionLevel;
+            workerCount_ = workerCount;
+        }
+
         /**
         Flush all pending data and finalize the file.
 
@@ -715,6 +880,60 @@ namespace internal
         }
 
     private:
+        // Upper bound for the uncompressed data gathered before it is passed
+        // to the compressor
+        static constexpr size_t StreamingBlockSize = 1 << 20;
+
+        void BeginCompression()
+        {
+            if (!compressionContext_) {
+                compressionContext_.reset(ZSTD_createCCtx());
+                if (!compressionContext_) {
+                    throw std::runtime_error("Could not create zstd compression context");
+                }
+                compressedBuffer_.resize(ZSTD_CStreamOutSize());
+                chunkDataBuffer_.reserve(StreamingBlockSize);
+            }
+
+            ZSTD_CCtx_reset(compressionContext_.get(), ZSTD_reset_session_only);
+            ZSTD_CCtx_setParameter(
+                compressionContext_.get(), ZSTD_c_compressionLevel, compressionLevel_);
+
+            // Fails if zstd was built without multithreading support, in
+            // which case the chunk is compressed on the calling thread
+            ZSTD_CCtx_setParameter(compressionContext_.get(), ZSTD_c_nbWorkers, workerCount_);
+        }
+
+        /**
+        Feed data to the compressor and write all compressed data it emits to
+        the stream. With ZSTD_e_end, the frame of the current chunk is
+        finished and flushed completely.
+        */
+        void CompressChunkData(const void* data, const size_t size, const ZSTD_EndDirective mode)
+        {
+            ZSTD_inBuffer input = {data, size, 0};
+            bool finished = false;
+            while (!finished) {
+                ZSTD_outBuffer output = {compressedBuffer_.data(), compressedBuffer_.size(), 0};
+                const auto remaining =
+                    ZSTD_compressStream2(compressionContext_.get(), &output, &input, mode);
+                if (ZSTD_isError(remaining)) {
+                    throw std::runtime_error(std::string("Error while compressing chunk data: ") +
+                                             ZSTD_getErrorName(remaining));
+                }
+
+                const auto outputSize = static_cast<std::int64_t>(output.pos);
+                if (outputSize > 0) {
+                    if (stream_->Write(outputSize, output.dst) != outputSize) {
+                        throw std::runtime_error("Error while writing to file.");
+                    }
+                    dataWriteOffset_ += outputSize;
+                }
+
+                finished = (mode == ZSTD_e_end) ? (remaining == 0) : (input.pos == input.size);
+            }
+        }
+
         void Construct(bool append)
         {
             if (!stream_->CanWrite()) {
@@ -766,6 +985,11 @@ namespace internal
 
         std::vector<ChunkFile::IndexEntry> chunks_;
         std::vector<unsigned char> chunkDataBuffer_;
+        std::vector<unsigned char> compressedBuffer_;
+        std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx*)> compressionContext_{nullptr,
+                                                                               &ZSTD_freeCCtx};
+        int compressionLevel_ = ZSTD_CLEVEL_DEFAULT;
+        int workerCount_ = 0;
 
         std::map<ChunkId, int> chunkCountPerType_;
 
@@ -1648,6 +1872,38 @@ int RDF_EXPORT rdfChunkFileReadChunkData(rdfChunkFile* handle,
     RDF_C_API_END
 }
 
+//////////////////////////////////////////////////////////////////////////////
+/**
+Read the data stored in a chunk block by block.
+
+Unlike rdfChunkFileReadChunkData, the chunk is never held in memory as a
+whole, so chunks larger than the available memory can be processed. The
+callback is invoked with every decoded block. If it returns anything but
+rdfResultOk, reading stops and its result is returned.
+
+@since 1.2
+*/
+int RDF_EXPORT rdfChunkFileReadChunkDataStreaming(rdfChunkFile* handle,
+                                                  const char* chunkId,
+                                                  const int chunkIndex,
+                                                  rdfChunkDataReadCallback callback,
+                                                  void* ctx)
+{
+    RDF_C_API_BEGIN
+
+    if (handle == nullptr) {
+        return rdfResult::rdfResultInvalidArgument;
+    }
+
+    if (callback == nullptr) {
+        return rdfResult::rdfResultInvalidArgument;
+    }
+
+    return handle->chunkFile->ReadChunkDataStreaming(chunkId, chunkIndex, callback, ctx);
+
+    RDF_C_API_END
+}
+
 //////////////////////////////////////////////////////////////////////////////
 /**
 Read the chunk header into the provided buffer.
@@ -2012,6 +2268,37 @@ int RDF_EXPORT rdfChunkFileWriterCreate2(const rdfChunkFileWriterCreateInfo* inf
     RDF_C_API_END
 }
 
+//////////////////////////////////////////////////////////////////////////////
+/**
+Set the compression level and the number of compression worker threads.
+
+The options apply to all chunks begun after this call. The level must be in
+the range supported by zstd, a worker count of 0 compresses on the calling
+thread.
+
+@since 1.2
+*/
+int RDF_EXPORT rdfChunkFileWriterSetCompressionOptions(rdfChunkFileWriter* writer,
+                                                       const int compressionLevel,
+                                                       const int workerCount)
+{
+    RDF_C_API_BEGIN
+
+    if (writer == nullptr) {
+        return rdfResult::rdfResultInvalidArgument;
+    }
+
+    if (workerCount < 0) {
+        return rdfResult::rdfResultInvalidArgument;
+    }
+
+    writer->writer->SetCompressionOptions(compressionLevel, workerCount);
+
+    return rdfResult::rdfResultOk;
+
+    RDF_C_API_END
+}
+
 //////////////////////////////////////////////////////////////////////////////
 /**
 Destroy a chunk file writer.
@@ -4,6 +4,7 @@
 #include "amdrdf.h"
 
 #include <cstring>
+#include <thread>
 #include "test_rdf.h"
 
 
@@ -237,3 +238,173 @@ TEST_CASE("rdf::ChunkFileWriter append increments index", "[rdf]")
     CHECK(cf.ContainsChunk("chunk", 0));
     CHECK(cf.ContainsChunk("chunk", 1));
 }
+
+TEST_CASE("rdf::ChunkFile streaming read", "[rdf]")
+{
+    // Large enough to span multiple streaming blocks
+    std::vector<std::uint32_t> data(3 * 1024 * 1024 / sizeof(std::uint32_t) + 17);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<std::uint32_t>(i * 2654435761u);
+    }
+    const auto dataSize = static_cast<std::int64_t>(data.size() * sizeof(std::uint32_t));
+
+    auto ms = rdf::Stream::CreateMemoryStream();
+
+    {
+        rdf::ChunkFileWriter writer(ms);
+        writer.WriteChunk("zstd", 0, nullptr, dataSize, data.data(), rdfCompressionZstd);
+        writer.WriteChunk("none", 0, nullptr, dataSize, data.data(), rdfCompressionNone);
+        writer.WriteChunk("empty", 0, nullptr, 0, nullptr, rdfCompressionZstd);
+        writer.Close();
+    }
+
+    rdf::ChunkFile cf(ms);
+
+    for (const char* chunkId : {"zstd", "none"}) {
+        std::vector<unsigned char> result;
+        int blockCount = 0;
+        cf.ReadChunkDataStreaming(chunkId, [&](const std::int64_t size, const void* block) {
+            const auto bytes = static_cast<const unsigned char*>(block);
+            result.insert(result.end(), bytes, bytes + size);
+            ++blockCount;
+        });
+
+        CHECK(blockCount > 1);
+        REQUIRE(result.size() == static_cast<size_t>(dataSize));
+        CHECK(::memcmp(result.data(), data.data(), result.size()) == 0);
+    }
+
+    std::vector<std::uint32_t> buffer(data.size());
+    cf.ReadChunkDataToBuffer("zstd", buffer.data());
+    CHECK(buffer == data);
+
+    int emptyBlocks = 0;
+    cf.ReadChunkDataStreaming("empty", [&](const std::int64_t, const void*) { ++emptyBlocks; });
+    CHECK(emptyBlocks == 0);
+
+    CHECK_THROWS_AS(cf.ReadChunkDataStreaming(
+                        "zstd",
+                        [](const std::int64_t, const void*) { throw std::logic_error("stop"); }),
+                    std::logic_error);
+}
+
+TEST_CASE("rdf::ChunkFileWriter streaming compression", "[rdf]")
+{
+    std::vector<std::uint64_t> data(512 * 1024);
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = i / 3;
+    }
+    const auto dataSize = static_cast<std::int64_t>(data.size() * sizeof(std::uint64_t));
+
+    auto ms = rdf::Stream::CreateMemoryStream();
+
+    {
+        rdf::ChunkFileWriter writer(ms);
+
+        // Many small appends and a single large one must produce the same data
+        writer.BeginChunk("small", 0, nullptr, rdfCompressionZstd);
+        for (const auto& value : data) {
+            writer.AppendToChunk(value);
+        }
+        writer.EndChunk();
+
+        writer.BeginChunk("large", 0, nullptr, rdfCompressionZstd);
+        writer.AppendToChunk(dataSize, data.data());
+        writer.EndChunk();
+        writer.Close();
+    }
+
+    rdf::ChunkFile cf(ms);
+
+    for (const char* chunkId : {"small", "large"}) {
+        REQUIRE(cf.GetChunkDataSize(chunkId) == dataSize);
+
+        std::vector<std::uint64_t> result(data.size());
+        cf.ReadChunkDataToBuffer(chunkId, result.data());
+        CHECK(result == data);
+    }
+}
+
+TEST_CASE("rdf::ChunkFileWriter compression options", "[rdf]")
+{
+    std::vector<std::uint32_t> data(4 * 1024 * 1024 / sizeof(std::uint32_t));
+    for (size_t i = 0; i < data.size(); ++i) {
+        data[i] = static_cast<std::uint32_t>((i * 7) % 1021);
+    }
+    const auto dataSize = static_cast<std::int64_t>(data.size() * sizeof(std::uint32_t));
+
+    auto ms = rdf::Stream::CreateMemoryStream();
+
+    {
+        rdf::ChunkFileWriter writer(ms);
+        CHECK_THROWS_AS(writer.SetCompressionOptions(1000, 0), rdf::ApiException);
+        CHECK_THROWS_AS(writer.SetCompressionOptions(3, -1), rdf::ApiException);
+
+        writer.SetCompressionOptions(1, 0);
+        writer.WriteChunk("fast", 0, nullptr, dataSize, data.data(), rdfCompressionZstd);
+        writer.SetCompressionOptions(9, 4);
+        writer.WriteChunk("threaded", 0, nullptr, dataSize, data.data(), rdfCompressionZstd);
+        writer.Close();
+    }
+
+    rdf::ChunkFile cf(ms);
+
+    for (const char* chunkId : {"fast", "threaded"}) {
+        std::vector<std::uint32_t> result(data.size());
+        cf.ReadChunkDataToBuffer(chunkId, result.data());
+        CHECK(result == data);
+    }
+}
+
+TEST_CASE("rdf::ChunkFile concurrent reads", "[rdf]")
+{
+    const int chunkCount = 16;
+    std::vector<std::vector<std::uint32_t>> data(chunkCount);
+    for (int c = 0; c < chunkCount; ++c) {
+        data[c].resize(3 * 1024 * 1024 / sizeof(std::uint32_t));
+        for (size_t i = 0; i < data[c].size(); ++i) {
+            data[c][i] = static_cast<std::uint32_t>((i * (c + 3)) % 4099);
+        }
+    }
+
+    auto ms = rdf::Stream::CreateMemoryStream();
+
+    {
+        rdf::ChunkFileWriter writer(ms);
+        for (int c = 0; c < chunkCount; ++c) {
+            const auto compression = (c % 2) ? rdfCompressionZstd : rdfCompressionNone;
+            writer.WriteChunk("chunk",
+                              sizeof(c),
+                              &c,
+                              data[c].size() * sizeof(std::uint32_t),
+                              data[c].data(),
+                              compression);
+        }
+        writer.Close();
+    }
+
+    rdf::ChunkFile cf(ms);
+
+    std::vector<int> matches(chunkCount, 0);
+    {
+        std::vector<std::thread> threads;
+        for (int t = 0; t < 4; ++t) {
+            threads.emplace_back([&, t]() {
+                for (int c = t; c < chunkCount; c += 4) {
+                    int header = -1;
+                    cf.ReadChunkHeaderToBuffer("chunk", c, &header);
+                    std::vector<std::uint32_t> result(data[c].size());
+                    cf.ReadChunkDataToBuffer("chunk", c, result.data());
+                    matches[c] = (header == c) && (result == data[c]);
+                }
+            });
+        }
+        for (auto& thread : threads) {
+            thread.join();
+        }
+    }
+
+    for (int c = 0; c < chunkCount; ++c) {
+        CHECK(matches[c] == 1);
+    }
+}
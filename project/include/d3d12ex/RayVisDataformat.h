@@ -1,15 +1,23 @@
 /* Copyright (c) 2023 Pirmin Pfeifer */
 #pragma once
 #include <Scene.h>
-#include <rayloader/RayTrace.h>
+#include <rayloader/TraceCollection.h>
 
-#include <span>
 #include <string>
 
 namespace dataformat {
     constexpr const char* EXTENSION = ".rayvis";
 
-    bool SaveTo(std::string path, std::span<const RayTrace>, const Scene*);
+    struct SaveOptions {
+        int  compressionLevel = 3;     /// zstd compression level
+        int  workerThreads    = 0;     /// zstd compression threads (0 compresses on the saving thread)
+        bool shuffleRays      = true;  /// Apply RayBlockTransform::Shuffle to the rays before compression
+    };
+
+    /// Traces that are not resident are decoded one after another while saving
+    bool SaveTo(std::string path, rayloader::TraceCollection&, const Scene*, const SaveOptions& options = {});
 
     bool CheckPathForVaildFile(std::string path);
+    /// Checks the scene and trace chunks of an opened file, only its chunk index is used
+    bool Validate(const rayloader::RayVisFile& file);
 }  // namespace dataformat
\ No newline at end of file
@@ -23,18 +23,21 @@
 using Microsoft::WRL::ComPtr;
 
 struct optionalRenderArgs {
-    std::optional<std::string> source       = std::nullopt;
-    std::optional<std::string> shaderSource = std::nullopt;
+    std::optional<std::string> source             = std::nullopt;
+    std::optional<std::string> shaderSource       = std::nullopt;
+    std::optional<int>         compressionLevel   = std::nullopt;
+    std::optional<int>         compressionThreads = std::nullopt;
 };
 
 class Renderer : public IUiWindow, public core::IConfigurationComponent {
     static constexpr int FenceSignalled   = 1;
     static constexpr int FenceUnsignalled = 0;
 
-    Clock                 clock;
-    Camera                camera;
-    rayloader::Loader     loader;
-    std::vector<RayTrace> traces;
+    Clock                      clock;
+    Camera                     camera;
+    rayloader::Loader          loader;
+    rayloader::TraceCollection traces;
+    std::shared_ptr<RayTrace>  activeTrace;
 
     HWND                    hwnd = nullptr;
     ComPtr<ID3D12Device5>   device;
@@ -47,6 +47,7 @@ class Scene {
 
     static Scene LoadFrom(ComPtr<ID3D12Device5> device, std::string path);
     static Scene LoadFromRAYVIS(ComPtr<ID3D12Device5> device, std::string path, size_t chunkIdx = 0);
+    static Scene LoadFromRAYVIS(ComPtr<ID3D12Device5> device, rdf::ChunkFile& chunkfile, size_t chunkIdx = 0);
 
     void SaveTo(rdf::ChunkFileWriter& writer) const;
 
@@ -16,14 +16,39 @@ struct VolumeProviderFootPrint {
 
 class VolumeProvider {
 public:
+    /// Volume textures are bound as one descriptor table, it has to fit into the resource heap next to the other views
+    static constexpr size_t MaxChunkTextures = 1 << 15;
+
     VolumeProvider(ComPtr<ID3D12Device5> device, RayTrace* trace);
 
     VolumeProviderFootPrint ComputeData(ComPtr<ID3D12CommandQueue> copyQueue);
 
+    /// Starts sampling on a background thread, the current textures stay valid until FinishComputeData
+    void ComputeDataAsync();
+    /// Uploads the volume of the finished background job, the GPU must not use the current textures anymore
+    VolumeProviderFootPrint FinishComputeData(ComPtr<ID3D12CommandQueue> copyQueue);
+    void                    CancelComputeData();
+
+    inline bool IsComputingData()
+    {
+        return sampler->IsSampling();
+    }
+
+    /// The background job finished and FinishComputeData can upload its volume
+    inline bool IsComputedDataReady()
+    {
+        return sampler->IsSampleReady();
+    }
+
     void SetFilter(const RayFilter filter);
     void SetChunkSize(const size_t chunkSize);
     void SetCellSize(float cellSize);
     void SetMaxT(std::optional<float> maxT);
+    void SetMissTolerance(const float missTolerance);
+    void SetMemoryBudget(const size_t memoryBudget);
+    void SetDirectionEncoding(const VolumetricSampler::DirectionEncoding encoding);
+    void SetWorkerCount(const size_t workerCount);
+    void SetProgressive(const bool progressive);
 
     void SetMinPointValue(float minPointValue);
     void SetMaxPointValue(float maxPointValue);
@@ -37,10 +62,24 @@ class VolumeProvider {
         return dirty_;
     }
 
+    /// Cancels a running background job, as it would still use the old state
     inline void MarkDirty() {
+        sampler->MarkDirty();
         dirty_ = true;
     }
 
+    /// The rays have to be sampled again, otherwise ComputeData only composes and uploads the volume
+    inline bool NeedsSampling()
+    {
+        return sampler->IsDirty();
+    }
+
+    /// Only the rays changing class after a miss tolerance change have to be moved, which ComputeDataAsync does
+    inline bool NeedsMovingRays()
+    {
+        return sampler->IsMovePending();
+    }
+
     inline bool IsPointCloudDirty()
     {
         return pointCloudDirty_ || dirty_;
@@ -81,6 +120,31 @@ class VolumeProvider {
         return sampler->ChunkCount();
     }
 
+    inline size_t ChunkByteSize()
+    {
+        return sampler->ChunkByteSize();
+    }
+
+    inline size_t DataByteSize()
+    {
+        return sampler->DataByteSize();
+    }
+
+    inline size_t PyramidByteSize()
+    {
+        return sampler->PyramidByteSize();
+    }
+
+    inline size_t TaskByteSize()
+    {
+        return sampler->TaskByteSize();
+    }
+
+    inline const VolumetricSampler::Coverage& GetCoverage()
+    {
+        return sampler->GetCoverage();
+    }
+
     inline size_t PointSampleSize()
     {
         return pointSampleSize_;
@@ -109,6 +173,7 @@ class VolumeProvider {
     void DumpToCSV(std::string path);
 
 private:
+    VolumeProviderFootPrint UploadData(ComPtr<ID3D12CommandQueue> copyQueue);
     void                    RecalulatePointCloud();
     VolumeProviderFootPrint lastFootprint;
 
@@ -2,6 +2,7 @@
 #pragma once
 #include <configuration/Configuration.h>
 #include <rayloader/CacheManager.h>
+#include <rayloader/TraceCollection.h>
 
 namespace rayloader {
     class Loader : public core::IConfigurationComponent {
@@ -9,13 +10,22 @@ namespace rayloader {
         Loader();
         Loader(std::unique_ptr<core::IConfiguration>&& configuration);
 
-        std::vector<RayTrace>    Load(const char* filename);
+        /// Decodes all traces of the file
+        std::vector<RayTrace> Load(const char* filename);
+        /// Only reads the chunk index, rays are decoded on first access of a trace
+        TraceCollection Open(const char* filename);
+        /// Shares the chunk index of an already opened file
+        TraceCollection Open(std::shared_ptr<RayVisFile> file);
+
         std::vector<std::string> GetAvailableConfigurationKeys() const override;
 
     private:
         void                  SetConfigurationImpl(std::unique_ptr<core::IConfiguration>&& configuration) override;
         core::IConfiguration& GetConfigurationImpl() override;
         std::vector<RayTrace> LoadFromRAYVIS(const char* filename);
+        TraceCollection       OpenRAYVIS(std::shared_ptr<RayVisFile> file);
+        size_t                WorkerThreadCount() const;
+        size_t                MemoryBudget() const;
 
         std::unique_ptr<core::IConfiguration> config_;
         std::unique_ptr<CacheManager>         cache_;
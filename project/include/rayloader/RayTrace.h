@@ -4,12 +4,52 @@
 #include <rayvis-utils/MathUtils.h>
 #include <amdrdf.h>
 
-static constexpr std::uint32_t RAY_TRACE_VERSION   = 1;
+#include <functional>
+#include <limits>
+#include <optional>
+#include <utility>
+#include <vector>
+
+/// Version 1: all rays of a trace in the data of the RAY_TRACE_CHUNK_ID chunk
+/// Version 2: rays split into RAY_BLOCK_CHUNK_ID chunks, the RAY_TRACE_CHUNK_ID chunk holds the block index
+static constexpr std::uint32_t RAY_TRACE_VERSION   = 2;
 static constexpr const char*   RAY_TRACE_CHUNK_ID  = "RAYVIS_RAYTRACE";
+static constexpr const char*   RAY_BLOCK_CHUNK_ID  = "RAYVIS_RAYBLOCK";
 static constexpr const char*   RAY_TRACE_EXTENSION = ".trace";
+static constexpr size_t        RAY_BLOCK_RAY_COUNT = 1 << 16;
+
+struct RayTraceHeaderV1 final {
+    std::uint32_t traceId;
+};
 
 struct RayTraceHeader final {
     std::uint32_t traceId;
+    std::uint32_t blockCount;
+    std::uint64_t rayCount;
+};
+
+/// Entry of the block index of a version 2 trace
+struct RayBlockInfo final {
+    std::uint64_t firstRay;  /// Index of the first ray of the block in the trace
+    std::uint32_t rayCount;
+    std::uint32_t chunkIdx;  /// Index of the RAY_BLOCK_CHUNK_ID chunk holding the rays
+    Float3        min;       /// Bounds of the [tMin, tMax] segments of all rays in the block
+    Float3        max;
+};
+
+/// Transform applied to the rays of a block before compression
+enum class RayBlockTransform : std::uint32_t {
+    None = 0,
+    /// Ids and hit indices are delta coded against the previous ray, then the bytes of all rays are regrouped by
+    /// their offset inside Ray. Every float lands next to the same byte of the same field of its neighbours, which
+    /// zstd compresses a lot better than interleaved rays.
+    Shuffle = 1,
+};
+
+/// Optional header of a RAY_BLOCK_CHUNK_ID chunk, blocks without header are stored untransformed
+struct RayBlockHeader final {
+    RayBlockTransform transform;
+    std::uint32_t     reserved;
 };
 
 enum class RayFilter : uint8_t {
@@ -39,12 +79,28 @@ struct Ray final {
 
     inline bool HasHit() const
     {
-        return (0 <= tHit) && (tHit < (tMax - missTolerance));
+        return HasHit(missTolerance);
+    }
+
+    inline bool HasHit(const float tolerance) const
+    {
+        return tolerance < HitMargin();
+    }
+
+    /// Distance from tHit to tMax, the ray hits for every tolerance below it. -infinity for rays without hit.
+    inline float HitMargin() const
+    {
+        return 0 <= tHit ? tMax - tHit : -std::numeric_limits<float>::infinity();
     }
 
     inline float tHitOrTMax() const
     {
-        return HasHit() ? tHit : tMax;
+        return tHitOrTMax(missTolerance);
+    }
+
+    inline float tHitOrTMax(const float tolerance) const
+    {
+        return HasHit(tolerance) ? tHit : tMax;
     }
 };
 
@@ -56,11 +112,38 @@ class RayTrace final {
 
     Float2 MinMaxTHit();
 
+    /// Rays ordered by Ray::HitMargin, rayByHitMargin[i] has the margin hitMargins[i]. As a ray hits for every
+    /// tolerance below its margin, the rays changing class between two tolerances are a contiguous range.
+    std::vector<std::uint32_t> rayByHitMargin;
+    std::vector<float>         hitMargins;
+
+    /// Builds rayByHitMargin and hitMargins, ScaleBy keeps them up to date once they were built
+    void SortHitMargins();
+    inline bool HasHitMargins() const
+    {
+        return !rays.empty() && hitMargins.size() == rays.size();
+    }
+    /// Range [first, last) of rayByHitMargin with rays hitting for only one of the tolerances
+    std::pair<size_t, size_t> HitMarginRange(const float toleranceA, const float toleranceB) const;
+
+    /// Blocks of version 2 traces are decoded in parallel
     static bool LoadFrom(const char* filename, RayTrace& target, const size_t chunkIdx = 0);
+    static bool LoadFromParallel(rdf::ChunkFile& file, RayTrace& target, const size_t chunkIdx = 0);
     static bool LoadFrom(rdf::ChunkFile& file, RayTrace& target, const size_t chunkIdx = 0);
-
-    bool        Save(const char* filename, bool overrideFile = true) const;
-    bool        Save(rdf::ChunkFileWriter& writer) const;
+    /// Only loads blocks accepted by blockFilter, version 1 traces have no blocks and are loaded completely
+    static bool LoadFrom(rdf::ChunkFile&                                 file,
+                         RayTrace&                                       target,
+                         const size_t                                    chunkIdx,
+                         const std::function<bool(const RayBlockInfo&)>& blockFilter);
+
+    /// Header of any trace version, for version 1 traces blockCount is 0 and rayCount is taken from the chunk size
+    static std::optional<RayTraceHeader> ReadHeader(rdf::ChunkFile& file, const size_t chunkIdx = 0);
+    /// Block index of a version 2 trace
+    static bool ReadBlockIndex(rdf::ChunkFile& file, const size_t chunkIdx, std::vector<RayBlockInfo>& blocks);
+    static bool LoadBlock(rdf::ChunkFile& file, const RayBlockInfo& block, Ray* target);
+
+    bool Save(const char* filename, bool overrideFile = true) const;
+    bool Save(rdf::ChunkFileWriter& writer, const RayBlockTransform transform = RayBlockTransform::Shuffle) const;
 
 
     void DumpStartEndPointsToCSV(std::string path) const;
@@ -0,0 +1,33 @@
+/* Copyright (c) 2023 Pirmin Pfeifer */
+#pragma once
+#include <amdrdf.h>
+
+#include <memory>
+#include <string>
+
+namespace rayloader {
+    /// Open session of a .rayvis file.
+    /// The chunk index is parsed once on opening and shared by validation, the scene and all trace readers.
+    /// Chunks can be read from several threads at once, rdf::ChunkFile serializes the reads of its stream.
+    class RayVisFile final {
+    public:
+        /// Throws if the file does not exist or is no rdf chunk file
+        static std::shared_ptr<RayVisFile> Open(const std::string& path);
+
+        RayVisFile(const RayVisFile&)            = delete;
+        RayVisFile& operator=(const RayVisFile&) = delete;
+
+        const std::string&    Path() const;
+        rdf::ChunkFile&       Chunks();
+        const rdf::ChunkFile& Chunks() const;
+
+        /// Checks version and header size of all trace chunks, only the chunk index is used
+        bool ValidateTraces() const;
+
+    private:
+        explicit RayVisFile(const std::string& path);
+
+        std::string    path_;
+        rdf::ChunkFile chunkfile_;
+    };
+}  // namespace rayloader
@@ -0,0 +1,65 @@
+/* Copyright (c) 2023 Pirmin Pfeifer */
+#pragma once
+#include <rayloader/RayTrace.h>
+#include <rayloader/RayVisFile.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace rayloader {
+    /// Index entry of a trace stored in a .rayvis file, read without decoding any rays
+    struct TraceInfo final {
+        std::uint32_t traceId;
+        size_t        chunkIdx;  /// Index of the RAY_TRACE_CHUNK_ID chunk holding the trace
+        size_t        rayCount;
+        std::int64_t  byteSize;  /// Size of the decoded rays
+    };
+
+    /// Handles to all traces of a .rayvis file, sorted by traceId.
+    /// Rays are decoded on first access and the least recently used traces are evicted once the resident traces
+    /// exceed the memory budget. Traces returned by Get stay valid as long as the caller holds on to them.
+    /// The file stays open while the collection exists, all traces are read through its shared chunk index.
+    /// The collection itself is not thread safe, it has to be used from one thread at a time. The traces returned by
+    /// Get can be read from any thread, as can the RayVisFile shared with other readers.
+    class TraceCollection final {
+    public:
+        static constexpr size_t UnlimitedMemoryBudget = 0;
+
+        TraceCollection() = default;
+        TraceCollection(std::shared_ptr<RayVisFile> file, std::vector<TraceInfo> infos, size_t memoryBudget);
+
+        std::shared_ptr<RayTrace> Get(const size_t idx);
+        const TraceInfo&          Info(const size_t idx) const;
+
+        size_t size() const;
+        bool   empty() const;
+
+        bool   IsResident(const size_t idx) const;
+        size_t ResidentBytes() const;
+        void   SetMemoryBudget(const size_t memoryBudget);
+
+        /// Scales all resident traces and every trace decoded later on
+        void ScaleBy(const float& scale);
+
+        const std::string& SourcePath() const;
+
+    private:
+        struct Entry final {
+            TraceInfo                 info;
+            std::shared_ptr<RayTrace> resident;
+            std::weak_ptr<RayTrace>   alive;  /// Still set after eviction while a caller holds the trace
+            std::uint64_t             lastAccess = 0;
+        };
+
+        void MakeResident(Entry& entry, std::shared_ptr<RayTrace> trace);
+        void EvictLeastRecentlyUsed(const size_t keepIdx);
+
+        std::shared_ptr<RayVisFile> file_;
+        std::vector<Entry>          entries_;
+        size_t                      memoryBudget_  = UnlimitedMemoryBudget;
+        size_t                      residentBytes_ = 0;
+        std::uint64_t               accessCount_   = 0;
+        float                       scale_         = 1.f;
+    };
+}  // namespace rayloader
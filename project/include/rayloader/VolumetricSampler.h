@@ -2,12 +2,39 @@
 #pragma once
 
 #include <rayloader/RayTrace.h>
+#include <rayvis-utils/BrickGrid.h>
 #include <rayvis-utils/CpuRaytracing.h>
+#include <rayvis-utils/TaskPool.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <stop_token>
+#include <thread>
+#include <utility>
 
 class VolumetricSampler {
 public:
     typedef uint16_t rdType;
 
+    using PackedDirection = linalg::vec<int8_t, 2>;
+
+    /// Storage of the mean ray direction of each cell
+    enum class DirectionEncoding {
+        Exact,       /// Float3 per cell, summed in double precision
+        Octahedral,  /// Two bytes per cell, see PackDirection. Summed in float
+    };
+
+    /// Octahedral encoding of a unit direction in two bytes. The decoded direction is at most 1 degree off, 0.34
+    /// degrees on average over uniformly distributed directions.
+    static PackedDirection PackDirection(const Float3& direction);
+    static Float3          UnpackDirection(const PackedDirection& packed);
+
     struct Footprint {
         float  cellSize;
         size_t chunkSize;
@@ -18,45 +45,166 @@ class VolumetricSampler {
         rdType              maxRays;
         Float3              min;
         Float3              max;
-        std::vector<rdType> rayDensity;
-        std::vector<Float3> directions;
         size_t              chunkSize;
 
+        /// Bricks are allocated once a ray crosses them, ToDense exports the chunkSize^3 array
+        BrickGrid<rdType>          rayDensity;
+        BrickGrid<Float3>          directions;        /// DirectionEncoding::Exact
+        BrickGrid<PackedDirection> packedDirections;  /// DirectionEncoding::Octahedral
+
         const rdType& RayDenity(const size_t& x, const size_t& y, const size_t& z) const;
-        const Float3& Directions(const size_t& x, const size_t& y, const size_t& z) const;
+        Float3        Directions(const size_t& x, const size_t& y, const size_t& z) const;
+        /// Memory of the allocated bricks
+        size_t ByteSize() const;
 
         size_t rayCount   = 0;
+        /// Composed from a pyramid level only the rays crossing one of the merged chunks are known, the rays crossing
+        /// the chunk are a lower bound and missedRays is an upper bound
         size_t missedRays = 0;
     };
 
+    /// Hitting and missing rays are summed into separate layers of a chunk, the filter only selects the layers the
+    /// exported ChunkData is composed of. Each layer only allocates the bricks its rays cross, a brick crossed by
+    /// hitting and missing rays is held twice. The memory budget charges the bricks of every layer.
+    static constexpr size_t HitLayer   = 0;
+    static constexpr size_t MissLayer  = 1;
+    static constexpr size_t LayerCount = 2;
+
+    /// Unnormalized sum of the directions of the rays crossing a cell
+    struct CellSum {
+        Float3   direction = Float3(0.f);
+        uint32_t rays      = 0;
+    };
+
+    /// On pyramid levels rays is a lower bound, the most rays crossing one of the merged chunks, and missedRays is 0
+    struct ChunkLayer {
+        BrickGrid<CellSum> cells;
+        size_t             rays       = 0;  /// Rays of the layer binned to the chunk
+        size_t             missedRays = 0;  /// Binned rays that miss the chunk bounds
+    };
+
+    struct ChunkSums {
+        Int3                               chunkIdx;
+        Float3                             min;
+        Float3                             max;
+        std::array<ChunkLayer, LayerCount> layers;
+
+        size_t ByteSize() const;
+    };
+
+    /// Share of the traversed volume that was kept within the chunk budget
+    struct Coverage {
+        size_t chunkCount    = 0;  /// Chunks crossed by at least one ray
+        size_t keptChunks    = 0;
+        size_t crossings     = 0;  /// Ray chunk crossings of all crossed chunks
+        size_t keptCrossings = 0;
+
+        float Ratio() const;
+    };
+
+    static constexpr size_t UnlimitedMemoryBudget = 0;
+
+    /// The sampled layers are level 0 of a pyramid, level i sums 2^3 cells of level i - 1 into one cell of twice the
+    /// size. Power of two multiples of the sampled cell size are composed from the pyramid without sampling again, on
+    /// the chunk grid sampling at that cell size uses. A ray crossing several of the summed cells counts once for each
+    /// of them, so the densities of a level exceed the ones of sampling at its cell size.
+    static constexpr size_t PyramidLevels = 4;
+
     VolumetricSampler() = default;
 
+    VolumetricSampler(const VolumetricSampler&)            = delete;
+    VolumetricSampler& operator=(const VolumetricSampler&) = delete;
+
     VolumetricSampler(RayTrace*            trace,
                       const size_t         chunkSize = 128,
                       float                cellSize  = 100,
                       std::optional<float> maxT      = 50000)
         : trace(trace), chunkSize_(chunkSize), cellSize_(cellSize), maxT_(maxT){};
 
+    /// Composes the volume of the filter from the sampled layers, the rays are not sampled again
     void SetFilter(const RayFilter filter);
     void SetChunkSize(const size_t chunkSize);
+    /// Up to 2^(PyramidLevels - 1) times the sampled cell size is served from the pyramid, any other size is sampled
     void SetCellSize(float cellSize);
     void SetMaxT(std::optional<float> maxT);
+    /// Rays changing class are moved between the hit and miss layers by the next Sample or background job, only they
+    /// are traced again. When too many rays change class, the trace is sampled again. The first change sorts the hit
+    /// margins of the trace, see RayTrace::SortHitMargins.
+    void SetMissTolerance(const float missTolerance);
+
+    /// Chunks are dropped, starting with the ones crossed by the fewest rays, once their data exceeds the budget
+    void SetMemoryBudget(const size_t memoryBudget);
+    void SetMaxChunkCount(const size_t maxChunkCount);
+    void SetDirectionEncoding(const DirectionEncoding encoding);
+    /// Threads sampling the volume, 0 uses all hardware threads
+    void SetWorkerCount(const size_t workerCount);
+    /// Background jobs on large traces first trace a stratified 1% and 10% of the rays and publish a preview of each
+    /// pass with densities scaled to the whole trace. The final volume is identical to a single pass. The memory
+    /// budget keeps the same chunks for both, when it has no room left for the sums of every chunk kept from pass to
+    /// pass the job samples in a single pass without previews.
+    void SetProgressive(const bool progressive);
+
+    /// Memory of the layers and the exported data of a single chunk with all bricks allocated, which counts both
+    /// layers in full. The budget charges chunks for the bricks the rays of each layer occupy once this dense size
+    /// does not fit.
+    size_t ChunkByteSize() const;
+    /// Memory of the layers, the pyramid and the exported data of all chunks
+    size_t DataByteSize() const;
+    /// Memory of the pyramid levels above the sampled layers
+    size_t PyramidByteSize() const;
+    /// Upper bound of the memory the chunk tasks of a sampling run keep while summing up directions, this grows with
+    /// the worker count and for progressive runs with the number of chunks
+    size_t TaskByteSize() const;
 
     void Sample();
+    /// Forces the next Sample, for changes of the trace the sampler can not see
+    void MarkDirty();
+
+    /// Samples on a background thread, the current volume stays available until FinishSampleAsync swaps in the new
+    /// one. A job that is still running is cancelled first, every setter cancels it as well.
+    void SampleAsync();
+    /// Stops the background job and waits for it, its volume is discarded. Returns how long the job took to stop.
+    std::chrono::microseconds Cancel();
+    /// Takes over the volume of a completed background job or the latest preview of a progressive one, false if
+    /// there is none. The sampler stays dirty until the job completed.
+    bool FinishSampleAsync();
+
+    inline bool IsSampling() const
+    {
+        return job_.joinable() && !jobDone_;
+    }
+
+    /// A background job completed or published a preview, which waits for FinishSampleAsync
+    inline bool IsSampleReady() const
+    {
+        return job_.joinable() && (jobDone_ || previewReady_);
+    }
 
     inline Footprint GetFootprint()
     {
-        return {cellSize_, chunkSize_};
+        return {CellSize(), chunkSize_};
     }
 
     inline const std::vector<ChunkData>* Data()
     {
-        return &data_;
+        return &volume_.chunks;
     }
 
-    inline bool IsDirty()
+    /// The trace has to be sampled again or rays have to be moved between the layers
+    inline bool IsDirty() const
     {
-        return dirty_;
+        return dirty_ || IsMovePending();
+    }
+
+    /// Rays changing class after SetMissTolerance wait to be moved, or a background job is moving them
+    inline bool IsMovePending() const
+    {
+        return !dirty_ && (moveJob_ || layers_.missTolerance != missTolerance_);
+    }
+
+    inline DirectionEncoding GetDirectionEncoding()
+    {
+        return directionEncoding_;
     }
 
     inline RayFilter GetFilter()
@@ -71,7 +219,7 @@ class VolumetricSampler {
 
     inline float CellSize()
     {
-        return cellSize_;
+        return cellSize_ * static_cast<float>(1 << level_);
     }
 
     inline std::optional<float> MaxT()
@@ -80,36 +228,190 @@ class VolumetricSampler {
     }
 
     inline rdType MaxRays() {
-        return maxRays_;
+        return volume_.maxRays;
     }
 
     inline Float3 MinBounds()
     {
-        return min_;
+        return volume_.min;
     }
 
     inline Float3 MaxBounds()
     {
-        return max_;
+        return volume_.max;
     }
 
     inline size_t ChunkCount()
     {
-        return data_.size();
+        return volume_.chunks.size();
+    }
+
+    inline const Coverage& GetCoverage()
+    {
+        return layers_.coverage;
     }
 
 private:
+    /// Result of a sampling run, all rays are sampled independent of the filter
+    struct Layers {
+        std::vector<ChunkSums>         chunks;
+        Float3                         origin;  /// Chunk (0, 0, 0) starts here
+        std::array<size_t, LayerCount> rayCount = {};  /// Rays of the trace in each layer
+        Coverage                       coverage;
+
+        std::array<std::vector<ChunkSums>, PyramidLevels - 1> pyramid;  /// Levels 1 and above
+
+        float densityScale  = 1.f;  /// Scales the densities of a preview to the whole trace
+        float missTolerance = 0.f;  /// Tolerance the rays were classified into the layers with
+    };
+
+    using Preview = std::function<void(std::unique_ptr<Layers>)>;
+
+    /// Bricks the cells of a chunk occupy in each layer and in any of them, the exported grids hold the latter
+    struct ChunkBricks {
+        std::array<size_t, LayerCount> layers  = {};
+        std::array<size_t, LayerCount> pyramid = {};  /// Bricks on all pyramid levels above the layer
+        size_t                         any     = 0;
+    };
+
+    /// Cells of a chunk that changed after it was composed
+    struct TouchedChunk {
+        size_t            chunk;  /// Index into its level
+        std::vector<Int3> cells;
+    };
+
+    /// Data exported for the filter
+    struct Volume {
+        std::vector<ChunkData> chunks;
+        rdType                 maxRays = 0;
+        Float3                 min;
+        Float3                 max;
+
+        /// Recomputes maxRays and the bounds from the chunks
+        void UpdateBounds();
+    };
+
+    TaskPool& Pool();
+    /// Workers of the pool, also before it is created
+    size_t    WorkerCount() const;
+
+    /// Chunks that fit into the memory budget and the chunk count limit with all their bricks allocated, the budget
+    /// covers the sums of the tasks of a single pass too
+    size_t      ChunkLimit() const;
+    /// Memory of a chunk occupying bricks, including its share of the pyramid
+    size_t      ChunkByteSize(const ChunkBricks& bricks) const;
+    ChunkBricks DenseBricks() const;
+    /// Memory of the sums of a slice of a chunk task with all bricks allocated
+    size_t      SliceByteSize() const;
+    /// Upper bound of the memory the slices of a sampling run of chunkCount chunks keep
+    size_t      StagingByteSize(const size_t chunkCount) const;
+    /// Memory the budget leaves for new chunks next to the layers, the volume and the task sums
+    size_t      FreeByteSize(const Layers& layers) const;
+    ChunkSums   MakeChunk(const Int3& chunkIdx, const Float3& origin, const size_t level = 0) const;
+
+    /// Samples the trace with the current parameters into layers, returns false once stop was requested. Only reads
+    /// the parameters, so it can run on the background job while the previous layers are still in use. With a
+    /// preview callback large traces are sampled progressively.
+    bool Sample(Layers& layers, const std::stop_token& stop, const Preview& preview = {}) const;
+
+    /// Step 4 of Sample, sums the chunks of each level into the next one. Skipped for odd chunk sizes.
+    void BuildPyramid(Layers& layers, const std::stop_token& stop) const;
+    /// Sums the touched cells of each level into the next one again
+    void UpdatePyramid(Layers& layers, std::vector<TouchedChunk> touched) const;
+
+    /// Exports the layers of the current pyramid level selected by the filter into volume_
+    void Compose();
+    /// Layers selected by the filter and the number of rays in them
+    std::pair<std::vector<size_t>, size_t> IncludedLayers() const;
+    /// Exports the included layers of sums into chunk, returns the number of cells whose ray count was clamped
+    size_t ComposeChunk(const ChunkSums&           sums,
+                        const std::vector<size_t>& included,
+                        const size_t               rayCount,
+                        ChunkData&                 chunk) const;
+
+    /// Removes the rays from the layer of the tolerance the layers were classified with and adds them to the one of
+    /// the current tolerance. Returns false if stop was requested before the layers changed.
+    template <typename Sum>
+    bool MoveRays(Layers& layers, const std::span<const uint32_t> movedRays, const std::stop_token& stop) const;
+    /// Rays changing class since the layers were classified, nullopt if there are none or sampling again is cheaper
+    std::optional<std::span<const uint32_t>> MovedRays() const;
+    /// Removes the segments of removedRays with removeTolerance from the layers and adds the ones of addedRays with
+    /// the current tolerance. New chunks are created on the grid of the layers while the memory budget allows. All
+    /// rays are traced before the first chunk changes, once stop is requested meanwhile the layers are left
+    /// unchanged and nullopt is returned.
+    template <typename Sum>
+    std::optional<std::vector<TouchedChunk>> UpdateChunks(Layers&                         layers,
+                                                          const std::span<const Ray>      rays,
+                                                          const std::span<const uint32_t> removedRays,
+                                                          const float                     removeTolerance,
+                                                          const std::span<const uint32_t> addedRays,
+                                                          const std::stop_token&          stop) const;
+
+    /// Clips the rays to the chunk and calls visit(layer, ray, segment) for each of them, with the segment in cells
+    /// relative to chunkMin or nullptr for rays missing the chunk. The layer is classified by missTolerance. Stops
+    /// early once stop is requested.
+    template <typename Visitor>
+    void ForEachSegment(const Float3&                   chunkMin,
+                        const Float3&                   chunkMax,
+                        const std::span<const Ray>      rays,
+                        const std::span<const uint32_t> rayIndices,
+                        const std::stop_token&          stop,
+                        const float                     missTolerance,
+                        Visitor&&                       visit) const;
+    /// Bricks the rays would occupy in the layers of the chunk, without allocating its cells
+    ChunkBricks CountBricks(const Int3&                     chunkIdx,
+                            const Float3&                   origin,
+                            const std::span<const Ray>      rays,
+                            const std::span<const uint32_t> rayIndices) const;
+    /// Traces the rays into the layers of the task sums, classified by missTolerance. Stops early once stop is
+    /// requested.
+    template <typename Sums>
+    void TraceRays(const ChunkSums&                task,
+                   const std::span<const Ray>      rays,
+                   const std::span<const uint32_t> rayIndices,
+                   Sums&                           sums,
+                   const std::stop_token&          stop,
+                   const float                     missTolerance) const;
+
+    /// Step 3 of Sample, fills every chunk from its rays. The chunks are processed in parallel when there are enough
+    /// of them, otherwise the rays of each chunk are split across threads. The rays are traced in passes, pass i ends
+    /// at passEnds[chunk][i] of the rays of a chunk. After every pass but the last, preview is called with a copy of
+    /// the chunks holding the sums so far. progress is reported per traced ray slice, the number of slices is
+    /// returned.
+    template <typename Sum>
+    size_t FillChunks(std::vector<ChunkSums>&                                      chunks,
+                      const std::span<const Ray>                                   rays,
+                      const std::vector<std::vector<std::uint32_t>>&               taskRays,
+                      const std::vector<std::vector<size_t>>&                      passEnds,
+                      const std::function<void(size_t, std::vector<ChunkSums>&&)>& preview,
+                      const TaskPool::Progress&                                    progress,
+                      const std::stop_token&                                       stop) const;
+
     bool dirty_ = true;
 
-    RayFilter            filter_        = RayFilter::IncludeAllRays;
-    size_t               chunkSize_     = 0;
-    float                cellSize_      = 0;
-    std::optional<float> maxT_          = std::nullopt;
-    const RayTrace*      trace;
+    RayTrace*            trace              = nullptr;
+    RayFilter            filter_            = RayFilter::IncludeAllRays;
+    size_t               chunkSize_         = 0;
+    float                cellSize_          = 0;  /// Cell size of the sampled layers
+    size_t               level_             = 0;  /// Pyramid level the volume is composed from
+    std::optional<float> maxT_              = std::nullopt;
+    float                missTolerance_     = Ray::missTolerance;
+    size_t               memoryBudget_      = UnlimitedMemoryBudget;
+    size_t               maxChunkCount_     = std::numeric_limits<size_t>::max();
+    DirectionEncoding    directionEncoding_ = DirectionEncoding::Octahedral;
+    size_t               workerCount_       = 0;
+    bool                 progressive_       = false;
+
+    std::unique_ptr<TaskPool> pool_;
 
-    rdType maxRays_ = 0;
-    Float3 min_;
-    Float3 max_;
+    Layers layers_;
+    Volume volume_;
 
-    std::vector<ChunkData> data_;
+    std::unique_ptr<Layers> jobLayers_;  /// Set by the background job once it completed
+    bool                    moveJob_ = false;  /// The background job moves rays and owns the layers meanwhile
+    std::atomic_bool        jobDone_ = false;
+    std::mutex              previewMutex_;
+    std::unique_ptr<Layers> jobPreview_;  /// Latest preview of a progressive background job
+    std::atomic_bool        previewReady_ = false;
+    std::jthread            job_;  /// Declared last, so it is joined before the members it uses are destroyed
 };
@@ -0,0 +1,163 @@
+/* Copyright (c) 2023 Pirmin Pfeifer */
+#pragma once
+#include <rayvis-utils/MathTypes.h>
+
+#include <array>
+#include <bit>
+#include <cassert>
+#include <memory>
+#include <vector>
+
+/// Cube of size^3 cells stored as BrickSize^3 bricks. A brick is allocated and zero filled when one of its cells is
+/// written for the first time, unallocated bricks read as T(). Cells are indexed x-major like a dense
+/// x * size * size + y * size + z array, ToDense exports exactly that layout.
+template <typename T>
+class BrickGrid final {
+public:
+    static constexpr size_t BrickSize      = 8;
+    static constexpr size_t BrickCellCount = BrickSize * BrickSize * BrickSize;
+    using Brick                            = std::array<T, BrickCellCount>;
+
+    BrickGrid() = default;
+    explicit BrickGrid(const size_t size)
+        : size_(size),
+          bricksPerAxis_((size + BrickSize - 1) / BrickSize),
+          bricks_(bricksPerAxis_ * bricksPerAxis_ * bricksPerAxis_),
+          occupancy_((bricks_.size() + 63) / 64, 0)
+    {
+    }
+
+    inline T& At(const Int3& cell)
+    {
+        assert(Contains(cell));
+        const size_t brickIdx = BrickIndex(cell);
+        auto&        brick    = bricks_[brickIdx];
+        if (!brick) {
+            brick = std::make_unique<Brick>();
+            occupancy_[brickIdx / 64] |= uint64_t(1) << (brickIdx % 64);
+            occupiedBricks_++;
+        }
+        return (*brick)[CellIndex(cell)];
+    }
+
+    inline const T& Get(const Int3& cell) const
+    {
+        static const T empty = T();
+        assert(Contains(cell));
+        const auto& brick = bricks_[BrickIndex(cell)];
+        return brick ? (*brick)[CellIndex(cell)] : empty;
+    }
+
+    /// Visits the cells of all allocated bricks as visit(const Int3& cell, const T& value)
+    template <typename Visitor>
+    void ForEachOccupied(Visitor&& visit) const
+    {
+        for (size_t word = 0; word < occupancy_.size(); word++) {
+            for (uint64_t bits = occupancy_[word]; bits != 0; bits &= bits - 1) {
+                const size_t brickIdx = word * 64 + std::countr_zero(bits);
+                const Int3   base     = BrickBase(brickIdx);
+                const Brick& brick    = *bricks_[brickIdx];
+                for (size_t i = 0; i < BrickCellCount; i++) {
+                    const Int3 cell =
+                        base + Int3(i / (BrickSize * BrickSize), (i / BrickSize) % BrickSize, i % BrickSize);
+                    if (Contains(cell)) {
+                        visit(cell, brick[i]);
+                    }
+                }
+            }
+        }
+    }
+
+    std::vector<T> ToDense() const
+    {
+        std::vector<T> dense(size_ * size_ * size_);
+        ForEachOccupied([&dense, size = size_](const Int3& cell, const T& value) {
+            dense[(cell.x * size + cell.y) * size + cell.z] = value;
+        });
+        return dense;
+    }
+
+    inline bool empty() const
+    {
+        return size_ == 0;
+    }
+
+    inline size_t Size() const
+    {
+        return size_;
+    }
+
+    inline size_t BrickCount() const
+    {
+        return bricks_.size();
+    }
+
+    inline size_t OccupiedBricks() const
+    {
+        return occupiedBricks_;
+    }
+
+    /// One bit per brick, set once the brick is allocated
+    inline const std::vector<uint64_t>& OccupancyMask() const
+    {
+        return occupancy_;
+    }
+
+    inline size_t ByteSize() const
+    {
+        return occupiedBricks_ * sizeof(Brick) + bricks_.size() * sizeof(std::unique_ptr<Brick>) +
+               occupancy_.size() * sizeof(uint64_t);
+    }
+
+    /// Bricks of a grid of size^3 cells
+    static size_t BricksFor(const size_t size)
+    {
+        const size_t bricksPerAxis = (size + BrickSize - 1) / BrickSize;
+        return bricksPerAxis * bricksPerAxis * bricksPerAxis;
+    }
+
+    /// Memory of a grid with occupiedBricks bricks allocated
+    static size_t ByteSize(const size_t size, const size_t occupiedBricks)
+    {
+        const size_t brickCount = BricksFor(size);
+        return occupiedBricks * sizeof(Brick) + brickCount * sizeof(std::unique_ptr<Brick>) +
+               (brickCount + 63) / 64 * sizeof(uint64_t);
+    }
+
+    /// Memory of a grid with all bricks allocated
+    static size_t DenseByteSize(const size_t size)
+    {
+        return ByteSize(size, BricksFor(size));
+    }
+
+private:
+    inline bool Contains(const Int3& cell) const
+    {
+        return 0 <= cell.x && 0 <= cell.y && 0 <= cell.z && static_cast<size_t>(cell.x) < size_ &&
+               static_cast<size_t>(cell.y) < size_ && static_cast<size_t>(cell.z) < size_;
+    }
+
+    inline size_t BrickIndex(const Int3& cell) const
+    {
+        return ((cell.x / BrickSize) * bricksPerAxis_ + cell.y / BrickSize) * bricksPerAxis_ + cell.z / BrickSize;
+    }
+
+    static inline size_t CellIndex(const Int3& cell)
+    {
+        return ((cell.x % BrickSize) * BrickSize + cell.y % BrickSize) * BrickSize + cell.z % BrickSize;
+    }
+
+    inline Int3 BrickBase(const size_t brickIdx) const
+    {
+        return Int3(brickIdx / (bricksPerAxis_ * bricksPerAxis_),
+                    (brickIdx / bricksPerAxis_) % bricksPerAxis_,
+                    brickIdx % bricksPerAxis_) *
+               static_cast<int32_t>(BrickSize);
+    }
+
+    size_t                              size_           = 0;
+    size_t                              bricksPerAxis_  = 0;
+    size_t                              occupiedBricks_ = 0;
+    std::vector<std::unique_ptr<Brick>> bricks_;
+    std::vector<uint64_t>               occupancy_;
+};
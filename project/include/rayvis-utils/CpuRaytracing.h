@@ -2,6 +2,10 @@
 #pragma once
 #include "rayvis-utils/MathTypes.h"
 
+#include <cstdint>
+#include <span>
+#include <string_view>
+
 inline bool HitAABB(const Float2& minMaxT, const float& tMax)
 {
     const bool missed     = minMaxT.y < minMaxT.x;
@@ -22,4 +26,63 @@ inline Float2 IntersectAABB(const Float3& rayOrigin, const Float3& rayDir, const
     const auto tNear       = linalg::maxelem(t1);
     const auto tFar        = linalg::minelem(t2);
     return Float2(tNear, tFar);
-}
\ No newline at end of file
+}
+
+/// Rays in structure of arrays form, intersected RayPacket::Width at a time
+struct RayPacket {
+    static constexpr size_t Width = 16;
+
+    alignas(64) float originX[Width];
+    alignas(64) float originY[Width];
+    alignas(64) float originZ[Width];
+    alignas(64) float dirX[Width];
+    alignas(64) float dirY[Width];
+    alignas(64) float dirZ[Width];
+    alignas(64) float tMax[Width];
+
+    inline void Set(const size_t lane, const Float3& origin, const Float3& dir, const float maxT)
+    {
+        originX[lane] = origin.x;
+        originY[lane] = origin.y;
+        originZ[lane] = origin.z;
+        dirX[lane]    = dir.x;
+        dirY[lane]    = dir.y;
+        dirZ[lane]    = dir.z;
+        tMax[lane]    = maxT;
+    }
+};
+
+struct RayPacketHits {
+    alignas(64) float tNear[RayPacket::Width];
+    alignas(64) float tFar[RayPacket::Width];
+    std::uint32_t     hitMask = 0;  /// Bit i is set if lane i passes HitAABB
+
+    inline Float2 MinMax(const size_t lane) const
+    {
+        return Float2(tNear[lane], tFar[lane]);
+    }
+
+    inline bool Hit(const size_t lane) const
+    {
+        return (hitMask >> lane) & 1;
+    }
+};
+
+/// IntersectAABB and HitAABB of the first count rays of the packet against one box.
+/// The results match the scalar functions bit for bit. The widest kernel the CPU supports is used by default.
+void IntersectAABB(
+    const RayPacket& rays, const size_t count, const Float3& boxMin, const Float3& boxMax, RayPacketHits& hits);
+
+struct IntersectAABBKernel {
+    void (*intersect)(const RayPacket&, const size_t, const Float3&, const Float3&, RayPacketHits&);
+    const char* name;
+};
+
+/// Packet kernels the CPU supports, starting with the scalar fallback and ending with the widest SIMD kernel
+std::span<const IntersectAABBKernel> IntersectAABBKernels();
+
+/// Makes the packet version of IntersectAABB use the kernel of this name, returns false if the CPU does not support it
+bool SelectIntersectAABBKernel(const std::string_view name);
+
+/// Name of the kernel used by the packet version of IntersectAABB
+const char* IntersectAABBKernelName();
@@ -1,90 +1,81 @@
+/* Copyright (c) 2023 Pirmin Pfeifer */
 #pragma once
 #include <rayvis-utils/MathTypes.h>
 
-// https://stackoverflow.com/a/38552664
-void VoxelTrace(Double3 start, Double3 end, std::function<void(const Int3& voxel)> processVoxel)
-{
-#define SIGN(x) (x > 0 ? 1 : (x < 0 ? -1 : 0))
-#define FRAC0(x) (x - floor(x))
-#define FRAC1(x) (1 - x + floor(x))
-
-    double tMaxX, tMaxY, tMaxZ, tDeltaX, tDeltaY, tDeltaZ;
-    Int3  voxel;
+#include <cassert>
+#include <cmath>
+#include <type_traits>
 
-    double x1, y1, z1;  // start point
-    double x2, y2, z2;  // end point
-    x1 = start.x;
-    x2 = end.x;
-    y1 = start.y;
-    y2 = end.y;
-    z1 = start.z;
-    z2 = end.z;
+/// Line segment in voxel space, used by VoxelTraceBatch
+template <typename T>
+struct VoxelSegment {
+    linalg::vec<T, 3> start;
+    linalg::vec<T, 3> end;
+};
 
-    int dx = SIGN(x2 - x1);
-    if (dx != 0) {
-        tDeltaX = fmin(dx / (x2 - x1), 10000000.0);
-    } else {
-        tDeltaX = 10000000.0;
-    }
-    if (dx > 0) {
-        tMaxX = tDeltaX * FRAC1(x1);
-    } else {
-        tMaxX = tDeltaX * FRAC0(x1);
-    }
-    voxel.x = (int)x1;
+/// 3D-DDA from start to end in voxel space, based on https://stackoverflow.com/a/38552664.
+/// Visits the voxel of start and every voxel entered while the segment is still inside all slabs of the
+/// current voxel. The voxel holding end is only visited if the segment starts in it, callers that need it
+/// have to handle it themselves. A segment parallel to an axis that starts on a voxel boundary of that axis visits
+/// the voxel of start twice, as the baseline traversal did. Both points are expected to be non negative.
+/// The visitor is called with the Int3 voxel index, it is a template parameter so the calls can be inlined.
+template <typename T, typename Visitor>
+inline void VoxelTrace(const linalg::vec<T, 3>& start, const linalg::vec<T, 3>& end, Visitor&& visit)
+{
+    static_assert(std::is_floating_point_v<T>);
+    constexpr T maxDelta = T(10000000.0);
 
-    int dy = SIGN(y2 - y1);
-    if (dy != 0) {
-        tDeltaY = fmin(dy / (y2 - y1), 10000000.0);
-    } else {
-        tDeltaY = 10000000.0;
-    }
-    if (dy > 0) {
-        tMaxY = tDeltaY * FRAC1(y1);
-    } else {
-        tMaxY = tDeltaY * FRAC0(y1);
+    Int3 voxel;
+    Int3 step;
+    T    tMax[3];
+    T    tDelta[3];
+    for (int axis = 0; axis < 3; axis++) {
+        const T from     = start[axis];
+        const T distance = end[axis] - from;
+        assert(0 <= from);
+        step[axis]  = (distance > 0) - (distance < 0);
+        voxel[axis] = static_cast<int32_t>(from);
+        tDelta[axis] = step[axis] != 0 ? std::fmin(step[axis] / distance, maxDelta) : maxDelta;
+        tMax[axis]   = tDelta[axis] * (0 < step[axis] ? (T(1) - from) + std::floor(from) : from - std::floor(from));
     }
-    voxel.y = (int)y1;
 
-    int dz = SIGN(z2 - z1);
-    if (dz != 0) {
-        tDeltaZ = fmin(dz / (z2 - z1), 10000000.0);
-    } else {
-        tDeltaZ = 10000000.0;
-    }
-    if (dz > 0) {
-        tMaxZ = tDeltaZ * FRAC1(z1);
-    } else {
-        tMaxZ = tDeltaZ * FRAC0(z1);
-    }
-    voxel.z = (int)z1;
-
-    processVoxel(voxel);
+    visit(voxel);
     while (true) {
-        if (tMaxX < tMaxY) {
-            if (tMaxX < tMaxZ) {
-                voxel.x += dx;
-                tMaxX += tDeltaX;
-            } else {
-                voxel.z += dz;
-                tMaxZ += tDeltaZ;
-            }
-        } else {
-            if (tMaxY < tMaxZ) {
-                voxel.y += dy;
-                tMaxY += tDeltaY;
-            } else {
-                voxel.z += dz;
-                tMaxZ += tDeltaZ;
-            }
-        }
-        if (tMaxX > 1 && tMaxY > 1 && tMaxZ > 1) {
+        const int axis = tMax[0] < tMax[1] ? (tMax[0] < tMax[2] ? 0 : 2) : (tMax[1] < tMax[2] ? 1 : 2);
+        voxel[axis] += step[axis];
+        tMax[axis] += tDelta[axis];
+        if (tMax[0] > 1 && tMax[1] > 1 && tMax[2] > 1) {
             break;
         }
-        processVoxel(voxel);
+        visit(voxel);
     }
+}
+
+/// VoxelTrace inside a grid of size^3 voxels. Start and end are clamped into the grid first, so only voxels in
+/// [0, size)^3 are visited.
+template <typename T, typename Visitor>
+inline void VoxelTraceClipped(linalg::vec<T, 3> start, linalg::vec<T, 3> end, const int32_t size, Visitor&& visit)
+{
+    // Points on the upper boundary belong to the last voxel
+    const linalg::vec<T, 3> lower(T(0));
+    const linalg::vec<T, 3> upper(static_cast<T>(size) - T(0.001));
+    start = linalg::clamp(start, lower, upper);
+    end   = linalg::clamp(end, lower, upper);
 
-#undef SIGN
-#undef FRAC0
-#undef FRAC1
-}
\ No newline at end of file
+    VoxelTrace(start, end, [&visit, size](const Int3& voxel) {
+        assert((0 <= voxel.x) && (0 <= voxel.y) && (0 <= voxel.z));
+        assert((voxel.x < size) && (voxel.y < size) && (voxel.z < size));
+        visit(voxel);
+    });
+}
+
+/// Traverses the segments in order, the visitor is called with the index of the segment and the voxel
+template <typename Segments, typename Visitor>
+inline void VoxelTraceBatch(const Segments& segments, Visitor&& visit)
+{
+    size_t segmentIdx = 0;
+    for (const auto& segment : segments) {
+        VoxelTrace(segment.start, segment.end, [&visit, segmentIdx](const Int3& voxel) { visit(segmentIdx, voxel); });
+        segmentIdx++;
+    }
+}
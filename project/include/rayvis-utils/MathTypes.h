@@ -177,6 +177,26 @@ inline Float3 projectToPlane(const Float3& point, const Float3& planeNormal)
     return projected;
 }
 
+/// Maps a unit vector onto the [-1, 1]^2 square of an octahedron unfolded around +z
+inline Float2 encodeOctahedral(const Float3& dir)
+{
+    const Float3 n = dir / (std::abs(dir.x) + std::abs(dir.y) + std::abs(dir.z));
+    if (0 <= n.z) {
+        return Float2(n.x, n.y);
+    }
+    return Float2((1 - std::abs(n.y)) * (n.x < 0 ? -1.f : 1.f), (1 - std::abs(n.x)) * (n.y < 0 ? -1.f : 1.f));
+}
+
+inline Float3 decodeOctahedral(const Float2& oct)
+{
+    Float3 n(oct.x, oct.y, 1 - std::abs(oct.x) - std::abs(oct.y));
+    if (n.z < 0) {
+        n.x = (1 - std::abs(oct.y)) * (oct.x < 0 ? -1.f : 1.f);
+        n.y = (1 - std::abs(oct.x)) * (oct.y < 0 ? -1.f : 1.f);
+    }
+    return linalg::normalize(n);
+}
+
 template <>
 struct fmt::formatter<Float3> {
     template <typename ParseContext>
@@ -0,0 +1,60 @@
+/* Copyright (c) 2023 Pirmin Pfeifer */
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <vector>
+
+/// Work stealing thread pool. Every worker owns a queue and takes its next task from there, once it is empty the
+/// worker steals from the queues of the others. The thread calling ParallelFor works on the tasks as well, so
+/// ParallelFor can be nested inside of tasks.
+class TaskPool final {
+public:
+    using Task     = std::function<void(size_t)>;
+    using Progress = std::function<void(size_t finished, size_t count)>;
+
+    /// workerCount includes the calling thread, 0 uses all hardware threads
+    explicit TaskPool(const size_t workerCount = 0);
+    ~TaskPool();
+
+    TaskPool(const TaskPool&)            = delete;
+    TaskPool& operator=(const TaskPool&) = delete;
+
+    size_t WorkerCount() const;
+
+    /// Runs task(i) for every i in [0, count) and returns once all of them finished.
+    /// With costs (one per task) the most expensive tasks are started first. progress is called after every finished
+    /// task, the calls are serialized. The first exception thrown by a task is rethrown, remaining tasks are skipped.
+    void ParallelFor(const size_t            count,
+                     const Task&             task,
+                     std::span<const size_t> costs    = {},
+                     const Progress&         progress = {});
+
+private:
+    struct Batch;
+    struct Item {
+        Batch* batch;
+        size_t index;
+    };
+    struct Queue {
+        std::mutex       mutex;
+        std::deque<Item> items;
+    };
+
+    bool TryRunNext(const size_t queueIdx);
+    void Run(const Item& item);
+    void WorkerLoop(const size_t queueIdx);
+
+    std::vector<std::unique_ptr<Queue>> queues_;  /// One per worker, the last one is shared by calling threads
+    std::vector<std::jthread>           workers_;
+
+    std::mutex              mutex_;
+    std::condition_variable wake_;
+    std::atomic_size_t      pending_ = 0;  /// Queued items of all queues
+    bool                    stop_    = false;
+};
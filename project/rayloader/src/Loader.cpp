@@ -1,9 +1,11 @@
 /* Copyright (c) 2023 Pirmin Pfeifer */
 #include "Loader.h"
 
-
+#include <atomic>
 #include <filesystem>
 #include <iostream>
+#include <mutex>
+#include <thread>
 
 namespace rayloader {
     Loader::Loader() {}
@@ -27,14 +29,45 @@ namespace rayloader {
         throw std::runtime_error("File not supported");
     }
 
+    TraceCollection Loader::Open(const char* filename)
+    {
+        if (!std::filesystem::exists(filename)) {
+            throw std::runtime_error("file dose not exist");
+        }
+
+        std::filesystem::path filePath(filename);
+        if (filePath.extension() == ".rayvis") {
+            return OpenRAYVIS(RayVisFile::Open(filename));
+        }
+
+        throw std::runtime_error("File not supported");
+    }
+
+    TraceCollection Loader::Open(std::shared_ptr<RayVisFile> file)
+    {
+        return OpenRAYVIS(std::move(file));
+    }
+
     std::vector<std::string> Loader::GetAvailableConfigurationKeys() const
     {
-        return {"useCache"};
+        return {"useCache", "workerThreads", "memoryBudget"};
     }
 
     void Loader::SetConfigurationImpl(std::unique_ptr<core::IConfiguration>&& configuration)
     {
         configuration->Register("useCache", true, "Use Cache", "Enable caching of rayhistory files");
+        const core::ConfigurationEntry::IntParameters threadParams = {0, 256};
+        configuration->Register("workerThreads",
+                                0,
+                                "Loader Threads",
+                                "Number of threads decoding traces in parallel (0 uses all hardware threads)",
+                                threadParams);
+        const core::ConfigurationEntry::IntParameters budgetParams = {0, 1024 * 1024};
+        configuration->Register("memoryBudget",
+                                8 * 1024,
+                                "Trace Memory Budget (MB)",
+                                "Memory kept for decoded traces before unused ones are evicted (0 is unlimited)",
+                                budgetParams);
 
         if (cache_) {
             cache_->SetConfiguration(configuration->CreateView("cache."));
@@ -61,19 +94,55 @@ namespace rayloader {
             return std::vector<RayTrace>();
         }
 
-        std::vector<RayTrace> result   = {};
-        bool                  succsess = true;
-
-        auto       chunkfile  = rdf::ChunkFile(filename);
-        const auto traceCount = chunkfile.GetChunkCount(RAY_TRACE_CHUNK_ID);
+        const auto file       = RayVisFile::Open(filename);
+        const auto traceCount = static_cast<size_t>(file->Chunks().GetChunkCount(RAY_TRACE_CHUNK_ID));
+
+        const size_t workerCount = std::clamp<size_t>(WorkerThreadCount(), 1, std::max<size_t>(traceCount, 1));
+        spdlog::info("RayTrace Loading: started loading {} traces form \"{}\" on {} threads",
+                     traceCount,
+                     filename,
+                     workerCount);
+
+        // Reads of the shared chunk file are serialized, the traces are decompressed in parallel
+        std::vector<RayTrace> result(traceCount);
+        std::vector<uint8_t>  loaded(traceCount, 0);
+        std::atomic_size_t    nextTrace = 0;
+        std::mutex            errorMutex;
+        std::exception_ptr    error  = nullptr;
+        const auto            worker = [&]() {
+            try {
+                for (size_t i = nextTrace++; i < traceCount; i = nextTrace++) {
+                    loaded[i] = RayTrace::LoadFrom(file->Chunks(), result[i], i);
+                }
+            } catch (...) {
+                // Stop the other workers and rethrow on the calling thread
+                nextTrace = traceCount;
+                std::lock_guard lock(errorMutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+        };
+
+        if (workerCount == 1) {
+            worker();
+        } else {
+            std::vector<std::jthread> workers;
+            workers.reserve(workerCount);
+            for (size_t i = 0; i < workerCount; i++) {
+                workers.emplace_back(worker);
+            }
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
 
-        spdlog::info("RayTrace Loading: started loading {} traces form \"{}\"", traceCount, filename);
-        for (size_t i = 0; i < traceCount; i++) {
-            RayTrace trace;
-            succsess &= RayTrace::LoadFrom(chunkfile, trace, i);
-            assert(succsess);
-            result.push_back(std::move(trace));
+        const bool succsess = std::all_of(loaded.begin(), loaded.end(), [](const uint8_t& l) { return l != 0; });
+        if (!succsess) {
+            spdlog::error("RayTrace Loading: at least one trace of \"{}\" could not be loaded", filename);
         }
+        assert(succsess);
+
         std::sort(
             result.begin(), result.end(), [](const RayTrace& a, const RayTrace& b) { return a.traceId < b.traceId; });
 
@@ -83,4 +152,56 @@ namespace rayloader {
 
         return result;
     }
-}  // namespace rayloader
\ No newline at end of file
+
+    TraceCollection Loader::OpenRAYVIS(std::shared_ptr<RayVisFile> file)
+    {
+        const auto begin = std::chrono::steady_clock::now();
+
+        auto&      chunkfile  = file->Chunks();
+        const auto traceCount = static_cast<size_t>(chunkfile.GetChunkCount(RAY_TRACE_CHUNK_ID));
+
+        std::vector<TraceInfo> infos;
+        infos.reserve(traceCount);
+        std::int64_t totalSize = 0;
+        for (size_t i = 0; i < traceCount; i++) {
+            const auto header = RayTrace::ReadHeader(chunkfile, i);
+            if (!header) {
+                spdlog::error("RayTrace Loading: trace chunk {} of \"{}\" can not be read", i, file->Path());
+                continue;
+            }
+
+            TraceInfo info;
+            info.traceId  = header->traceId;
+            info.chunkIdx = i;
+            info.rayCount = header->rayCount;
+            info.byteSize = header->rayCount * sizeof(Ray);
+            infos.push_back(info);
+            totalSize += info.byteSize;
+        }
+
+        const auto end     = std::chrono::steady_clock::now();
+        const auto seconds = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() / 1000.f;
+        spdlog::info("RayTrace Loading: indexed {} traces ({} MB) of \"{}\" in {}s",
+                     infos.size(),
+                     totalSize / (1024 * 1024),
+                     file->Path(),
+                     seconds);
+
+        return TraceCollection(std::move(file), std::move(infos), MemoryBudget());
+    }
+
+    size_t Loader::WorkerThreadCount() const
+    {
+        const int32_t configured = config_ ? config_->Get<int32_t>("workerThreads") : 0;
+        if (0 < configured) {
+            return configured;
+        }
+        return std::max(std::thread::hardware_concurrency(), 1U);
+    }
+
+    size_t Loader::MemoryBudget() const
+    {
+        const int32_t configured = config_ ? config_->Get<int32_t>("memoryBudget") : 0;
+        return static_cast<size_t>(std::max(configured, 0)) * 1024 * 1024;
+    }
+}  // namespace rayloader
@@ -3,10 +3,89 @@
 
 #include <spdlog/spdlog.h>
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+#include <execution>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
+#include <mutex>
+#include <numeric>
 #include <set>
+#include <thread>
+
+namespace {
+    /// Bounds of the [tMin, tMax] segment of a ray, components running off to infinity stay infinite
+    std::pair<Float3, Float3> SegmentBounds(const Ray& ray)
+    {
+        const Float3 start = ray.origin + ray.direction * ray.tMin;
+        Float3       end   = ray.origin + ray.direction * ray.tMax;
+        for (int i = 0; i < 3; i++) {
+            if (!std::isfinite(end[i])) {
+                end[i] = (ray.direction[i] == 0.f)
+                             ? ray.origin[i]
+                             : std::copysign(std::numeric_limits<float>::infinity(), ray.direction[i]);
+            }
+        }
+        return {linalg::min(start, end), linalg::max(start, end)};
+    }
+
+    static_assert(sizeof(Ray) % sizeof(std::uint32_t) == 0);
+    constexpr size_t RayWordCount = sizeof(Ray) / sizeof(std::uint32_t);
+    using RayWords                = std::array<std::uint32_t, RayWordCount>;
+
+    /// Words of Ray that mostly grow slowly from one ray to the next, so their deltas are small
+    constexpr std::array<size_t, 4> DeltaCodedWords = {
+        offsetof(Ray, rayId) / sizeof(std::uint32_t),
+        offsetof(Ray, hitInfo.instanceIndex) / sizeof(std::uint32_t),
+        offsetof(Ray, hitInfo.primitiveIndex) / sizeof(std::uint32_t),
+        offsetof(Ray, hitInfo.geometryIndex) / sizeof(std::uint32_t),
+    };
+
+    /// RayBlockTransform::Shuffle, byte b of ray i ends up at target[b * count + i]
+    void ShuffleRays(const Ray* rays, const size_t count, std::byte* target)
+    {
+        RayWords previous = {};
+        for (size_t i = 0; i < count; i++) {
+            RayWords words;
+            std::memcpy(words.data(), &rays[i], sizeof(Ray));
+            for (const auto word : DeltaCodedWords) {
+                const auto value = words[word];
+                words[word] -= previous[word];
+                previous[word] = value;
+            }
+
+            const auto* bytes = reinterpret_cast<const std::byte*>(words.data());
+            for (size_t b = 0; b < sizeof(Ray); b++) {
+                target[b * count + i] = bytes[b];
+            }
+        }
+    }
+
+    void UnshuffleRays(const std::byte* source, const size_t count, Ray* rays)
+    {
+        RayWords previous = {};
+        for (size_t i = 0; i < count; i++) {
+            RayWords words;
+            auto*    bytes = reinterpret_cast<std::byte*>(words.data());
+            for (size_t b = 0; b < sizeof(Ray); b++) {
+                bytes[b] = source[b * count + i];
+            }
+
+            for (const auto word : DeltaCodedWords) {
+                words[word] += previous[word];
+                previous[word] = words[word];
+            }
+            std::memcpy(static_cast<void*>(&rays[i]), words.data(), sizeof(Ray));
+        }
+    }
+}  // namespace
 
 float Ray::missTolerance = 0.1f;
 
@@ -21,6 +100,39 @@ Float2 RayTrace::MinMaxTHit()
     return Float2(min, max);
 }
 
+void RayTrace::SortHitMargins()
+{
+    const auto begin = std::chrono::steady_clock::now();
+    assert(rays.size() <= std::numeric_limits<std::uint32_t>::max());
+    rayByHitMargin.resize(rays.size());
+    std::iota(rayByHitMargin.begin(), rayByHitMargin.end(), 0);
+    std::sort(std::execution::par, rayByHitMargin.begin(), rayByHitMargin.end(), [this](const auto a, const auto b) {
+        const float marginA = rays[a].HitMargin();
+        const float marginB = rays[b].HitMargin();
+        return marginA != marginB ? marginA < marginB : a < b;
+    });
+    hitMargins.resize(rays.size());
+    std::transform(rayByHitMargin.begin(), rayByHitMargin.end(), hitMargins.begin(), [this](const auto rayIdx) {
+        return rays[rayIdx].HitMargin();
+    });
+
+    const auto end = std::chrono::steady_clock::now();
+    spdlog::info("Sorted the hit margins of {} rays in {}s",
+                 rays.size(),
+                 std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() / 1000.f);
+}
+
+std::pair<size_t, size_t> RayTrace::HitMarginRange(const float toleranceA, const float toleranceB) const
+{
+    assert(HasHitMargins());
+    // Rays with a margin in (lower, upper] hit with the lower tolerance only
+    const float lower = std::min(toleranceA, toleranceB);
+    const float upper = std::max(toleranceA, toleranceB);
+    const auto  first = std::upper_bound(hitMargins.begin(), hitMargins.end(), lower);
+    const auto  last  = std::upper_bound(first, hitMargins.end(), upper);
+    return {first - hitMargins.begin(), last - hitMargins.begin()};
+}
+
 bool RayTrace::Save(const char* filename, bool overrideFile) const
 {
     auto path = std::filesystem::path(filename);
@@ -42,75 +154,340 @@ bool RayTrace::Save(const char* filename, bool overrideFile) const
     return res;
 }
 
-bool RayTrace::Save(rdf::ChunkFileWriter& writer) const
+bool RayTrace::Save(rdf::ChunkFileWriter& writer, const RayBlockTransform transform) const
 {
-    // Header
-    auto header    = RayTraceHeader();
-    header.traceId = traceId;
+    static_assert(std::is_trivially_copyable_v<Ray>);
 
-    writer.BeginChunk(RAY_TRACE_CHUNK_ID, sizeof(RayTraceHeader), &header, rdfCompressionZstd, RAY_TRACE_VERSION);
+    const auto begin = std::chrono::steady_clock::now();
+
+    std::vector<std::byte> shuffled;
+    if (transform == RayBlockTransform::Shuffle) {
+        shuffled.resize(std::min(RAY_BLOCK_RAY_COUNT, rays.size()) * sizeof(Ray));
+    }
 
-    for (size_t i = 0; i < rays.size(); i++) {
-        writer.AppendToChunk(rays[i]);
+    // Blocks are written first, as their chunk indices are part of the block index
+    std::vector<RayBlockInfo> blocks;
+    blocks.reserve((rays.size() + RAY_BLOCK_RAY_COUNT - 1) / RAY_BLOCK_RAY_COUNT);
+    for (size_t firstRay = 0; firstRay < rays.size(); firstRay += RAY_BLOCK_RAY_COUNT) {
+        RayBlockInfo block = {};
+        block.firstRay     = firstRay;
+        block.rayCount     = static_cast<std::uint32_t>(std::min(RAY_BLOCK_RAY_COUNT, rays.size() - firstRay));
+        block.min          = Float3(std::numeric_limits<float>::max());
+        block.max          = Float3(std::numeric_limits<float>::lowest());
+        for (size_t i = firstRay; i < firstRay + block.rayCount; i++) {
+            const auto [segmentMin, segmentMax] = SegmentBounds(rays[i]);
+            block.min                           = linalg::min(block.min, segmentMin);
+            block.max                           = linalg::max(block.max, segmentMax);
+        }
+
+        const RayBlockHeader blockHeader = {transform, 0};
+        writer.BeginChunk(
+            RAY_BLOCK_CHUNK_ID, sizeof(RayBlockHeader), &blockHeader, rdfCompressionZstd, RAY_TRACE_VERSION);
+        if (transform == RayBlockTransform::Shuffle) {
+            ShuffleRays(&rays[firstRay], block.rayCount, shuffled.data());
+            writer.AppendToChunk(block.rayCount * sizeof(Ray), shuffled.data());
+        } else {
+            writer.AppendToChunk(block.rayCount * sizeof(Ray), &rays[firstRay]);
+        }
+        block.chunkIdx = writer.EndChunk();
+        blocks.push_back(block);
     }
 
+    auto header       = RayTraceHeader();
+    header.traceId    = traceId;
+    header.blockCount = static_cast<std::uint32_t>(blocks.size());
+    header.rayCount   = rays.size();
+
+    writer.BeginChunk(RAY_TRACE_CHUNK_ID, sizeof(RayTraceHeader), &header, rdfCompressionZstd, RAY_TRACE_VERSION);
+    writer.AppendToChunk(blocks.size() * sizeof(RayBlockInfo), blocks.data());
     writer.EndChunk();
+
+    const auto end     = std::chrono::steady_clock::now();
+    const auto seconds = std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count() / 1000000.0;
+    spdlog::info("RayTrace Saving: compressed {} rays in {} {} blocks of trace {} in {}s ({:.1f} MB/s)",
+                 rays.size(),
+                 blocks.size(),
+                 transform == RayBlockTransform::Shuffle ? "shuffled" : "raw",
+                 traceId,
+                 seconds,
+                 0 < seconds ? (rays.size() * sizeof(Ray) / seconds) / (1024.0 * 1024.0) : 0.0);
     return true;
 }
 
 bool RayTrace::LoadFrom(const char* filename, RayTrace& target, const size_t chunkIdx)
 {
     auto path = std::filesystem::path(filename);
-    assert(path.extension() == RAY_TRACE_EXTENSION);
     if (!std::filesystem::exists(path)) {
         spdlog::warn("RayTrace Loading: file dose not exist");
         return false;
     }
 
     auto chunkfile = rdf::ChunkFile(filename);
-    return LoadFrom(chunkfile, target, chunkIdx);
+    return LoadFromParallel(chunkfile, target, chunkIdx);
+}
+
+bool RayTrace::LoadFromParallel(rdf::ChunkFile& chunkfile, RayTrace& target, const size_t chunkIdx)
+{
+    if (static_cast<size_t>(chunkfile.GetChunkCount(RAY_TRACE_CHUNK_ID)) <= chunkIdx ||
+        chunkfile.GetChunkVersion(RAY_TRACE_CHUNK_ID, chunkIdx) == 1)
+    {
+        return LoadFrom(chunkfile, target, chunkIdx);
+    }
+
+    const auto header = ReadHeader(chunkfile, chunkIdx);
+    std::vector<RayBlockInfo> blocks;
+    if (!header || !ReadBlockIndex(chunkfile, chunkIdx, blocks)) {
+        return false;
+    }
+
+    const auto begin = std::chrono::steady_clock::now();
+
+    target.traceId = header->traceId;
+    target.rays.clear();
+    target.rays.resize(header->rayCount);
+
+    // Reads of the chunk file are serialized, the blocks are decompressed in parallel
+    const size_t workerCount =
+        std::clamp<size_t>(std::thread::hardware_concurrency(), 1, std::max<size_t>(blocks.size(), 1));
+    std::atomic_size_t nextBlock = 0;
+    std::atomic_bool   success   = true;
+    std::mutex         errorMutex;
+    std::exception_ptr error  = nullptr;
+    const auto         worker = [&]() {
+        try {
+            for (size_t i = nextBlock++; i < blocks.size(); i = nextBlock++) {
+                if (!LoadBlock(chunkfile, blocks[i], target.rays.data() + blocks[i].firstRay)) {
+                    success = false;
+                }
+            }
+        } catch (...) {
+            // Stop the other workers and rethrow on the calling thread
+            nextBlock = blocks.size();
+            std::lock_guard lock(errorMutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    };
+
+    if (workerCount == 1) {
+        worker();
+    } else {
+        std::vector<std::jthread> workers;
+        workers.reserve(workerCount);
+        for (size_t i = 0; i < workerCount; i++) {
+            workers.emplace_back(worker);
+        }
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    const auto end     = std::chrono::steady_clock::now();
+    const auto seconds = std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count() / 1000000.0;
+    spdlog::info("RayTrace Loading: decoded {} rays in {} blocks of trace {} on {} threads in {}s ({:.2f} GB/s)",
+                 target.rays.size(),
+                 blocks.size(),
+                 target.traceId,
+                 workerCount,
+                 seconds,
+                 0 < seconds ? (target.rays.size() * sizeof(Ray) / seconds) / (1024.0 * 1024.0 * 1024.0) : 0.0);
+    return success;
 }
 
 bool RayTrace::LoadFrom(rdf::ChunkFile& chunkfile, RayTrace& target, const size_t chunkIdx)
 {
-    if (chunkfile.GetChunkCount(RAY_TRACE_CHUNK_ID) <= chunkIdx) {
-        spdlog::warn(fmt::format("RayTrace Loading: missing chunk with RAY_TRACE_CHUNK_ID at index {}", chunkIdx));
+    return LoadFrom(chunkfile, target, chunkIdx, nullptr);
+}
+
+bool RayTrace::LoadFrom(rdf::ChunkFile&                                 chunkfile,
+                        RayTrace&                                       target,
+                        const size_t                                    chunkIdx,
+                        const std::function<bool(const RayBlockInfo&)>& blockFilter)
+{
+    const auto header = ReadHeader(chunkfile, chunkIdx);
+    if (!header) {
         return false;
     }
+    target.traceId = header->traceId;
+
+    const auto begin = std::chrono::steady_clock::now();
+
+    target.rays.clear();
+    if (chunkfile.GetChunkVersion(RAY_TRACE_CHUNK_ID, chunkIdx) == 1) {
+        // Rays are stored as a flat array, so the chunk can be decompressed straight into target.rays
+        target.rays.resize(header->rayCount);
+        if (!target.rays.empty()) {
+            chunkfile.ReadChunkDataToBuffer(RAY_TRACE_CHUNK_ID, chunkIdx, target.rays.data());
+        }
+    } else {
+        std::vector<RayBlockInfo> blocks;
+        if (!ReadBlockIndex(chunkfile, chunkIdx, blocks)) {
+            return false;
+        }
+        if (blockFilter) {
+            blocks.erase(std::remove_if(blocks.begin(),
+                                        blocks.end(),
+                                        [&blockFilter](const RayBlockInfo& block) { return !blockFilter(block); }),
+                         blocks.end());
+        }
+
+        size_t rayCount = 0;
+        for (const auto& block : blocks) {
+            rayCount += block.rayCount;
+        }
+        target.rays.resize(rayCount);
+
+        // Selected blocks are packed in order, without filter this is their position in the trace
+        Ray* blockTarget = target.rays.data();
+        for (const auto& block : blocks) {
+            if (!LoadBlock(chunkfile, block, blockTarget)) {
+                return false;
+            }
+            blockTarget += block.rayCount;
+        }
+    }
+
+    const auto end     = std::chrono::steady_clock::now();
+    const auto seconds = std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count() / 1000000.0;
+    spdlog::info("RayTrace Loading: decoded {} rays of trace {} in {}s ({:.2f} GB/s)",
+                 target.rays.size(),
+                 target.traceId,
+                 seconds,
+                 0 < seconds ? (target.rays.size() * sizeof(Ray) / seconds) / (1024.0 * 1024.0 * 1024.0) : 0.0);
+    return true;
+}
+
+std::optional<RayTraceHeader> RayTrace::ReadHeader(rdf::ChunkFile& chunkfile, const size_t chunkIdx)
+{
+    if (static_cast<size_t>(chunkfile.GetChunkCount(RAY_TRACE_CHUNK_ID)) <= chunkIdx) {
+        spdlog::warn(fmt::format("RayTrace Loading: missing chunk with RAY_TRACE_CHUNK_ID at index {}", chunkIdx));
+        return std::nullopt;
+    }
     const auto headerSize   = chunkfile.GetChunkHeaderSize(RAY_TRACE_CHUNK_ID, chunkIdx);
     const auto chunkVersion = chunkfile.GetChunkVersion(RAY_TRACE_CHUNK_ID, chunkIdx);
-    if (headerSize != sizeof(RayTraceHeader)) {
-        spdlog::warn("RayTrace Loading: Wrong header size");
-        return false;
+    if (chunkVersion == 1) {
+        if (headerSize != sizeof(RayTraceHeaderV1)) {
+            spdlog::warn("RayTrace Loading: Wrong header size");
+            return std::nullopt;
+        }
+        RayTraceHeaderV1 headerV1;
+        chunkfile.ReadChunkHeaderToBuffer(RAY_TRACE_CHUNK_ID, chunkIdx, &headerV1);
+
+        const auto dataSize = chunkfile.GetChunkDataSize(RAY_TRACE_CHUNK_ID, chunkIdx);
+        if (dataSize % sizeof(Ray) != 0) {
+            spdlog::warn("RayTrace Loading: Chunk data dose not contain rays in the correct format");
+            return std::nullopt;
+        }
+
+        RayTraceHeader header;
+        header.traceId    = headerV1.traceId;
+        header.blockCount = 0;
+        header.rayCount   = dataSize / sizeof(Ray);
+        return header;
     }
     if (chunkVersion != RAY_TRACE_VERSION) {
         spdlog::warn("RayTrace Loading: Wrong RAY_TRACE_VERSION");
-        return false;
+        return std::nullopt;
+    }
+    if (headerSize != sizeof(RayTraceHeader)) {
+        spdlog::warn("RayTrace Loading: Wrong header size");
+        return std::nullopt;
     }
 
     RayTraceHeader header;
     chunkfile.ReadChunkHeaderToBuffer(RAY_TRACE_CHUNK_ID, chunkIdx, &header);
-    target.traceId = header.traceId;
-
-    bool loadedSucessfull = false;
-    chunkfile.ReadChunkData(
-        RAY_TRACE_CHUNK_ID, chunkIdx, [&target, &loadedSucessfull](int64_t dataSize, const void* data) {
-            if (dataSize % sizeof(Ray) != 0) {
-                spdlog::warn("RayTrace Loading: Chunk data dose not contain rays in the correct format");
-                return;
-            }
-            const size_t        rayCount = dataSize / sizeof(Ray);
-            const std::uint8_t* ptr      = reinterpret_cast<const std::uint8_t*>(data);
-            for (size_t i = 0; i < rayCount; i++) {
-                Ray                 ray;
-                const std::uint8_t* ptrOffset = ptr + i * sizeof(Ray);
-                std::memcpy(&ray, ptrOffset, sizeof(Ray));
-                target.rays.push_back(ray);
-            }
+    return header;
+}
+
+bool RayTrace::ReadBlockIndex(rdf::ChunkFile& chunkfile, const size_t chunkIdx, std::vector<RayBlockInfo>& blocks)
+{
+    const auto header = ReadHeader(chunkfile, chunkIdx);
+    if (!header) {
+        return false;
+    }
+    if (chunkfile.GetChunkVersion(RAY_TRACE_CHUNK_ID, chunkIdx) == 1) {
+        spdlog::warn("RayTrace Loading: version 1 traces have no block index");
+        return false;
+    }
+
+    static_assert(std::is_trivially_copyable_v<RayBlockInfo>);
+    const auto dataSize = chunkfile.GetChunkDataSize(RAY_TRACE_CHUNK_ID, chunkIdx);
+    if (static_cast<size_t>(dataSize) != header->blockCount * sizeof(RayBlockInfo)) {
+        spdlog::warn("RayTrace Loading: Block index dose not match the block count of the header");
+        return false;
+    }
+
+    blocks.resize(header->blockCount);
+    if (!blocks.empty()) {
+        chunkfile.ReadChunkDataToBuffer(RAY_TRACE_CHUNK_ID, chunkIdx, blocks.data());
+    }
 
-            loadedSucessfull = true;
-        });
-    return loadedSucessfull;
+    // Every ray of the trace is in exactly one block, the index may list the blocks in any order
+    std::vector<std::pair<std::uint64_t, std::uint32_t>> ranges(blocks.size());
+    std::transform(blocks.begin(), blocks.end(), ranges.begin(), [](const RayBlockInfo& block) {
+        return std::make_pair(block.firstRay, block.rayCount);
+    });
+    std::sort(ranges.begin(), ranges.end());
+    std::uint64_t covered = 0;
+    for (const auto& [firstRay, rayCount] : ranges) {
+        if (firstRay != covered) {
+            spdlog::warn("RayTrace Loading: Blocks overlap or leave out rays at ray {}", covered);
+            return false;
+        }
+        covered += rayCount;
+    }
+    if (covered != header->rayCount) {
+        spdlog::warn("RayTrace Loading: Blocks cover {} of the {} rays of the trace", covered, header->rayCount);
+        return false;
+    }
+    return true;
+}
+
+bool RayTrace::LoadBlock(rdf::ChunkFile& chunkfile, const RayBlockInfo& block, Ray* target)
+{
+    if (chunkfile.GetChunkCount(RAY_BLOCK_CHUNK_ID) <= block.chunkIdx) {
+        spdlog::warn("RayTrace Loading: missing chunk with RAY_BLOCK_CHUNK_ID at index {}", block.chunkIdx);
+        return false;
+    }
+    const auto dataSize = chunkfile.GetChunkDataSize(RAY_BLOCK_CHUNK_ID, block.chunkIdx);
+    if (static_cast<size_t>(dataSize) != block.rayCount * sizeof(Ray)) {
+        spdlog::warn("RayTrace Loading: Block {} dose not match its entry in the block index", block.chunkIdx);
+        return false;
+    }
+
+    auto       transform  = RayBlockTransform::None;
+    const auto headerSize = chunkfile.GetChunkHeaderSize(RAY_BLOCK_CHUNK_ID, block.chunkIdx);
+    if (headerSize == sizeof(RayBlockHeader)) {
+        RayBlockHeader header;
+        chunkfile.ReadChunkHeaderToBuffer(RAY_BLOCK_CHUNK_ID, block.chunkIdx, &header);
+        transform = header.transform;
+    } else if (headerSize != 0) {
+        spdlog::warn("RayTrace Loading: Block {} has a wrong header size", block.chunkIdx);
+        return false;
+    }
+
+    if (block.rayCount == 0) {
+        return true;
+    }
+    switch (transform) {
+    case RayBlockTransform::None:
+        chunkfile.ReadChunkDataToBuffer(RAY_BLOCK_CHUNK_ID, block.chunkIdx, target);
+        return true;
+    case RayBlockTransform::Shuffle: {
+        // Blocks are decoded on several threads at once, each keeps its own staging buffer
+        thread_local std::vector<std::byte> shuffled;
+        shuffled.resize(block.rayCount * sizeof(Ray));
+        chunkfile.ReadChunkDataToBuffer(RAY_BLOCK_CHUNK_ID, block.chunkIdx, shuffled.data());
+        UnshuffleRays(shuffled.data(), block.rayCount, target);
+        return true;
+    }
+    default:
+        spdlog::warn("RayTrace Loading: Block {} uses the unknown transform {}",
+                     block.chunkIdx,
+                     static_cast<std::uint32_t>(transform));
+        return false;
+    }
 }
 
 void RayTrace::DumpStartEndPointsToCSV(std::string path) const
@@ -137,4 +514,8 @@ void RayTrace::ScaleBy(const float& scale)
             ray.tHit = ray.tHit * scale;
         }
     }
+    // Rounding can reorder rays with almost the same margin
+    if (HasHitMargins()) {
+        SortHitMargins();
+    }
 }
@@ -0,0 +1,71 @@
+/* Copyright (c) 2023 Pirmin Pfeifer */
+#include "RayVisFile.h"
+
+#include <rayloader/RayTrace.h>
+#include <spdlog/spdlog.h>
+
+#include <filesystem>
+#include <stdexcept>
+
+namespace rayloader {
+    std::shared_ptr<RayVisFile> RayVisFile::Open(const std::string& path)
+    {
+        if (!std::filesystem::exists(path)) {
+            throw std::runtime_error(fmt::format("\"{}\" dose not exist", path));
+        }
+        return std::shared_ptr<RayVisFile>(new RayVisFile(path));
+    }
+
+    RayVisFile::RayVisFile(const std::string& path) : path_(path), chunkfile_(path.c_str()) {}
+
+    const std::string& RayVisFile::Path() const
+    {
+        return path_;
+    }
+
+    rdf::ChunkFile& RayVisFile::Chunks()
+    {
+        return chunkfile_;
+    }
+
+    const rdf::ChunkFile& RayVisFile::Chunks() const
+    {
+        return chunkfile_;
+    }
+
+    bool RayVisFile::ValidateTraces() const
+    {
+        const auto chunkCount = chunkfile_.GetChunkCount(RAY_TRACE_CHUNK_ID);
+        if (chunkCount == 0) {
+            spdlog::error("RAYVIS_CHECK_PATH: A chunk of type {} is required, but not present in \"{}\"",
+                          RAY_TRACE_CHUNK_ID,
+                          path_);
+            return false;
+        }
+
+        for (std::int64_t i = 0; i < chunkCount; i++) {
+            // Version 1 traces are still supported
+            const auto chunkVersion = chunkfile_.GetChunkVersion(RAY_TRACE_CHUNK_ID, i);
+            if (chunkVersion != RAY_TRACE_VERSION && chunkVersion != 1) {
+                spdlog::error("RAYVIS_CHECK_PATH: Chunk {} ID {}: Version is {} but supported versions are 1 to {}",
+                              RAY_TRACE_CHUNK_ID,
+                              i,
+                              chunkVersion,
+                              RAY_TRACE_VERSION);
+                return false;
+            }
+
+            const auto headerSize         = chunkfile_.GetChunkHeaderSize(RAY_TRACE_CHUNK_ID, i);
+            const auto expectedHeaderSize = chunkVersion == 1 ? sizeof(RayTraceHeaderV1) : sizeof(RayTraceHeader);
+            if (static_cast<size_t>(headerSize) != expectedHeaderSize) {
+                spdlog::error("RAYVIS_CHECK_PATH: Chunk {} ID {}: Header size is {} but was expected to be {}",
+                              RAY_TRACE_CHUNK_ID,
+                              i,
+                              headerSize,
+                              expectedHeaderSize);
+                return false;
+            }
+        }
+        return true;
+    }
+}  // namespace rayloader
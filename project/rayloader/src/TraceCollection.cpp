@@ -0,0 +1,142 @@
+/* Copyright (c) 2023 Pirmin Pfeifer */
+#include "TraceCollection.h"
+
+#include <spdlog/spdlog.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+namespace rayloader {
+    TraceCollection::TraceCollection(std::shared_ptr<RayVisFile> file,
+                                     std::vector<TraceInfo>      infos,
+                                     size_t                      memoryBudget)
+        : file_(std::move(file)), memoryBudget_(memoryBudget)
+    {
+        std::sort(
+            infos.begin(), infos.end(), [](const TraceInfo& a, const TraceInfo& b) { return a.traceId < b.traceId; });
+        entries_.reserve(infos.size());
+        for (const auto& info : infos) {
+            Entry entry;
+            entry.info = info;
+            entries_.push_back(entry);
+        }
+    }
+
+    std::shared_ptr<RayTrace> TraceCollection::Get(const size_t idx)
+    {
+        auto& entry      = entries_.at(idx);
+        entry.lastAccess = ++accessCount_;
+        if (entry.resident) {
+            return entry.resident;
+        }
+
+        // The trace was evicted but is still in use, so there is no need to decode it again
+        if (auto trace = entry.alive.lock()) {
+            MakeResident(entry, trace);
+            EvictLeastRecentlyUsed(idx);
+            return trace;
+        }
+
+        auto trace = std::make_shared<RayTrace>();
+        if (!RayTrace::LoadFromParallel(file_->Chunks(), *trace, entry.info.chunkIdx)) {
+            throw std::runtime_error(
+                fmt::format("Could not load trace {} from \"{}\"", entry.info.traceId, SourcePath()));
+        }
+        trace->sourcePath = SourcePath();
+        if (scale_ != 1.f) {
+            trace->ScaleBy(scale_);
+        }
+
+        MakeResident(entry, trace);
+        EvictLeastRecentlyUsed(idx);
+        return trace;
+    }
+
+    const TraceInfo& TraceCollection::Info(const size_t idx) const
+    {
+        return entries_.at(idx).info;
+    }
+
+    size_t TraceCollection::size() const
+    {
+        return entries_.size();
+    }
+
+    bool TraceCollection::empty() const
+    {
+        return entries_.empty();
+    }
+
+    bool TraceCollection::IsResident(const size_t idx) const
+    {
+        return entries_.at(idx).resident != nullptr;
+    }
+
+    size_t TraceCollection::ResidentBytes() const
+    {
+        return residentBytes_;
+    }
+
+    void TraceCollection::SetMemoryBudget(const size_t memoryBudget)
+    {
+        memoryBudget_ = memoryBudget;
+
+        // Keep the most recently used trace resident
+        const auto mostRecent = std::max_element(entries_.begin(), entries_.end(), [](const Entry& a, const Entry& b) {
+            return a.lastAccess < b.lastAccess;
+        });
+        if (mostRecent != entries_.end()) {
+            EvictLeastRecentlyUsed(std::distance(entries_.begin(), mostRecent));
+        }
+    }
+
+    void TraceCollection::ScaleBy(const float& scale)
+    {
+        scale_ *= scale;
+        for (auto& entry : entries_) {
+            if (auto trace = entry.alive.lock()) {
+                trace->ScaleBy(scale);
+            }
+        }
+    }
+
+    const std::string& TraceCollection::SourcePath() const
+    {
+        static const std::string noSource;
+        return file_ ? file_->Path() : noSource;
+    }
+
+    void TraceCollection::MakeResident(Entry& entry, std::shared_ptr<RayTrace> trace)
+    {
+        entry.alive    = trace;
+        entry.resident = std::move(trace);
+        residentBytes_ += entry.info.byteSize;
+    }
+
+    void TraceCollection::EvictLeastRecentlyUsed(const size_t keepIdx)
+    {
+        if (memoryBudget_ == UnlimitedMemoryBudget) {
+            return;
+        }
+
+        while (memoryBudget_ < residentBytes_) {
+            Entry* leastRecent = nullptr;
+            for (size_t i = 0; i < entries_.size(); i++) {
+                auto& entry = entries_[i];
+                if (i != keepIdx && entry.resident && (!leastRecent || entry.lastAccess < leastRecent->lastAccess)) {
+                    leastRecent = &entry;
+                }
+            }
+            if (!leastRecent) {
+                break;
+            }
+
+            spdlog::info("RayTrace Loading: evicted trace {} ({} MB) to stay within the memory budget of {} MB",
+                         leastRecent->info.traceId,
+                         leastRecent->info.byteSize / (1024 * 1024),
+                         memoryBudget_ / (1024 * 1024));
+            leastRecent->resident.reset();
+            residentBytes_ -= leastRecent->info.byteSize;
+        }
+    }
+}  // namespace rayloader
@@ -1,118 +1,1445 @@
 /* Copyright (c) 2023 Pirmin Pfeifer */
 #include "VolumetricSampler.h"
 
+#include <rayvis-utils/BrickGrid.h>
 #include <rayvis-utils/ChunkedArray3D.h>
 #include <rayvis-utils/FastVoxelTraverse.h>
 #include <rayvis-utils/MathUtils.h>
 
+#include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <execution>
-#include <future>
+#include <numeric>
 #include <set>
+#include <span>
+#include <thread>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
 using namespace std::chrono_literals;
 
+namespace {
+    /// Rays of a chunk are only split across threads in slices of at least this many rays
+    constexpr size_t MinRaysPerSlice = 4096;
+
+    /// Chunks sampled before the memory budget replaced the fixed cap, a budget keeping fewer chunks is logged
+    constexpr size_t PreviousChunkCap = 512;
+
+    /// Moving more rays than this after a miss tolerance change samples the trace again
+    constexpr size_t MaxMovedRays = 1 << 22;
+
+    /// Pass i of a progressive run adds the rays with an index divisible by PassStrides[i], the first pass traces 1%
+    /// of the trace, the second 10% and the last one all rays
+    constexpr std::array<uint32_t, 3> PassStrides = {100, 10, 1};
+    /// Smaller traces are sampled in a single pass, a preview would not show up noticeably earlier
+    constexpr size_t MinProgressiveRays = 1 << 20;
+
+    /// Ray count and direction sum of each cell crossed by the rays of a layer of a chunk task. Both live in one brick
+    /// grid so a traversal step needs a single lookup. Sum is Double3 for DirectionEncoding::Exact and Float3
+    /// otherwise.
+    template <typename Sum>
+    class CellSums {
+    public:
+        explicit CellSums(const size_t chunkSize) : cells_(chunkSize) {}
+
+        inline void Add(const Int3& voxel, const Float3& dir)
+        {
+            Cell& cell = cells_.At(voxel);
+            cell.rays++;
+            cell.direction += dir;
+        }
+
+        void Merge(const CellSums& other)
+        {
+            other.cells_.ForEachOccupied([this](const Int3& voxel, const Cell& cell) {
+                if (cell.rays != 0) {
+                    Cell& target = cells_.At(voxel);
+                    target.rays += cell.rays;
+                    target.direction += cell.direction;
+                }
+            });
+        }
+
+        /// Adds the sums of the cells to the layer or removes them from it, the directions in float precision. The
+        /// changed voxels are appended to changed if given.
+        void Apply(VolumetricSampler::ChunkLayer& layer, const bool remove, std::vector<Int3>* changed = nullptr) const
+        {
+            cells_.ForEachOccupied([&layer, remove, changed](const Int3& voxel, const Cell& cell) {
+                if (cell.rays == 0) {
+                    return;
+                }
+                if (changed) {
+                    changed->push_back(voxel);
+                }
+                VolumetricSampler::CellSum& target = layer.cells.At(voxel);
+                if (remove) {
+                    target.direction -= Float3(cell.direction);
+                    target.rays -= cell.rays;
+                } else {
+                    target.direction += Float3(cell.direction);
+                    target.rays += cell.rays;
+                }
+                // Removing the last rays of a cell would leave the rounding error as its direction
+                if (target.rays == 0) {
+                    target.direction = Float3(0.f);
+                }
+            });
+        }
+
+        static size_t ByteSize(const size_t chunkSize, const size_t occupiedBricks)
+        {
+            return BrickGrid<Cell>::ByteSize(chunkSize, occupiedBricks);
+        }
+
+    private:
+        struct Cell {
+            Sum      direction = Sum();
+            uint32_t rays      = 0;
+        };
+
+        BrickGrid<Cell> cells_;
+    };
+
+    /// Sums of all layers of a chunk task, each ray is added to the layer of its class
+    template <typename Sum>
+    struct TaskSums {
+        using Layers = std::array<size_t, VolumetricSampler::LayerCount>;
+
+        explicit TaskSums(const size_t chunkSize) : layers{CellSums<Sum>(chunkSize), CellSums<Sum>(chunkSize)} {}
+
+        void Merge(const TaskSums& other)
+        {
+            for (size_t layer = 0; layer < VolumetricSampler::LayerCount; layer++) {
+                layers[layer].Merge(other.layers[layer]);
+                rays[layer] += other.rays[layer];
+                missedRays[layer] += other.missedRays[layer];
+            }
+        }
+
+        void Apply(VolumetricSampler::ChunkSums& chunk, const bool remove, std::vector<Int3>* changed = nullptr) const
+        {
+            for (size_t layer = 0; layer < VolumetricSampler::LayerCount; layer++) {
+                VolumetricSampler::ChunkLayer& target = chunk.layers[layer];
+                layers[layer].Apply(target, remove, changed);
+                if (remove) {
+                    target.rays -= rays[layer];
+                    target.missedRays -= missedRays[layer];
+                } else {
+                    target.rays += rays[layer];
+                    target.missedRays += missedRays[layer];
+                }
+            }
+        }
+
+        std::array<CellSums<Sum>, VolumetricSampler::LayerCount> layers;
+        Layers                                                   rays       = {};
+        Layers                                                   missedRays = {};
+    };
+
+    /// Drops repeated cells of a chunk, the first occurrence is kept
+    void DropRepeatedCells(std::vector<Int3>& cells, const size_t chunkSize)
+    {
+        BrickGrid<uint8_t> seen(chunkSize);
+        std::erase_if(cells, [&seen](const Int3& cell) { return std::exchange(seen.At(cell), uint8_t(1)) != 0; });
+    }
+
+    /// Ray counts of coarse pyramid levels and of several layers stay at the largest count instead of wrapping around
+    inline uint32_t AddSaturated(const uint32_t a, const uint32_t b)
+    {
+        return b < std::numeric_limits<uint32_t>::max() - a ? a + b : std::numeric_limits<uint32_t>::max();
+    }
+
+    /// Writes the clamped ray count and the normalized direction of a cell into the chunk, in the encoding of its
+    /// direction grid. Returns if the ray count was clamped to the range of rdType.
+    bool Export(const Int3& voxel, const VolumetricSampler::CellSum& cell, VolumetricSampler::ChunkData& chunk)
+    {
+        using rdType = VolumetricSampler::rdType;
+        constexpr uint32_t maxDensity = std::numeric_limits<rdType>::max() - 1;
+        const rdType       density    = static_cast<rdType>(std::min<uint32_t>(cell.rays, maxDensity));
+        chunk.rayDensity.At(voxel) = density;
+        chunk.maxRays              = std::max(chunk.maxRays, density);
+
+        if (chunk.packedDirections.empty()) {
+            chunk.directions.At(voxel) = linalg::normalize(cell.direction);
+        } else if (cell.direction != Float3(0.f)) {
+            chunk.packedDirections.At(voxel) = VolumetricSampler::PackDirection(linalg::normalize(cell.direction));
+        }
+        return maxDensity < cell.rays;
+    }
+
+    void WarnClampedCells(const size_t clampedCells)
+    {
+        if (clampedCells != 0) {
+            spdlog::warn("VS::Sampler - {} cells hold more rays than the density range, they are clamped to {}",
+                         clampedCells,
+                         std::numeric_limits<VolumetricSampler::rdType>::max() - 1);
+        }
+    }
+
+    /// Segment of the ray from tMin to tMax in units of chunks of voxelSize, relative to origin
+    VoxelSegment<double> ChunkSegment(const Ray& ray, const float tMax, const Float3& origin, const float voxelSize)
+    {
+        Double3 start = ray.origin + ray.direction * ray.tMin * 1.0;
+        Double3 end   = ray.origin + ray.direction * tMax * 1.0;
+        start         = start - origin;
+        end           = end - origin;
+        start         = start / voxelSize;
+        end           = end / voxelSize;
+        return {start, end};
+    }
+
+    /// Visits every chunk the segment crosses once, including the one holding its end. Unlike VoxelTrace the segment
+    /// may leave the bounds the chunk grid was created for, negative chunk indices are visited as well. Coordinates in
+    /// (-1, 0) are rounding errors at the lower bounds and stay in chunk 0.
+    template <typename Visitor>
+    void ForEachCrossedChunk(const VoxelSegment<double>& segment, Visitor&& visit)
+    {
+        const Double3 lowest = linalg::min(segment.start, segment.end);
+        Double3       shift(0.0);
+        for (int axis = 0; axis < 3; axis++) {
+            if (lowest[axis] <= -1.0) {
+                shift[axis] = std::floor(lowest[axis]);
+            }
+        }
+        const Int3    offset = Int3(shift);
+        const Double3 start  = segment.start - shift;
+        const Double3 end    = segment.end - shift;
+
+        Int3 lastChunk(std::numeric_limits<int32_t>::min());
+        VoxelTrace(start, end, [&visit, &lastChunk, &offset](const Int3& voxel) {
+            // Axis parallel segments starting on a chunk boundary visit their first chunk twice
+            if (voxel + offset != lastChunk) {
+                lastChunk = voxel + offset;
+                visit(lastChunk);
+            }
+        });
+        // VoxelTrace stops before visiting the voxel holding the end point
+        const Int3 endChunk = Int3(end) + offset;
+        if (endChunk != lastChunk) {
+            visit(endChunk);
+        }
+    }
+
+    template <typename Chunk>
+    size_t ByteSize(const std::vector<Chunk>& chunks)
+    {
+        return std::transform_reduce(chunks.begin(), chunks.end(), size_t(0), std::plus<>(), [](const Chunk& chunk) {
+            return chunk.ByteSize();
+        });
+    }
+
+    template <typename Chunk, size_t N>
+    size_t ByteSize(const std::array<std::vector<Chunk>, N>& levels)
+    {
+        size_t byteSize = 0;
+        for (const auto& level : levels) {
+            byteSize += ByteSize(level);
+        }
+        return byteSize;
+    }
+}  // namespace
+
 const VolumetricSampler::rdType& VolumetricSampler::ChunkData::RayDenity(const size_t& x,
                                                                          const size_t& y,
                                                                          const size_t& z) const
 {
-    return rayDensity[x * chunkSize * chunkSize + y * chunkSize + z];
+    return rayDensity.Get(Int3(x, y, z));
+}
+
+Float3 VolumetricSampler::ChunkData::Directions(const size_t& x, const size_t& y, const size_t& z) const
+{
+    if (!packedDirections.empty()) {
+        return UnpackDirection(packedDirections.Get(Int3(x, y, z)));
+    }
+    return directions.Get(Int3(x, y, z));
 }
 
-const Float3& VolumetricSampler::ChunkData::Directions(const size_t& x, const size_t& y, const size_t& z) const
+size_t VolumetricSampler::ChunkData::ByteSize() const
 {
-    return directions[x * chunkSize * chunkSize + y * chunkSize + z];
+    return rayDensity.ByteSize() + directions.ByteSize() + packedDirections.ByteSize() + sizeof(ChunkData);
+}
+
+size_t VolumetricSampler::ChunkSums::ByteSize() const
+{
+    size_t byteSize = sizeof(ChunkSums);
+    for (const auto& layer : layers) {
+        byteSize += layer.cells.ByteSize();
+    }
+    return byteSize;
+}
+
+VolumetricSampler::PackedDirection VolumetricSampler::PackDirection(const Float3& direction)
+{
+    const Float2 oct = encodeOctahedral(direction);
+    return PackedDirection(static_cast<int8_t>(std::round(oct.x * 127.f)),
+                           static_cast<int8_t>(std::round(oct.y * 127.f)));
+}
+
+Float3 VolumetricSampler::UnpackDirection(const PackedDirection& packed)
+{
+    return decodeOctahedral(Float2(packed.x / 127.f, packed.y / 127.f));
+}
+
+float VolumetricSampler::Coverage::Ratio() const
+{
+    return crossings == 0 ? 1.f : static_cast<float>(keptCrossings) / crossings;
 }
 
 void VolumetricSampler::SetFilter(const RayFilter filter)
 {
-    dirty_ = true;
     if (filter == RayFilter::None) {
         spdlog::warn("VolumetricSampler::SetFilter was set to RayFilter::None");
     }
+    Cancel();
     filter_ = filter;
+    // Otherwise the next Sample composes the volume
+    if (!IsDirty()) {
+        Compose();
+    }
 }
 
 void VolumetricSampler::SetChunkSize(const size_t chunkSize)
 {
+    Cancel();
     dirty_     = true;
     chunkSize_ = chunkSize;
+    // Odd chunk sizes have no pyramid, the cell size of the current level is sampled instead
+    if (chunkSize_ % 2 != 0) {
+        cellSize_ = CellSize();
+        level_    = 0;
+    }
 }
 
 void VolumetricSampler::SetCellSize(float cellSize)
 {
+    Cancel();
+    const size_t levels = chunkSize_ % 2 == 0 ? PyramidLevels : 1;
+    for (size_t level = 0; level < levels; level++) {
+        if (cellSize == cellSize_ * static_cast<float>(1 << level)) {
+            // Otherwise the next Sample builds the pyramid and composes the level
+            if (level != level_ && !IsDirty()) {
+                level_ = level;
+                Compose();
+            }
+            level_ = level;
+            return;
+        }
+    }
     dirty_    = true;
     cellSize_ = cellSize;
+    level_    = 0;
 }
 
 void VolumetricSampler::SetMaxT(std::optional<float> maxT)
 {
+    Cancel();
     dirty_ = true;
     maxT_  = maxT;
 }
 
+void VolumetricSampler::SetMissTolerance(const float missTolerance)
+{
+    if (missTolerance == missTolerance_) {
+        return;
+    }
+    Cancel();
+    missTolerance_ = missTolerance;
+    // Sorted on the first change only, traces keep the order while they are resident
+    if (IsMovePending() && !trace->HasHitMargins()) {
+        trace->SortHitMargins();
+    }
+    // The next Sample or background job moves the rays changing class, unless sampling again is cheaper
+    if (IsMovePending() && !MovedRays()) {
+        dirty_ = true;
+    }
+}
+
+void VolumetricSampler::SetMemoryBudget(const size_t memoryBudget)
+{
+    Cancel();
+    dirty_        = true;
+    memoryBudget_ = memoryBudget;
+}
+
+void VolumetricSampler::SetMaxChunkCount(const size_t maxChunkCount)
+{
+    Cancel();
+    dirty_         = true;
+    maxChunkCount_ = maxChunkCount;
+}
+
+void VolumetricSampler::SetWorkerCount(const size_t workerCount)
+{
+    Cancel();
+    workerCount_ = workerCount;
+    pool_.reset();
+}
+
+void VolumetricSampler::SetProgressive(const bool progressive)
+{
+    Cancel();
+    progressive_ = progressive;
+}
+
+void VolumetricSampler::SetDirectionEncoding(const DirectionEncoding encoding)
+{
+    Cancel();
+    dirty_             = true;
+    directionEncoding_ = encoding;
+}
+
+size_t VolumetricSampler::ChunkByteSize() const
+{
+    return ChunkByteSize(DenseBricks());
+}
+
+size_t VolumetricSampler::ChunkByteSize(const ChunkBricks& bricks) const
+{
+    const bool   exact         = directionEncoding_ == DirectionEncoding::Exact;
+    const size_t directionSize = exact ? BrickGrid<Float3>::ByteSize(chunkSize_, bricks.any)
+                                       : BrickGrid<PackedDirection>::ByteSize(chunkSize_, bricks.any);
+    size_t       layerSize     = sizeof(ChunkSums);
+    size_t       pyramidSize   = 0;
+    for (size_t layer = 0; layer < LayerCount; layer++) {
+        layerSize += BrickGrid<CellSum>::ByteSize(chunkSize_, bricks.layers[layer]);
+        pyramidSize += bricks.pyramid[layer] * sizeof(BrickGrid<CellSum>::Brick);
+    }
+    // At most one chunk per pyramid level is created for the chunk
+    if (chunkSize_ % 2 == 0) {
+        pyramidSize +=
+            (PyramidLevels - 1) * (sizeof(ChunkSums) + LayerCount * BrickGrid<CellSum>::ByteSize(chunkSize_, 0));
+    }
+    return BrickGrid<rdType>::ByteSize(chunkSize_, bricks.any) + directionSize + sizeof(ChunkData) + layerSize +
+           pyramidSize;
+}
+
+VolumetricSampler::ChunkBricks VolumetricSampler::DenseBricks() const
+{
+    ChunkBricks bricks;
+    bricks.layers.fill(BrickGrid<CellSum>::BricksFor(chunkSize_));
+    bricks.any = BrickGrid<CellSum>::BricksFor(chunkSize_);
+    // A chunk fills 1/8 of its chunk on the next level, 1/64 on the one after and so on
+    for (size_t level = 1; level < PyramidLevels && chunkSize_ % 2 == 0; level++) {
+        for (auto& pyramidBricks : bricks.pyramid) {
+            pyramidBricks += BrickGrid<CellSum>::BricksFor(chunkSize_ >> level);
+        }
+    }
+    return bricks;
+}
+
+size_t VolumetricSampler::TaskByteSize() const
+{
+    return StagingByteSize(layers_.chunks.size());
+}
+
+size_t VolumetricSampler::SliceByteSize() const
+{
+    const size_t bricks = BrickGrid<CellSum>::BricksFor(chunkSize_);
+    return LayerCount * (directionEncoding_ == DirectionEncoding::Exact
+                             ? CellSums<Double3>::ByteSize(chunkSize_, bricks)
+                             : CellSums<Float3>::ByteSize(chunkSize_, bricks));
+}
+
+size_t VolumetricSampler::StagingByteSize(const size_t chunkCount) const
+{
+    // A chunk traced by a single slice frees its sums once it is done, so at most one per worker is alive. Fewer
+    // chunks than workers are split into less than two slices per worker, which stay until they are merged. Progressive
+    // runs keep the sums of every slice from pass to pass.
+    const size_t slices = 2 * WorkerCount();
+    return (progressive_ ? std::max(chunkCount, slices) : slices) * SliceByteSize();
+}
+
+size_t VolumetricSampler::DataByteSize() const
+{
+    return ByteSize(layers_.chunks) + PyramidByteSize() + ByteSize(volume_.chunks);
+}
+
+size_t VolumetricSampler::PyramidByteSize() const
+{
+    return ByteSize(layers_.pyramid);
+}
+
+template <typename Visitor>
+void VolumetricSampler::ForEachSegment(const Float3&                   chunkMin,
+                                       const Float3&                   chunkMax,
+                                       const std::span<const Ray>      rays,
+                                       const std::span<const uint32_t> rayIndices,
+                                       const std::stop_token&          stop,
+                                       const float                     missTolerance,
+                                       Visitor&&                       visit) const
+{
+    RayPacket                            packet = {};
+    RayPacketHits                        hits;
+    std::array<size_t, RayPacket::Width> layers;  // Layer of the ray in each lane
+    for (size_t first = 0; first < rayIndices.size() && !stop.stop_requested(); first += RayPacket::Width) {
+        const size_t count = std::min(RayPacket::Width, rayIndices.size() - first);
+        for (size_t lane = 0; lane < count; lane++) {
+            const auto& ray  = rays[rayIndices[first + lane]];
+            const float maxT = std::min(ray.tHitOrTMax(missTolerance), maxT_.value_or(ray.tMax));
+            packet.Set(lane, ray.origin, ray.direction, maxT);
+            layers[lane] = ray.HasHit(missTolerance) ? HitLayer : MissLayer;
+        }
+        IntersectAABB(packet, count, chunkMin, chunkMax, hits);
+
+        for (size_t lane = 0; lane < count; lane++) {
+            const auto& ray = rays[rayIndices[first + lane]];
+            if (!hits.Hit(lane)) {
+                visit(layers[lane], ray, nullptr);
+                continue;
+            }
+            const Float2 minMax = hits.MinMax(lane);
+            const float  maxT   = packet.tMax[lane];
+
+            Double3 start = ray.origin + ray.direction * static_cast<double>(std::max(minMax.x, ray.tMin));
+            Double3 end   = ray.origin + ray.direction * static_cast<double>(std::min(minMax.y, maxT));
+            start         = start - chunkMin;
+            end           = end - chunkMin;
+            start         = start / cellSize_;
+            end           = end / cellSize_;
+
+            const auto assertRoundingError = 0.1;
+            const auto upperAssertLimit    = chunkSize_ + assertRoundingError;
+            assert(-assertRoundingError < start.x && start.x < upperAssertLimit);
+            assert(-assertRoundingError <= start.y && start.y < upperAssertLimit);
+            assert(-assertRoundingError <= start.z && start.z < upperAssertLimit);
+            assert(-assertRoundingError <= end.x && end.x < upperAssertLimit);
+            assert(-assertRoundingError <= end.y && end.y < upperAssertLimit);
+            assert(-assertRoundingError <= end.z && end.z < upperAssertLimit);
+
+            const VoxelSegment<double> segment = {start, end};
+            visit(layers[lane], ray, &segment);
+        }
+    }
+}
+
+template <typename Sums>
+void VolumetricSampler::TraceRays(const ChunkSums&                task,
+                                  const std::span<const Ray>      rays,
+                                  const std::span<const uint32_t> rayIndices,
+                                  Sums&                           sums,
+                                  const std::stop_token&          stop,
+                                  const float                     missTolerance) const
+{
+    const auto size = static_cast<int32_t>(chunkSize_);
+    ForEachSegment(task.min,
+                   task.max,
+                   rays,
+                   rayIndices,
+                   stop,
+                   missTolerance,
+                   [&sums, size](const size_t layer, const Ray& ray, const VoxelSegment<double>* segment) {
+                       sums.rays[layer]++;
+                       if (!segment) {
+                           sums.missedRays[layer]++;
+                           return;
+                       }
+                       VoxelTraceClipped(segment->start,
+                                         segment->end,
+                                         size,
+                                         [&cells = sums.layers[layer], &dir = ray.direction](const Int3& voxel) {
+                                             cells.Add(voxel, dir);
+                                         });
+                   });
+}
+
+VolumetricSampler::ChunkBricks VolumetricSampler::CountBricks(const Int3&                     chunkIdx,
+                                                              const Float3&                   origin,
+                                                              const std::span<const Ray>      rays,
+                                                              const std::span<const uint32_t> rayIndices) const
+{
+    // The segments are traced at brick resolution, which visits the bricks holding the cells TraceRays visits
+    constexpr size_t brickSize     = BrickGrid<CellSum>::BrickSize;
+    const auto       bricksPerAxis = static_cast<int32_t>((chunkSize_ + brickSize - 1) / brickSize);
+    const float      voxelSize     = chunkSize_ * cellSize_;
+    const Float3     chunkMin      = Float3(chunkIdx) * voxelSize + origin;
+
+    std::vector<uint8_t> occupied(BrickGrid<CellSum>::BricksFor(chunkSize_));  // Bit i is set for layer i
+    ForEachSegment(
+        chunkMin,
+        chunkMin + Float3(voxelSize),
+        rays,
+        rayIndices,
+        {},
+        missTolerance_,
+        [&](const size_t layer, const Ray&, const VoxelSegment<double>* segment) {
+            if (!segment) {
+                return;
+            }
+            const auto mark = [&occupied, bricksPerAxis, layer](const Int3& brick) {
+                occupied[(brick.x * bricksPerAxis + brick.y) * bricksPerAxis + brick.z] |= uint8_t(1) << layer;
+            };
+            // VoxelTrace leaves out the voxel holding the end, at brick resolution it may hold traced cells
+            const Double3 start = segment->start / static_cast<double>(brickSize);
+            const Double3 end   = segment->end / static_cast<double>(brickSize);
+            VoxelTraceClipped(start, end, bricksPerAxis, mark);
+            mark(Int3(linalg::clamp(end, Double3(0.), Double3(bricksPerAxis - 0.001))));
+        });
+
+    ChunkBricks bricks;
+    for (const uint8_t layerBits : occupied) {
+        for (size_t layer = 0; layer < LayerCount; layer++) {
+            bricks.layers[layer] += (layerBits >> layer) & 1;
+        }
+        bricks.any += layerBits != 0;
+    }
+    if (chunkSize_ % 2 != 0) {
+        return bricks;
+    }
+
+    // The chunk fills a part of one chunk on every pyramid level, its bricks there are counted as if no neighbour
+    // shared them
+    const auto size       = static_cast<int32_t>(chunkSize_);
+    const auto brickCells = static_cast<int32_t>(brickSize);
+    for (size_t level = 1; level < PyramidLevels; level++) {
+        const int32_t        mask = (1 << level) - 1;
+        const Int3           base = Int3(chunkIdx.x & mask, chunkIdx.y & mask, chunkIdx.z & mask) * size;
+        std::vector<uint8_t> levelOccupied(occupied.size());
+        for (size_t brickIdx = 0; brickIdx < occupied.size(); brickIdx++) {
+            if (occupied[brickIdx] == 0) {
+                continue;
+            }
+            const Int3 brick(brickIdx / (bricksPerAxis * bricksPerAxis),
+                             (brickIdx / bricksPerAxis) % bricksPerAxis,
+                             brickIdx % bricksPerAxis);
+            const Int3 first = ((base + brick * brickCells) >> static_cast<int32_t>(level)) / brickCells;
+            const Int3 last  = ((base + (brick + 1) * brickCells - 1) >> static_cast<int32_t>(level)) / brickCells;
+            for (int32_t x = first.x; x <= last.x; x++) {
+                for (int32_t y = first.y; y <= last.y; y++) {
+                    for (int32_t z = first.z; z <= last.z; z++) {
+                        levelOccupied[(x * bricksPerAxis + y) * bricksPerAxis + z] |= occupied[brickIdx];
+                    }
+                }
+            }
+        }
+        for (const uint8_t layerBits : levelOccupied) {
+            for (size_t layer = 0; layer < LayerCount; layer++) {
+                bricks.pyramid[layer] += (layerBits >> layer) & 1;
+            }
+        }
+    }
+    return bricks;
+}
+
+template <typename Sum>
+size_t VolumetricSampler::FillChunks(std::vector<ChunkSums>&                                      chunks,
+                                     const std::span<const Ray>                                   rays,
+                                     const std::vector<std::vector<std::uint32_t>>&               taskRays,
+                                     const std::vector<std::vector<size_t>>&                      passEnds,
+                                     const std::function<void(size_t, std::vector<ChunkSums>&&)>& preview,
+                                     const TaskPool::Progress&                                    progress,
+                                     const std::stop_token&                                       stop) const
+{
+    // With at least one chunk per thread every chunk is a single slice, the ones with most rays are traced first.
+    // Otherwise the rays of each chunk are split into slices traced into private sums, which are reduced pairwise.
+    struct Slice {
+        size_t                       task;
+        size_t                       first;
+        size_t                       last;
+        std::optional<TaskSums<Sum>> sums;  // Kept from pass to pass
+    };
+    const size_t threads        = pool_->WorkerCount();
+    const size_t slicesPerChunk =
+        chunks.empty() || threads <= chunks.size() ? 1 : (threads + chunks.size() - 1) / chunks.size();
+    std::vector<Slice>                     slices;
+    std::vector<std::pair<size_t, size_t>> chunkSlices;  // First slice and slice count of each chunk
+    slices.reserve(chunks.size() * slicesPerChunk);
+    for (size_t task = 0; task < chunks.size(); task++) {
+        const size_t rayCount = taskRays[task].size();
+        const size_t count    = std::clamp<size_t>(rayCount / MinRaysPerSlice, 1, slicesPerChunk);
+        chunkSlices.emplace_back(slices.size(), count);
+        for (size_t i = 0; i < count; i++) {
+            slices.push_back({task, rayCount * i / count, rayCount * (i + 1) / count, std::nullopt});
+        }
+    }
+
+    // A slice traces the rays of each pass in order, so its sums do not depend on the number of passes
+    const size_t passCount = passEnds.empty() ? 1 : passEnds.front().size();
+    for (size_t pass = 0; pass < passCount && !stop.stop_requested(); pass++) {
+        const bool lastPass  = pass + 1 == passCount;
+        const auto passRange = [&](const Slice& slice) {
+            const size_t passBegin = pass == 0 ? 0 : passEnds[slice.task][pass - 1];
+            const size_t first     = std::max(slice.first, passBegin);
+            return std::pair(first, std::max(std::min(slice.last, passEnds[slice.task][pass]), first));
+        };
+
+        std::vector<size_t> costs(slices.size());
+        std::transform(slices.begin(), slices.end(), costs.begin(), [&passRange](const Slice& slice) {
+            const auto [first, last] = passRange(slice);
+            return last - first;
+        });
+        pool_->ParallelFor(
+            slices.size(),
+            [&](const size_t sliceIdx) {
+                if (stop.stop_requested()) {
+                    return;
+                }
+                Slice& slice = slices[sliceIdx];
+                if (!slice.sums) {
+                    slice.sums.emplace(chunkSize_);
+                }
+                const auto [first, last] = passRange(slice);
+                const std::span<const uint32_t> rayIndices(taskRays[slice.task].data() + first, last - first);
+                TraceRays(chunks[slice.task], rays, rayIndices, *slice.sums, stop, missTolerance_);
+
+                // Chunks of a single slice are complete right away, which frees their sums early
+                if (lastPass && chunkSlices[slice.task].second == 1) {
+                    slice.sums->Apply(chunks[slice.task], false);
+                    slice.sums.reset();
+                }
+            },
+            costs,
+            progress);
+
+        if (!lastPass && preview && !stop.stop_requested()) {
+            std::vector<ChunkSums> snapshot(chunks.size());
+            pool_->ParallelFor(chunks.size(), [&](const size_t taskIdx) {
+                ChunkSums& chunk = snapshot[taskIdx];
+                chunk.chunkIdx   = chunks[taskIdx].chunkIdx;
+                chunk.min        = chunks[taskIdx].min;
+                chunk.max        = chunks[taskIdx].max;
+                for (auto& layer : chunk.layers) {
+                    layer.cells = BrickGrid<CellSum>(chunkSize_);
+                }
+                const auto [first, count] = chunkSlices[taskIdx];
+                for (size_t i = first; i < first + count; i++) {
+                    slices[i].sums->Apply(chunk, false);
+                }
+            });
+            preview(pass, std::move(snapshot));
+        }
+    }
+
+    // Merge slice i + stride into slice i, all pairs of a round are independent
+    for (size_t stride = 1; stride < slicesPerChunk && !stop.stop_requested(); stride *= 2) {
+        std::vector<std::pair<size_t, size_t>> pairs;
+        for (const auto& [first, count] : chunkSlices) {
+            for (size_t i = 0; i + stride < count; i += 2 * stride) {
+                pairs.emplace_back(first + i, first + i + stride);
+            }
+        }
+        pool_->ParallelFor(pairs.size(), [&slices, &pairs](const size_t pairIdx) {
+            Slice& target = slices[pairs[pairIdx].first];
+            Slice& source = slices[pairs[pairIdx].second];
+            target.sums->Merge(*source.sums);
+            source.sums.reset();
+        });
+    }
+
+    if (stop.stop_requested()) {
+        return slices.size();
+    }
+    pool_->ParallelFor(chunks.size(), [&](const size_t taskIdx) {
+        Slice& slice = slices[chunkSlices[taskIdx].first];
+        if (slice.sums) {
+            slice.sums->Apply(chunks[taskIdx], false);
+            slice.sums.reset();
+        }
+    });
+    return slices.size();
+}
+
+TaskPool& VolumetricSampler::Pool()
+{
+    if (!pool_) {
+        pool_ = std::make_unique<TaskPool>(workerCount_);
+    }
+    return *pool_;
+}
+
+size_t VolumetricSampler::WorkerCount() const
+{
+    if (pool_) {
+        return pool_->WorkerCount();
+    }
+    return 0 < workerCount_ ? workerCount_ : std::max(std::thread::hardware_concurrency(), 1U);
+}
+
+size_t VolumetricSampler::ChunkLimit() const
+{
+    if (memoryBudget_ == UnlimitedMemoryBudget) {
+        return maxChunkCount_;
+    }
+    // The staging of a single pass is independent of the number of chunks
+    const size_t staging  = StagingByteSize(0);
+    const size_t perChunk = ChunkByteSize(DenseBricks());
+    return std::min(maxChunkCount_, staging < memoryBudget_ ? (memoryBudget_ - staging) / perChunk : 0);
+}
+
+size_t VolumetricSampler::FreeByteSize(const Layers& layers) const
+{
+    if (memoryBudget_ == UnlimitedMemoryBudget) {
+        return std::numeric_limits<size_t>::max();
+    }
+    const size_t used =
+        ByteSize(layers.chunks) + ByteSize(layers.pyramid) + ByteSize(volume_.chunks) + StagingByteSize(0);
+    return used < memoryBudget_ ? memoryBudget_ - used : 0;
+}
+
+VolumetricSampler::ChunkSums VolumetricSampler::MakeChunk(const Int3&   chunkIdx,
+                                                         const Float3& origin,
+                                                         const size_t  level) const
+{
+    const float voxelSize = chunkSize_ * cellSize_ * static_cast<float>(1 << level);
+    ChunkSums   chunk     = {};
+    chunk.chunkIdx        = chunkIdx;
+    chunk.min             = Float3(chunkIdx) * voxelSize + origin;
+    chunk.max             = chunk.min + Float3(voxelSize);
+    for (auto& layer : chunk.layers) {
+        layer.cells = BrickGrid<CellSum>(chunkSize_);
+    }
+    return chunk;
+}
+
+template <typename Sum>
+std::optional<std::vector<VolumetricSampler::TouchedChunk>> VolumetricSampler::UpdateChunks(
+    Layers&                         layers,
+    const std::span<const Ray>      rays,
+    const std::span<const uint32_t> removedRays,
+    const float                     removeTolerance,
+    const std::span<const uint32_t> addedRays,
+    const std::stop_token&          stop) const
+{
+    const float  voxelSize  = chunkSize_ * cellSize_;
+    const size_t chunkBytes = ChunkByteSize();
+    size_t       freeBytes  = FreeByteSize(layers);
+
+    std::unordered_map<Int3, size_t> chunkSlots;  // Index into layers.chunks
+    for (size_t i = 0; i < layers.chunks.size(); i++) {
+        chunkSlots.emplace(layers.chunks[i].chunkIdx, i);
+    }
+
+    // The segment of each ray is removed from or added to the chunks it crosses. The grid of the layers is kept, new
+    // chunks are created while the budget left by the current data fits them with all bricks allocated.
+    const size_t                       previousChunks   = layers.chunks.size();
+    const Coverage                     previousCoverage = layers.coverage;
+    std::vector<std::vector<uint32_t>> chunkRemovedRays(layers.chunks.size());
+    std::vector<std::vector<uint32_t>> chunkAddedRays(layers.chunks.size());
+    Coverage&                          coverage = layers.coverage;
+    const auto binRays = [&](const std::span<const uint32_t> rayIndices, const bool add) {
+        const float tolerance = add ? missTolerance_ : removeTolerance;
+        for (const uint32_t rayIdx : rayIndices) {
+            const Ray&  ray  = rays[rayIdx];
+            const float tMax = std::min(ray.tHitOrTMax(tolerance), maxT_.value_or(ray.tMax));
+            ForEachCrossedChunk(ChunkSegment(ray, tMax, layers.origin, voxelSize), [&](const Int3& chunkIdx) {
+                auto slot = chunkSlots.find(chunkIdx);
+                if (slot == chunkSlots.end() && add && layers.chunks.size() < maxChunkCount_ &&
+                    chunkBytes <= freeBytes) {
+                    freeBytes -= chunkBytes;
+                    slot = chunkSlots.emplace(chunkIdx, layers.chunks.size()).first;
+                    layers.chunks.push_back(MakeChunk(chunkIdx, layers.origin));
+                    chunkRemovedRays.emplace_back();
+                    chunkAddedRays.emplace_back();
+                    coverage.chunkCount++;
+                    coverage.keptChunks++;
+                }
+                // Chunks beyond the limit are only accounted for by their crossings
+                const bool kept = slot != chunkSlots.end();
+                if (add) {
+                    coverage.crossings++;
+                    coverage.keptCrossings += kept;
+                } else {
+                    coverage.crossings--;
+                    coverage.keptCrossings -= kept;
+                }
+                if (kept) {
+                    (add ? chunkAddedRays : chunkRemovedRays)[slot->second].push_back(rayIdx);
+                }
+            });
+        }
+    };
+    binRays(removedRays, false);
+    binRays(addedRays, true);
+
+    std::vector<TouchedChunk> touched;
+    std::vector<size_t>       costs;
+    for (size_t i = 0; i < layers.chunks.size(); i++) {
+        if (!chunkRemovedRays[i].empty() || !chunkAddedRays[i].empty()) {
+            touched.push_back({i, {}});
+            costs.push_back(chunkRemovedRays[i].size() + chunkAddedRays[i].size());
+        }
+    }
+
+    // All chunks are traced before the first one changes, so a stop leaves the layers as they were
+    std::vector<std::optional<std::pair<TaskSums<Sum>, TaskSums<Sum>>>> sums(touched.size());  // Removed and added
+    pool_->ParallelFor(
+        touched.size(),
+        [&](const size_t i) {
+            const ChunkSums& chunk = layers.chunks[touched[i].chunk];
+            auto&            pair  = sums[i].emplace(TaskSums<Sum>(chunkSize_), TaskSums<Sum>(chunkSize_));
+            TraceRays(chunk, rays, chunkRemovedRays[touched[i].chunk], pair.first, stop, removeTolerance);
+            TraceRays(chunk, rays, chunkAddedRays[touched[i].chunk], pair.second, stop, missTolerance_);
+        },
+        costs);
+    if (stop.stop_requested()) {
+        layers.chunks.erase(layers.chunks.begin() + previousChunks, layers.chunks.end());
+        layers.coverage = previousCoverage;
+        return std::nullopt;
+    }
+
+    pool_->ParallelFor(touched.size(), [&](const size_t i) {
+        TouchedChunk& touchedChunk = touched[i];
+        ChunkSums&    chunk        = layers.chunks[touchedChunk.chunk];
+        sums[i]->first.Apply(chunk, true, &touchedChunk.cells);
+        sums[i]->second.Apply(chunk, false, &touchedChunk.cells);
+        sums[i].reset();
+        DropRepeatedCells(touchedChunk.cells, chunkSize_);
+    });
+    return touched;
+}
+
+template <typename Sum>
+bool VolumetricSampler::MoveRays(Layers&                         layers,
+                                 const std::span<const uint32_t> movedRays,
+                                 const std::stop_token&          stop) const
+{
+    const auto  begin             = std::chrono::steady_clock::now();
+    const float previousTolerance = layers.missTolerance;
+
+    const auto touched = UpdateChunks<Sum>(layers, trace->rays, movedRays, previousTolerance, movedRays, stop);
+    if (!touched) {
+        spdlog::info("VS::Sampler - cancelled moving rays, the layers are unchanged");
+        return false;
+    }
+
+    const size_t from = previousTolerance < missTolerance_ ? HitLayer : MissLayer;
+    const size_t to   = from == HitLayer ? MissLayer : HitLayer;
+    layers.rayCount[from] -= movedRays.size();
+    layers.rayCount[to] += movedRays.size();
+    layers.missTolerance = missTolerance_;
+    const size_t touchedCount = touched->size();
+    UpdatePyramid(layers, std::move(*touched));
+
+    const auto end = std::chrono::steady_clock::now();
+    spdlog::info("VS::Sampler - moved {} rays to the {} layer, traced {} chunks again in {}s",
+                 movedRays.size(),
+                 to == HitLayer ? "hit" : "miss",
+                 touchedCount,
+                 std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() / 1000.f);
+    return true;
+}
+
+std::optional<std::span<const uint32_t>> VolumetricSampler::MovedRays() const
+{
+    if (dirty_ || layers_.missTolerance == missTolerance_ || !trace->HasHitMargins()) {
+        return std::nullopt;
+    }
+    // Moving a ray traces it twice, beyond this share of the trace or this many rays sampling it again is cheaper
+    constexpr size_t maxMovedShare = 4;
+    const auto [first, last]       = trace->HitMarginRange(layers_.missTolerance, missTolerance_);
+    if (std::min(trace->rays.size() / maxMovedShare, MaxMovedRays) < last - first) {
+        return std::nullopt;
+    }
+    return std::span<const uint32_t>(trace->rayByHitMargin.data() + first, last - first);
+}
+
+void VolumetricSampler::MarkDirty()
+{
+    Cancel();
+    dirty_ = true;
+}
+
 void VolumetricSampler::Sample()
+{
+    Cancel();
+    Pool();
+    if (const auto movedRays = MovedRays()) {
+        directionEncoding_ == DirectionEncoding::Exact ? MoveRays<Double3>(layers_, *movedRays, {})
+                                                       : MoveRays<Float3>(layers_, *movedRays, {});
+    } else {
+        Sample(layers_, std::stop_token());
+        dirty_ = false;
+    }
+    Compose();
+}
+
+void VolumetricSampler::SampleAsync()
+{
+    Cancel();
+    Pool();
+    jobDone_ = false;
+
+    // The job owns the layers while it moves rays between them, a cancelled move hands them back unchanged
+    if (const auto movedRays = MovedRays()) {
+        moveJob_ = true;
+        job_     = std::jthread(
+            [this, movedRays = *movedRays, layers = std::make_unique<Layers>(std::move(layers_))](
+                const std::stop_token stop) mutable {
+                directionEncoding_ == DirectionEncoding::Exact ? MoveRays<Double3>(*layers, movedRays, stop)
+                                                               : MoveRays<Float3>(*layers, movedRays, stop);
+                jobLayers_ = std::move(layers);
+                jobDone_   = true;
+            });
+        return;
+    }
+    job_ = std::jthread([this](const std::stop_token stop) {
+        const auto preview = [this](std::unique_ptr<Layers> layers) {
+            std::lock_guard lock(previewMutex_);
+            jobPreview_   = std::move(layers);
+            previewReady_ = true;
+        };
+        auto layers = std::make_unique<Layers>();
+        if (Sample(*layers, stop, progressive_ ? Preview(preview) : Preview())) {
+            jobLayers_ = std::move(layers);
+        }
+        jobDone_ = true;
+    });
+}
+
+std::chrono::microseconds VolumetricSampler::Cancel()
+{
+    if (!job_.joinable()) {
+        return std::chrono::microseconds(0);
+    }
+    const bool running = !jobDone_;
+    const auto begin   = std::chrono::steady_clock::now();
+    job_.request_stop();
+    job_.join();
+    if (moveJob_) {
+        // A move that completed meanwhile is kept, the volume is composed from its layers right away
+        const bool moved = jobLayers_->missTolerance == missTolerance_;
+        layers_          = std::move(*jobLayers_);
+        moveJob_         = false;
+        if (moved) {
+            Compose();
+        }
+    }
+    jobLayers_.reset();
+    jobPreview_.reset();
+    previewReady_ = false;
+    const auto latency =
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - begin);
+    if (running) {
+        spdlog::info("VS::Sampler - cancelled background job, stopped in {}ms", latency.count() / 1000.f);
+    }
+    return latency;
+}
+
+bool VolumetricSampler::FinishSampleAsync()
+{
+    if (!IsSampleReady()) {
+        return false;
+    }
+    if (!jobDone_) {
+        {
+            std::lock_guard lock(previewMutex_);
+            layers_       = std::move(*jobPreview_);
+            previewReady_ = false;
+            jobPreview_.reset();
+        }
+        Compose();
+        return true;
+    }
+    job_.join();
+    jobPreview_.reset();
+    previewReady_ = false;
+    if (!jobLayers_) {
+        return false;
+    }
+    layers_ = std::move(*jobLayers_);
+    jobLayers_.reset();
+    dirty_   = false;
+    moveJob_ = false;
+    Compose();
+    return true;
+}
+
+void VolumetricSampler::BuildPyramid(Layers& layers, const std::stop_token& stop) const
+{
+    const auto begin = std::chrono::steady_clock::now();
+    for (auto& level : layers.pyramid) {
+        level.clear();
+    }
+    if (chunkSize_ % 2 != 0) {
+        return;
+    }
+
+    // Every chunk covers the 2^3 chunks of the finer level it starts at, each of them filling one octant
+    const int32_t                 half  = static_cast<int32_t>(chunkSize_ / 2);
+    const std::vector<ChunkSums>* finer = &layers.chunks;
+    for (size_t level = 1; level < PyramidLevels && !stop.stop_requested(); level++) {
+        std::vector<ChunkSums>&          chunks = layers.pyramid[level - 1];
+        std::vector<std::vector<size_t>> children;
+        std::unordered_map<Int3, size_t> chunkSlots;  // Index into chunks
+        for (size_t i = 0; i < finer->size(); i++) {
+            const Int3& childIdx = (*finer)[i].chunkIdx;
+            const Int3  chunkIdx(childIdx.x >> 1, childIdx.y >> 1, childIdx.z >> 1);
+            const auto [slot, created] = chunkSlots.emplace(chunkIdx, chunks.size());
+            if (created) {
+                chunks.push_back(MakeChunk(chunkIdx, layers.origin, level));
+                children.emplace_back();
+            }
+            children[slot->second].push_back(i);
+        }
+
+        pool_->ParallelFor(chunks.size(), [&](const size_t chunkIdx) {
+            ChunkSums& chunk = chunks[chunkIdx];
+            for (const size_t childIdx : children[chunkIdx]) {
+                const ChunkSums& child  = (*finer)[childIdx];
+                const Int3       offset = (child.chunkIdx - chunk.chunkIdx * 2) * half;
+                for (size_t layer = 0; layer < LayerCount; layer++) {
+                    ChunkLayer&       target = chunk.layers[layer];
+                    const ChunkLayer& source = child.layers[layer];
+                    source.cells.ForEachOccupied([&target, &offset](const Int3& voxel, const CellSum& cell) {
+                        if (cell.rays != 0) {
+                            CellSum& sum = target.cells.At(offset + voxel / 2);
+                            sum.direction += cell.direction;
+                            sum.rays = AddSaturated(sum.rays, cell.rays);
+                        }
+                    });
+                    target.rays = std::max(target.rays, source.rays - source.missedRays);
+                }
+            }
+        });
+        finer = &chunks;
+    }
+
+    if (stop.stop_requested()) {
+        return;
+    }
+
+    const size_t pyramidBytes = ByteSize(layers.pyramid);
+    const size_t layerBytes   = ByteSize(layers.chunks);
+    const auto   end          = std::chrono::steady_clock::now();
+    spdlog::info("VS::SamplerStep 4 - built pyramid up to {}x the cell size, {} MB ({:.1f}% of the layers) - "
+                 "finished in {}s",
+                 1 << (PyramidLevels - 1),
+                 pyramidBytes / (1024 * 1024),
+                 layerBytes == 0 ? 0.f : 100.f * pyramidBytes / layerBytes,
+                 std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() / 1000.f);
+}
+
+void VolumetricSampler::UpdatePyramid(Layers& layers, std::vector<TouchedChunk> touched) const
+{
+    if (chunkSize_ % 2 != 0) {
+        return;
+    }
+    std::array<std::vector<TouchedChunk>, PyramidLevels> touchedLevels;
+    touchedLevels[0] = std::move(touched);
+
+    // A cell sums 2^3 cells of the child in its octant, in the order BuildPyramid visits them
+    const int32_t                 half  = static_cast<int32_t>(chunkSize_ / 2);
+    const std::vector<ChunkSums>* finer = &layers.chunks;
+    for (size_t level = 1; level < PyramidLevels; level++) {
+        std::vector<ChunkSums>&          chunks = layers.pyramid[level - 1];
+        std::unordered_map<Int3, size_t> chunkSlots;  // Index into chunks
+        std::unordered_map<Int3, size_t> childSlots;  // Index into finer
+        for (size_t i = 0; i < chunks.size(); i++) {
+            chunkSlots.emplace(chunks[i].chunkIdx, i);
+        }
+        for (size_t i = 0; i < finer->size(); i++) {
+            childSlots.emplace((*finer)[i].chunkIdx, i);
+        }
+
+        std::vector<TouchedChunk>&         touchedChunks = touchedLevels[level];
+        std::unordered_map<size_t, size_t> touchedSlots;  // Index into touchedChunks
+        for (const TouchedChunk& child : touchedLevels[level - 1]) {
+            const Int3& childIdx = (*finer)[child.chunk].chunkIdx;
+            const Int3  chunkIdx(childIdx.x >> 1, childIdx.y >> 1, childIdx.z >> 1);
+            const auto [slot, created] = chunkSlots.emplace(chunkIdx, chunks.size());
+            if (created) {
+                chunks.push_back(MakeChunk(chunkIdx, layers.origin, level));
+            }
+            const auto [touchedSlot, first] = touchedSlots.emplace(slot->second, touchedChunks.size());
+            if (first) {
+                touchedChunks.push_back({slot->second, {}});
+            }
+            const Int3 offset = (childIdx - chunkIdx * 2) * half;
+            for (const Int3& cell : child.cells) {
+                touchedChunks[touchedSlot->second].cells.push_back(offset + cell / 2);
+            }
+        }
+
+        pool_->ParallelFor(touchedChunks.size(), [&](const size_t i) {
+            TouchedChunk& touchedChunk = touchedChunks[i];
+            ChunkSums&    chunk        = chunks[touchedChunk.chunk];
+            DropRepeatedCells(touchedChunk.cells, chunkSize_);
+
+            std::array<const ChunkSums*, 8> children = {};  // By octant
+            for (auto& layer : chunk.layers) {
+                layer.rays = 0;
+            }
+            for (int32_t octant = 0; octant < 8; octant++) {
+                const Int3 childIdx = chunk.chunkIdx * 2 + Int3(octant >> 2, (octant >> 1) & 1, octant & 1);
+                const auto slot     = childSlots.find(childIdx);
+                if (slot == childSlots.end()) {
+                    continue;
+                }
+                children[octant] = &(*finer)[slot->second];
+                for (size_t layer = 0; layer < LayerCount; layer++) {
+                    const ChunkLayer& source = children[octant]->layers[layer];
+                    chunk.layers[layer].rays = std::max(chunk.layers[layer].rays, source.rays - source.missedRays);
+                }
+            }
+
+            for (const Int3& cell : touchedChunk.cells) {
+                const Int3       octant = cell / half;
+                const ChunkSums* child  = children[octant.x * 4 + octant.y * 2 + octant.z];
+                const Int3       first  = (cell - octant * half) * 2;
+                for (size_t layer = 0; layer < LayerCount; layer++) {
+                    CellSum sum = {};
+                    for (int32_t j = 0; child && j < 8; j++) {
+                        const Int3     voxel  = first + Int3(j >> 2, (j >> 1) & 1, j & 1);
+                        const CellSum& source = child->layers[layer].cells.Get(voxel);
+                        if (source.rays != 0) {
+                            sum.direction += source.direction;
+                            sum.rays = AddSaturated(sum.rays, source.rays);
+                        }
+                    }
+                    BrickGrid<CellSum>& target = chunk.layers[layer].cells;
+                    if (sum.rays != 0 || target.Get(cell).rays != 0) {
+                        target.At(cell) = sum;
+                    }
+                }
+            }
+        });
+        finer = &chunks;
+    }
+}
+
+std::pair<std::vector<size_t>, size_t> VolumetricSampler::IncludedLayers() const
+{
+    std::vector<size_t> included;
+    size_t              rayCount = 0;
+    for (const size_t layer : {HitLayer, MissLayer}) {
+        const RayFilter layerFilter = layer == HitLayer ? RayFilter::IncludeHitRays : RayFilter::IncludeMissRays;
+        if (is_flag_set(layerFilter, filter_)) {
+            included.push_back(layer);
+            rayCount += layers_.rayCount[layer];
+        }
+    }
+    return {included, rayCount};
+}
+
+size_t VolumetricSampler::ComposeChunk(const ChunkSums&           sums,
+                                       const std::vector<size_t>& included,
+                                       const size_t               rayCount,
+                                       ChunkData&                 chunk) const
+{
+    chunk.chunkIdx   = sums.chunkIdx;
+    chunk.min        = sums.min;
+    chunk.max        = sums.max;
+    chunk.chunkSize  = chunkSize_;
+    chunk.maxRays    = 0;
+    chunk.rayDensity = BrickGrid<rdType>(chunkSize_);
+    if (directionEncoding_ == DirectionEncoding::Exact) {
+        chunk.directions = BrickGrid<Float3>(chunkSize_);
+    } else {
+        chunk.packedDirections = BrickGrid<PackedDirection>(chunkSize_);
+    }
+
+    // Rays that were not binned to the chunk miss it
+    chunk.rayCount   = rayCount;
+    chunk.missedRays = rayCount;
+
+    size_t clampedCells = 0;
+    for (size_t i = 0; i < included.size(); i++) {
+        const ChunkLayer& layer = sums.layers[included[i]];
+        chunk.missedRays -= layer.rays - layer.missedRays;
+
+        // A cell is exported with the first included layer holding rays in it, summed over all included layers
+        layer.cells.ForEachOccupied([&](const Int3& voxel, const CellSum& cell) {
+            if (cell.rays == 0) {
+                return;
+            }
+            CellSum total = {};
+            for (size_t j = 0; j < included.size(); j++) {
+                const CellSum& other = j == i ? cell : sums.layers[included[j]].cells.Get(voxel);
+                if (j < i && other.rays != 0) {
+                    return;
+                }
+                total.direction += other.direction;
+                total.rays = AddSaturated(total.rays, other.rays);
+            }
+            if (layers_.densityScale != 1.f) {
+                total.rays = static_cast<uint32_t>(std::min<double>(std::round(total.rays * layers_.densityScale),
+                                                                    std::numeric_limits<uint32_t>::max()));
+            }
+            clampedCells += Export(voxel, total, chunk) ? 1 : 0;
+        });
+    }
+    return clampedCells;
+}
+
+void VolumetricSampler::Volume::UpdateBounds()
+{
+    maxRays = 0;
+    min     = Float3(std::numeric_limits<float>::max());
+    max     = Float3(std::numeric_limits<float>::lowest());
+    for (const auto& chunk : chunks) {
+        maxRays = std::max(maxRays, chunk.maxRays);
+        min     = linalg::min(min, linalg::min(chunk.min, chunk.max));
+        max     = linalg::max(max, linalg::max(chunk.min, chunk.max));
+    }
+}
+
+void VolumetricSampler::Compose()
+{
+    const auto begin = std::chrono::steady_clock::now();
+
+    std::vector<size_t> included;
+    size_t              rayCount = 0;
+    std::tie(included, rayCount) = IncludedLayers();
+
+    // Chunks none of the included rays were binned to are left out
+    assert(level_ == 0 || !layers_.pyramid[level_ - 1].empty() || layers_.chunks.empty());
+    std::vector<const ChunkSums*> sources;
+    for (const auto& sums : level_ == 0 ? layers_.chunks : layers_.pyramid[level_ - 1]) {
+        if (std::any_of(included.begin(), included.end(), [&sums](const size_t l) { return sums.layers[l].rays; })) {
+            sources.push_back(&sums);
+        }
+    }
+
+    volume_        = {};
+    volume_.chunks = std::vector<ChunkData>(sources.size());
+    std::vector<size_t> chunkIndices(sources.size());
+    std::vector<size_t> clampedCells(sources.size());
+    std::iota(chunkIndices.begin(), chunkIndices.end(), 0);
+    std::for_each(std::execution::par, chunkIndices.begin(), chunkIndices.end(), [&](const size_t chunkIdx) {
+        clampedCells[chunkIdx] = ComposeChunk(*sources[chunkIdx], included, rayCount, volume_.chunks[chunkIdx]);
+    });
+    volume_.UpdateBounds();
+    WarnClampedCells(std::accumulate(clampedCells.begin(), clampedCells.end(), size_t(0)));
+
+    const auto end = std::chrono::steady_clock::now();
+    spdlog::info("VS::Sampler - composed {} chunks of {} rays ({}, pyramid level {}) in {}s",
+                 volume_.chunks.size(),
+                 rayCount,
+                 display_name(filter_),
+                 level_,
+                 std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() / 1000.f);
+}
+
+bool VolumetricSampler::Sample(Layers& layers, const std::stop_token& stop, const Preview& preview) const
 {
     std::chrono::steady_clock::time_point absoluteStartTime = std::chrono::steady_clock::now();
-    data_.clear();
-    const std::vector<Ray> filteredRays =
-        filter_ == RayFilter::IncludeAllRays ? trace->rays : [&rays = trace->rays, &filter = filter_]() {
-            std::vector<Ray> result;
-            for (auto& ray : rays) {
-                if (IncludeRay(ray, filter)) {
-                    result.push_back(ray);
-                }
-            }
-            spdlog::info("VS::Sampler Preprocessing - filtered rays (Filter: {} Rays: {}/{})",
-                         display_name(filter),
-                         result.size(),
-                         rays.size());
-            return result;
-        }();
+
+    const auto cancelled = [&absoluteStartTime]() {
+        const auto elapsed = std::chrono::steady_clock::now() - absoluteStartTime;
+        spdlog::info("VS::Sampler - cancelled after {}s",
+                     std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() / 1000.f);
+        return false;
+    };
+    layers = {};
+    // All rays are sampled, each into the layer of its class. The filter only matters once the layers are composed.
+    const std::span<const Ray> sampledRays(trace->rays);
+
+    // Rays are split into contiguous ranges, one per partial result of the parallel steps
+    constexpr size_t minRaysPerPartial = 1 << 14;
+    const size_t     partialCount      = std::clamp<size_t>(
+        pool_->WorkerCount(), 1, std::max<size_t>(sampledRays.size() / minRaysPerPartial, 1));
 
     // Step 0 find ray bounds
     std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
-    Float3                                min   = Float3(std::numeric_limits<float>::max());
-    Float3                                max   = Float3(std::numeric_limits<float>::lowest());
-    for (const auto& ray : filteredRays) {
-        const float tMax       = std::min(ray.tHitOrTMax(), maxT_.value_or(ray.tMax));
-        const auto  startPoint = ray.origin + ray.direction * ray.tMin;
-        const auto  endPoint   = ray.origin + ray.direction * tMax;
-        min                    = linalg::min(min, linalg::min(startPoint, endPoint));
-        max                    = linalg::max(max, linalg::max(startPoint, endPoint));
-    }
+    struct Bounds {
+        Float3 min;
+        Float3 max;
+    };
+    const Bounds emptyBounds = {Float3(std::numeric_limits<float>::max()),
+                                Float3(std::numeric_limits<float>::lowest())};
+    const Bounds rayBounds   = std::transform_reduce(
+        std::execution::par,
+        sampledRays.begin(),
+        sampledRays.end(),
+        emptyBounds,
+        [](const Bounds& a, const Bounds& b) {
+            return Bounds{linalg::min(a.min, b.min), linalg::max(a.max, b.max)};
+        },
+        [&maxT_ = maxT_, missTolerance = missTolerance_](const Ray& ray) {
+            const float tMax       = std::min(ray.tHitOrTMax(missTolerance), maxT_.value_or(ray.tMax));
+            const auto  startPoint = ray.origin + ray.direction * ray.tMin;
+            const auto  endPoint   = ray.origin + ray.direction * tMax;
+            return Bounds{linalg::min(startPoint, endPoint), linalg::max(startPoint, endPoint)};
+        });
+    const Float3 min     = rayBounds.min;
+    layers.origin        = min;
+    layers.missTolerance = missTolerance_;
+
+    layers.rayCount[HitLayer] =
+        std::count_if(std::execution::par,
+                      sampledRays.begin(),
+                      sampledRays.end(),
+                      [missTolerance = missTolerance_](const Ray& ray) { return ray.HasHit(missTolerance); });
+    layers.rayCount[MissLayer] = sampledRays.size() - layers.rayCount[HitLayer];
 
     std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
     const auto step0_seconds = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() / 1000.f;
-    spdlog::info("VS::SamplerStep 0 - calculate ray bounds - finished in {}s", step0_seconds);
+    spdlog::info("VS::SamplerStep 0 - calculate ray bounds ({} hitting, {} missing rays) - finished in {}s",
+                 layers.rayCount[HitLayer],
+                 layers.rayCount[MissLayer],
+                 step0_seconds);
 
-    // Step 1 find chunks that are intersected
+    // Step 1 find chunks that are intersected and bin the rays crossing them
     begin = std::chrono::steady_clock::now();
 
-    const float                  voxelSize            = chunkSize_ * cellSize_;
-    const int32_t                higherLevelChunksize = 128;
-    ChunkedArray3D<std::uint8_t> chunks(higherLevelChunksize);
-    for (const auto& ray : filteredRays) {
-        const float tMax  = std::min(ray.tHitOrTMax(), maxT_.value_or(ray.tMax));
-        Double3     start = ray.origin + ray.direction * ray.tMin * 1.0;
-        Double3     end   = ray.origin + ray.direction * tMax * 1.0;
-        start             = start - min;
-        end               = end - min;
-        start             = start / voxelSize;
-        end               = end / voxelSize;
-        VoxelTrace(start, end, [&chunks = chunks](const Int3& voxel) {
-            assert((0 <= voxel.x) && (0 <= voxel.y) && (0 <= voxel.z));
-            chunks.At(voxel) = 1;
-        });
+    const float   voxelSize            = chunkSize_ * cellSize_;
+    const int32_t higherLevelChunksize = 128;
+
+    // The partials only index the chunks their rays cross, a dense index per partial would cost megabytes per thread
+    struct DiscoveryPartial {
+        std::unordered_map<Int3, std::uint32_t> chunks;     // Index into chunkRays
+        std::vector<std::vector<std::uint32_t>> chunkRays;  // Rays crossing chunkIds[i], in ascending order
+        std::vector<Int3>                       chunkIds;
+    };
+    std::vector<DiscoveryPartial> partials(partialCount);
+
+    assert(sampledRays.size() <= std::numeric_limits<std::uint32_t>::max());
+    pool_->ParallelFor(partialCount, [&](const size_t partialIdx) {
+        DiscoveryPartial& partial = partials[partialIdx];
+        const auto firstRay = static_cast<std::uint32_t>(sampledRays.size() * partialIdx / partialCount);
+        const auto lastRay  = static_cast<std::uint32_t>(sampledRays.size() * (partialIdx + 1) / partialCount);
+        for (std::uint32_t rayIdx = firstRay; rayIdx < lastRay && !stop.stop_requested(); rayIdx++) {
+            const auto& ray    = sampledRays[rayIdx];
+            const float tMax   = std::min(ray.tHitOrTMax(missTolerance_), maxT_.value_or(ray.tMax));
+            const auto  binRay = [&partial = partial, rayIdx](const Int3& voxel) {
+                assert((0 <= voxel.x) && (0 <= voxel.y) && (0 <= voxel.z));
+                const auto [slot, inserted] =
+                    partial.chunks.try_emplace(voxel, static_cast<std::uint32_t>(partial.chunkRays.size()));
+                if (inserted) {
+                    partial.chunkRays.emplace_back();
+                    partial.chunkIds.push_back(voxel);
+                }
+                partial.chunkRays[slot->second].push_back(rayIdx);
+            };
+            ForEachCrossedChunk(ChunkSegment(ray, tMax, min, voxelSize), binRay);
+        }
+    });
+
+    if (stop.stop_requested()) {
+        return cancelled();
     }
+
+    // Merging the partials in ray order keeps the rays of every chunk ascending, independent of the thread count
+    ChunkedArray3D<std::uint32_t>           chunks(higherLevelChunksize);  // Index + 1 into chunkRays
+    std::vector<std::vector<std::uint32_t>> chunkRays;
+    for (auto& partial : partials) {
+        for (size_t i = 0; i < partial.chunkIds.size(); i++) {
+            auto& slot = chunks.At(partial.chunkIds[i]);
+            auto& rays = partial.chunkRays[i];
+            if (slot == 0) {
+                chunkRays.push_back(std::move(rays));
+                slot = static_cast<std::uint32_t>(chunkRays.size());
+            } else {
+                chunkRays[slot - 1].insert(chunkRays[slot - 1].end(), rays.begin(), rays.end());
+            }
+        }
+    }
+    partials.clear();
     end                      = std::chrono::steady_clock::now();
     const auto step1_seconds = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() / 1000.f;
-    spdlog::info("VS::SamplerStep 1 - calculate traversed chunks - finished in {}s", step1_seconds);
+    spdlog::info("VS::SamplerStep 1 - calculate traversed chunks on {} partials - finished in {}s",
+                 partialCount,
+                 step1_seconds);
 
     // Step 2 create chunk tasks
     begin = std::chrono::steady_clock::now();
 
-    const size_t dataSize = chunkSize_ * chunkSize_ * chunkSize_;
-
+    struct Candidate {
+        Int3          chunkIdx;
+        std::uint32_t slot;
+    };
+    std::vector<Candidate> candidates;
+    candidates.reserve(chunkRays.size());
     for (const auto& data : chunks.GetData()) {
         const Int3& base = data.first * higherLevelChunksize;
         for (size_t i = 0; i < data.second.size(); i++) {
@@ -120,126 +1447,207 @@ void VolumetricSampler::Sample()
                 const Int3 index(i / higherLevelChunksize / higherLevelChunksize,
                                  (i / higherLevelChunksize) % higherLevelChunksize,
                                  i % higherLevelChunksize);
+                candidates.push_back({base + index, data.second[i]});
+            }
+        }
+    }
 
-                ChunkData taskData = {};
-                taskData.chunkSize = chunkSize_;
-                taskData.chunkIdx  = (base + index);
-                taskData.min       = Float3(taskData.chunkIdx) * voxelSize + min;
-                taskData.max       = taskData.min + Float3(voxelSize);
-                taskData.rayDensity.resize(chunkSize_ * chunkSize_ * chunkSize_);
-                taskData.directions.resize(chunkSize_ * chunkSize_ * chunkSize_);
-                data_.push_back(taskData);
+    layers.coverage            = {};
+    layers.coverage.chunkCount = candidates.size();
+    for (const auto& candidate : candidates) {
+        layers.coverage.crossings += chunkRays[candidate.slot - 1].size();
+    }
+
+    // Keep the chunks crossed by the most rays, the kept chunks stay in traversal order. Once the budget does not fit
+    // the chunks with all bricks allocated, each one is charged for the bricks its rays occupy instead. Progressive
+    // runs keep the same chunks as a single pass, so both sample the same volume.
+    size_t     chunkLimit = std::min(candidates.size(), maxChunkCount_);
+    const bool denseFits  = chunkLimit <= ChunkLimit();
+    size_t     keptBytes  = chunkLimit * ChunkByteSize();
+    if (!denseFits || chunkLimit < candidates.size()) {
+        std::vector<size_t> order(candidates.size());
+        std::iota(order.begin(), order.end(), 0);
+        const auto crossedByMore = [&candidates = candidates, &chunkRays = chunkRays](const size_t a, const size_t b) {
+            const size_t crossingsA = chunkRays[candidates[a].slot - 1].size();
+            const size_t crossingsB = chunkRays[candidates[b].slot - 1].size();
+            return crossingsA != crossingsB ? crossingsB < crossingsA : a < b;
+        };
+        std::sort(order.begin(), order.end(), crossedByMore);
+
+        if (!denseFits) {
+            const size_t staging   = StagingByteSize(0);
+            const size_t available = staging < memoryBudget_ ? memoryBudget_ - staging : 0;
+            size_t       free      = available;
+            size_t       kept      = 0;
+            // Estimated a batch at a time, only the chunks up to the first one that does not fit are counted
+            const size_t        batchSize = 4 * pool_->WorkerCount();
+            std::vector<size_t> byteSizes;
+            while (kept < chunkLimit) {
+                byteSizes.resize(std::min(batchSize, chunkLimit - kept));
+                pool_->ParallelFor(byteSizes.size(), [&](const size_t i) {
+                    const Candidate& candidate = candidates[order[kept + i]];
+                    const ChunkBricks bricks =
+                        CountBricks(candidate.chunkIdx, min, sampledRays, chunkRays[candidate.slot - 1]);
+                    byteSizes[i] = ChunkByteSize(bricks);
+                });
+                size_t fitting = 0;
+                while (fitting < byteSizes.size() && byteSizes[fitting] <= free) {
+                    free -= byteSizes[fitting++];
+                }
+                kept += fitting;
+                if (fitting < byteSizes.size()) {
+                    break;
+                }
             }
-            if (512 <= data_.size()) {
-                break;
+            chunkLimit = kept;
+            keptBytes  = available - free;
+        }
+        order.resize(chunkLimit);
+        std::sort(order.begin(), order.end());
+
+        std::vector<Candidate> kept;
+        kept.reserve(chunkLimit);
+        for (const auto idx : order) {
+            kept.push_back(candidates[idx]);
+        }
+        candidates = std::move(kept);
+    }
+
+    // Progressive runs keep the sums of every chunk from pass to pass, a budget without room for them next to the kept
+    // chunks is sampled in a single pass
+    bool progressive = preview && MinProgressiveRays <= sampledRays.size();
+    if (progressive && memoryBudget_ != UnlimitedMemoryBudget &&
+        memoryBudget_ < keptBytes + StagingByteSize(candidates.size())) {
+        progressive = false;
+        spdlog::info("VS::SamplerStep 2 - the memory budget of {} MB leaves no room for the sums of a progressive run, "
+                     "sampling in a single pass",
+                     memoryBudget_ / (1024 * 1024));
+    }
+
+    // Rays crossing layers.chunks[i], only these are traced in the task of the chunk. They are ordered by the pass
+    // of a progressive run even for a single pass, so both add up the rays of a cell in the same order.
+    std::vector<std::vector<std::uint32_t>> taskRays;
+    std::vector<std::vector<size_t>>        passEnds;
+    taskRays.reserve(candidates.size());
+    passEnds.reserve(candidates.size());
+    layers.chunks.reserve(candidates.size());
+    for (const auto& candidate : candidates) {
+        layers.chunks.push_back(MakeChunk(candidate.chunkIdx, min));
+
+        auto& rays = taskRays.emplace_back(std::move(chunkRays[candidate.slot - 1]));
+        auto& ends = passEnds.emplace_back();
+        auto  pass = rays.begin();
+        for (const uint32_t stride : PassStrides) {
+            pass = std::stable_partition(pass, rays.end(), [stride](const uint32_t rayIdx) {
+                return rayIdx % stride == 0;
+            });
+            if (progressive) {
+                ends.push_back(static_cast<size_t>(pass - rays.begin()));
             }
         }
-        if (512 <= data_.size()) {
-            spdlog::error("maximum chunks reached (512=. There will be missing chunks");
-            break;
+        if (!progressive) {
+            ends.push_back(rays.size());
         }
+        layers.coverage.keptCrossings += rays.size();
+    }
+    layers.coverage.keptChunks       = layers.chunks.size();
+    const size_t crossingCount = layers.coverage.keptCrossings;
+
+    if (layers.coverage.keptChunks < layers.coverage.chunkCount) {
+        spdlog::warn(
+            "VS::SamplerStep 2 - chunk budget ({} MB, {} chunks) exceeded, kept {}/{} chunks covering {:.1f}% of "
+            "{} ray chunk crossings",
+            memoryBudget_ / (1024 * 1024),
+            chunkLimit,
+            layers.coverage.keptChunks,
+            layers.coverage.chunkCount,
+            layers.coverage.Ratio() * 100.f,
+            layers.coverage.crossings);
+    }
+    if (!denseFits && layers.coverage.keptChunks < std::min(layers.coverage.chunkCount, PreviousChunkCap)) {
+        spdlog::warn("VS::SamplerStep 2 - the memory budget of {} MB keeps only {} chunks, fewer than the previous "
+                     "cap of {} chunks",
+                     memoryBudget_ / (1024 * 1024),
+                     layers.coverage.keptChunks,
+                     PreviousChunkCap);
     }
 
     end                      = std::chrono::steady_clock::now();
     const auto step2_seconds = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() / 1000.f;
-    spdlog::info("VS::SamplerStep 2 - created {} chunk tasks - finished in {}s", data_.size(), step2_seconds);
+    spdlog::info("VS::SamplerStep 2 - created {} chunk tasks for {} ray chunk crossings - finished in {}s",
+                 layers.chunks.size(),
+                 crossingCount,
+                 step2_seconds);
 
     // Step 3 execute chunk filing tasks
     begin = std::chrono::steady_clock::now();
 
-    std::atomic_char16_t finishedTasks = 0;
-    std::future<void>    computeChunks = std::async(std::launch::async, [&]() {
-        std::for_each(
-            std::execution::par,
-            data_.begin(),
-            data_.end(),
-            [&chunkSize_    = chunkSize_,
-             &rays          = filteredRays,
-             &maxT_         = maxT_,
-             &cellSize_     = cellSize_,
-             &finishedTasks = finishedTasks](ChunkData& task) {
-                std::vector<Double3> doubleDirs;
-                doubleDirs.resize(chunkSize_ * chunkSize_ * chunkSize_);
-                task.rayCount = rays.size();
-                for (const auto& ray : rays) {
-                    const Float2 minMax = IntersectAABB(ray.origin, ray.direction, task.min, task.max);
-                    const float  maxT   = std::min(ray.tHitOrTMax(), maxT_.value_or(ray.tMax));
-                    if (!HitAABB(minMax, maxT)) {
-                        task.missedRays++;
-                        continue;
-                    }
-                    Double3 start = ray.origin + ray.direction * static_cast<double>(std::max(minMax.x, ray.tMin));
-                    Double3 end   = ray.origin + ray.direction * static_cast<double>(std::min(minMax.y, maxT));
-                    start         = start - task.min;
-                    end           = end - task.min;
-                    start         = start / cellSize_;
-                    end           = end / cellSize_;
-
-                    const auto assertRoundingError = 0.1;
-                    const auto upperAssertLimit    = chunkSize_ + assertRoundingError;
-                    assert(-assertRoundingError < start.x && start.x < upperAssertLimit);
-                    assert(-assertRoundingError <= start.y && start.y < upperAssertLimit);
-                    assert(-assertRoundingError <= start.z && start.z < upperAssertLimit);
-                    assert(-assertRoundingError <= end.x && end.x < upperAssertLimit);
-                    assert(-assertRoundingError <= end.y && end.y < upperAssertLimit);
-                    assert(-assertRoundingError <= end.z && end.z < upperAssertLimit);
-
-                    start = linalg::clamp(start, Double3(0.0), Double3(chunkSize_ - 0.001));
-                    end   = linalg::clamp(end, Double3(0.0), Double3(chunkSize_ - 0.001));
-
-                    VoxelTrace(start,
-                               end,
-                               [&task = task, size = chunkSize_, &doubleDirs = doubleDirs, &dir = ray.direction](
-                                   const Int3& voxel) {
-                                   assert((0 <= voxel.x) && (0 <= voxel.y) && (0 <= voxel.z));
-                                   assert((voxel.x < size) && (voxel.y < size) && (voxel.z < size));
-                                   const size_t idx = voxel.x * size * size + voxel.y * size + voxel.z;
-                                   if (task.rayDensity[idx] + 1 != std::numeric_limits<rdType>::max()) {
-                                       task.rayDensity[idx]++;
-                                   }
-                                   doubleDirs[idx] += dir;
-                               });
-                }
-
-                // Normalize Directions
-                std::transform(doubleDirs.begin(), doubleDirs.end(), task.directions.begin(), [](Double3& dir) {
-                    return Float3(linalg::normalize(dir));
-                });
-
-                // Grab max rays
-                task.maxRays = std::accumulate(
-                    task.rayDensity.begin(), task.rayDensity.end(), 0, [](const rdType& a, const rdType& b) {
-                        return std::max(a,b);
-                    });
-
-                finishedTasks++;
-            });
-    });
-
-    size_t lastFinishCount = 0;
-    while (computeChunks.wait_for(50ms) != std::future_status::ready) {
-        size_t ft = finishedTasks;
-        if (lastFinishCount != ft) {
-            lastFinishCount = ft;
-            spdlog::info(
-                "VS::SamplerStep 3 - Computation Update: finished {}/{} chunk tasks", lastFinishCount, data_.size());
+    // Progress calls are serialized by the pool, updates are logged at most every 50ms
+    auto       lastUpdate     = begin;
+    const auto reportProgress = [&lastUpdate](const size_t finished, const size_t count) {
+        const auto now = std::chrono::steady_clock::now();
+        if (50ms <= now - lastUpdate && finished != count) {
+            lastUpdate = now;
+            spdlog::info("VS::SamplerStep 3 - Computation Update: finished {}/{} ray slices", finished, count);
         }
+    };
+    // Previews are published with the densities scaled to the whole trace
+    const auto publish = [&](const size_t pass, std::vector<ChunkSums>&& chunks) {
+        auto previewLayers           = std::make_unique<Layers>();
+        previewLayers->chunks        = std::move(chunks);
+        previewLayers->origin        = layers.origin;
+        previewLayers->rayCount      = layers.rayCount;
+        previewLayers->coverage      = layers.coverage;
+        previewLayers->missTolerance = layers.missTolerance;
+        const size_t tracedRays      = (sampledRays.size() + PassStrides[pass] - 1) / PassStrides[pass];
+        previewLayers->densityScale  = static_cast<float>(sampledRays.size()) / tracedRays;
+        BuildPyramid(*previewLayers, stop);
+
+        const auto elapsed = std::chrono::steady_clock::now() - absoluteStartTime;
+        spdlog::info("VS::SamplerStep 3 - published preview of pass {} ({} of {} rays) after {}s",
+                     pass,
+                     tracedRays,
+                     sampledRays.size(),
+                     std::chrono::duration_cast<std::chrono::milliseconds>(elapsed).count() / 1000.f);
+        preview(std::move(previewLayers));
+    };
+    const size_t sliceCount =
+        directionEncoding_ == DirectionEncoding::Exact
+            ? FillChunks<Double3>(layers.chunks, sampledRays, taskRays, passEnds, publish, reportProgress, stop)
+            : FillChunks<Float3>(layers.chunks, sampledRays, taskRays, passEnds, publish, reportProgress, stop);
+    if (stop.stop_requested()) {
+        return cancelled();
     }
 
     end                      = std::chrono::steady_clock::now();
     const auto step3_seconds = std::chrono::duration_cast<std::chrono::milliseconds>(end - begin).count() / 1000.f;
-    spdlog::info("VS::SamplerStep 3 - execute {} chunk tasks - finished in {}s", finishedTasks, step3_seconds);
-
-    // calculate min max 
-    maxRays_ = 0;
-    min_ = Float3(std::numeric_limits<float>::max());
-    max_ = Float3(std::numeric_limits<float>::lowest());
-    for (const auto& chunk : data_) {
-        maxRays_ = std::max(maxRays_, chunk.maxRays);
-        min_ = linalg::min(min_, linalg::min(chunk.min, chunk.max));
-        max_ = linalg::max(max_, linalg::max(chunk.min, chunk.max));
+    size_t occupiedBricks = 0;
+    for (const auto& chunk : layers.chunks) {
+        for (const auto& layer : chunk.layers) {
+            occupiedBricks += layer.cells.OccupiedBricks();
+        }
     }
+    spdlog::info(
+        "VS::SamplerStep 3 - execute {} chunk tasks in {} ray slices ({} ray chunk crossings, {} AABB kernel, {} "
+        "directions, {} threads) - finished in {}s",
+        layers.chunks.size(),
+        sliceCount,
+        crossingCount,
+        IntersectAABBKernelName(),
+        directionEncoding_ == DirectionEncoding::Exact ? "exact" : "octahedral",
+        pool_->WorkerCount(),
+        step3_seconds);
+    spdlog::info("VS::SamplerStep 3 - hit and miss layers hold {} MB in {}/{} occupied bricks, {} MB if stored dense",
+                 ByteSize(layers.chunks) / (1024 * 1024),
+                 occupiedBricks,
+                 layers.chunks.size() * LayerCount * BrickGrid<CellSum>::BricksFor(chunkSize_),
+                 layers.chunks.size() * LayerCount * BrickGrid<CellSum>::DenseByteSize(chunkSize_) / (1024 * 1024));
 
+    // Step 4 build the pyramid of coarser cell sizes
+    BuildPyramid(layers, stop);
+    if (stop.stop_requested()) {
+        return cancelled();
+    }
 
     // finished
 
@@ -247,5 +1655,5 @@ void VolumetricSampler::Sample()
     const auto completeTime =
         std::chrono::duration_cast<std::chrono::milliseconds>(end - absoluteStartTime).count() / 1000.f;
     spdlog::info("VS::Sampler - finished computation in {}s", completeTime);
-    dirty_ = false;
+    return true;
 }
\ No newline at end of file
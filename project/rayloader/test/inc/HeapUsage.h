@@ -0,0 +1,9 @@
+/* Copyright (c) 2023 Pirmin Pfeifer */
+#pragma once
+#include <cstddef>
+
+/// Bytes currently allocated with the global operator new, which the test binary replaces to count them
+size_t CurrentHeapBytes();
+/// Highest CurrentHeapBytes since the last ResetPeakHeapBytes
+size_t PeakHeapBytes();
+void   ResetPeakHeapBytes();
@@ -0,0 +1,80 @@
+/* Copyright (c) 2023 Pirmin Pfeifer */
+#pragma once
+#include <rayloader/RayTrace.h>
+
+#include <array>
+#include <cstring>
+#include <random>
+
+/// Rays of a camera looking into a scene, neighbouring rays have similar directions, distances and hit indices like
+/// the rays of a captured trace. A third of the rays miss.
+inline RayTrace MakeTrace(const std::uint32_t traceId, const size_t rayCount)
+{
+    constexpr size_t width = 1024;
+
+    std::mt19937                          rng(traceId);
+    std::uniform_real_distribution<float> jitter(-0.001f, 0.001f);
+    std::uniform_real_distribution<float> distance(10.f, 12.f);
+
+    RayTrace trace;
+    trace.traceId = traceId;
+    trace.rays.resize(rayCount);
+    for (size_t i = 0; i < rayCount; i++) {
+        const float x = static_cast<float>(i % width) / width - 0.5f;
+        const float y = static_cast<float>(i / width % width) / width - 0.5f;
+
+        Ray& ray      = trace.rays[i];
+        ray.rayId     = static_cast<std::uint32_t>(i);
+        ray.origin    = Float3(0.f, 0.f, -5.f);
+        ray.direction = linalg::normalize(Float3(x + jitter(rng), y + jitter(rng), 1.f));
+        ray.tMin      = 0.f;
+        ray.tMax      = distance(rng) + 4.f * x * x;
+        if (i % 3 != 0) {
+            ray.tHit                   = ray.tMax;
+            ray.hitInfo.instanceIndex  = static_cast<std::uint32_t>(i / 65536);
+            ray.hitInfo.primitiveIndex = static_cast<std::uint32_t>(i / 8);
+            ray.hitInfo.geometryIndex  = static_cast<std::uint32_t>(i / 4096 % 4);
+        } else {
+            ray.tHit    = -1.f;
+            ray.hitInfo = {};
+        }
+    }
+    return trace;
+}
+
+/// Rays of eight cameras inside a box of size^3 units, in random directions. Two thirds of the rays hit, their hit
+/// margins are spread over [0, 2) so that changing the miss tolerance moves rays between the hit and miss layers of the
+/// sampler.
+inline RayTrace MakeSceneTrace(const std::uint32_t traceId, const size_t rayCount, const float size = 64.f)
+{
+    std::mt19937                          rng(traceId);
+    std::uniform_real_distribution<float> position(0.f, size);
+    std::normal_distribution<float>       direction;
+    std::uniform_real_distribution<float> distance(size / 8.f, size / 2.f);
+    std::uniform_real_distribution<float> margin(0.f, 2.f);
+
+    std::array<Float3, 8> cameras;
+    for (Float3& camera : cameras) {
+        camera = Float3(position(rng), position(rng), position(rng));
+    }
+
+    RayTrace trace;
+    trace.traceId = traceId;
+    trace.rays.resize(rayCount);
+    for (size_t i = 0; i < rayCount; i++) {
+        Ray& ray      = trace.rays[i];
+        ray.rayId     = static_cast<std::uint32_t>(i);
+        ray.origin    = cameras[i % cameras.size()];
+        ray.direction = linalg::normalize(Float3(direction(rng), direction(rng), direction(rng)));
+        ray.tMin      = 0.f;
+        ray.tMax      = distance(rng);
+        ray.tHit      = i % 3 != 0 ? ray.tMax - margin(rng) : -1.f;
+        ray.hitInfo   = {};
+    }
+    return trace;
+}
+
+inline bool SameRays(const std::vector<Ray>& a, const std::vector<Ray>& b)
+{
+    return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size() * sizeof(Ray)) == 0;
+}
@@ -0,0 +1,55 @@
+/* Copyright (c) 2023 Pirmin Pfeifer */
+#include "HeapUsage.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+namespace {
+    std::atomic_size_t currentBytes = 0;
+    std::atomic_size_t peakBytes    = 0;
+
+    // Every allocation is prefixed with its size, keeping the alignment of malloc
+    constexpr size_t SizePrefix = alignof(std::max_align_t);
+}  // namespace
+
+size_t CurrentHeapBytes()
+{
+    return currentBytes;
+}
+
+size_t PeakHeapBytes()
+{
+    return peakBytes;
+}
+
+void ResetPeakHeapBytes()
+{
+    peakBytes = currentBytes.load();
+}
+
+// The array, nothrow and sized forms forward to these two
+void* operator new(const size_t size)
+{
+    auto* block = static_cast<std::byte*>(std::malloc(size + SizePrefix));
+    if (block == nullptr) {
+        throw std::bad_alloc();
+    }
+    *reinterpret_cast<size_t*>(block) = size;
+
+    const size_t current = currentBytes += size;
+    size_t       peak    = peakBytes;
+    while (peak < current && !peakBytes.compare_exchange_weak(peak, current)) {
+    }
+    return block + SizePrefix;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    if (ptr == nullptr) {
+        return;
+    }
+    auto* block = static_cast<std::byte*>(ptr) - SizePrefix;
+    currentBytes -= *reinterpret_cast<size_t*>(block);
+    std::free(block);
+}
@@ -0,0 +1,119 @@
+/* Copyright (c) 2023 Pirmin Pfeifer */
+#include <catch2/catch.hpp>
+
+#include <configuration/Configuration.h>
+#include <rayloader/Loader.h>
+#include <spdlog/spdlog.h>
+
+#include "TestTraces.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <string>
+#include <thread>
+
+namespace {
+    /// .rayvis file in the temp directory, the traces are written in descending trace id order and the ray count
+    /// of each trace grows with its id
+    std::filesystem::path WriteRayVisFile(const char* name, const size_t traceCount, const size_t rayCount)
+    {
+        const auto path = std::filesystem::temp_directory_path() / (std::string(name) + ".rayvis");
+        std::filesystem::remove(path);
+
+        auto                 stream = rdf::Stream::CreateFile(path.string().c_str());
+        rdf::ChunkFileWriter writer(stream);
+        for (size_t i = traceCount; 0 < i; i--) {
+            const auto traceId = static_cast<std::uint32_t>(i - 1);
+            MakeTrace(traceId, rayCount + traceId * 1000).Save(writer);
+        }
+        writer.Close();
+        return path;
+    }
+}  // namespace
+
+TEST_CASE("Loader::Load decodes all traces sorted by trace id", "[Loader]")
+{
+    constexpr size_t traceCount = 5;
+    constexpr size_t rayCount   = RAY_BLOCK_RAY_COUNT + 17;
+    const auto       path       = WriteRayVisFile("rayloader_test_load", traceCount, rayCount);
+
+    core::Configuration config;
+    rayloader::Loader   loader(config.CreateView("rayloader."));
+    for (const int32_t workerThreads : {1, 3, 0}) {
+        INFO("Worker threads " << workerThreads);
+        config.Set("rayloader.workerThreads", workerThreads);
+
+        const std::vector<RayTrace> traces = loader.Load(path.string().c_str());
+        REQUIRE(traces.size() == traceCount);
+        for (size_t i = 0; i < traceCount; i++) {
+            CHECK(traces[i].traceId == i);
+            CHECK(SameRays(traces[i].rays, MakeTrace(traces[i].traceId, rayCount + i * 1000).rays));
+        }
+    }
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("TraceCollection evicts the least recently used traces", "[Loader]")
+{
+    constexpr size_t traceCount = 4;
+    constexpr size_t rayCount   = RAY_BLOCK_RAY_COUNT;
+    const auto       path       = WriteRayVisFile("rayloader_test_open", traceCount, rayCount);
+
+    core::Configuration config;
+    rayloader::Loader   loader(config.CreateView("rayloader."));
+    auto                traces = loader.Open(path.string().c_str());
+    REQUIRE(traces.size() == traceCount);
+
+    // Any two traces fit, three do not
+    const auto   byteSize = [&traces](const size_t idx) { return static_cast<size_t>(traces.Info(idx).byteSize); };
+    const size_t budget   = byteSize(2) + byteSize(3);
+    traces.SetMemoryBudget(budget);
+
+    const auto held = traces.Get(0);
+    traces.Get(1);
+    CHECK(traces.ResidentBytes() == byteSize(0) + byteSize(1));
+    traces.Get(2);
+    CHECK(traces.ResidentBytes() <= budget);
+    CHECK_FALSE(traces.IsResident(0));
+    CHECK(traces.IsResident(1));
+    CHECK(traces.IsResident(2));
+    traces.Get(3);
+    CHECK(traces.ResidentBytes() <= budget);
+    CHECK_FALSE(traces.IsResident(1));
+
+    // An evicted trace stays valid while it is held, and Get hands out the same trace instead of decoding it again
+    CHECK(SameRays(held->rays, MakeTrace(0, rayCount).rays));
+    CHECK(traces.Get(0) == held);
+    CHECK(traces.IsResident(0));
+    CHECK(traces.ResidentBytes() <= budget);
+
+    // Hit margins are only sorted once the sampler needs them
+    CHECK_FALSE(held->HasHitMargins());
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Loader::Load benchmark", "[Loader][!benchmark]")
+{
+    constexpr size_t traceCount = 16;
+    constexpr size_t rayCount   = 4 * RAY_BLOCK_RAY_COUNT;
+    const auto       path       = WriteRayVisFile("rayloader_benchmark_load", traceCount, rayCount);
+    const size_t     rayBytes   = std::filesystem::file_size(path);
+
+    core::Configuration config;
+    rayloader::Loader   loader(config.CreateView("rayloader."));
+
+    // Divide the size in the names by the mean time for the throughput
+    const auto level = spdlog::get_level();
+    spdlog::set_level(spdlog::level::warn);
+    const auto hardwareThreads = static_cast<int32_t>(std::max(std::thread::hardware_concurrency(), 1U));
+    for (int32_t workerThreads = 1; workerThreads <= hardwareThreads; workerThreads *= 2) {
+        config.Set("rayloader.workerThreads", workerThreads);
+        BENCHMARK(std::to_string(traceCount) + " traces, " + std::to_string(rayBytes / (1024 * 1024)) +
+                  " MB compressed, " + std::to_string(workerThreads) + " threads")
+        {
+            return loader.Load(path.string().c_str()).size();
+        };
+    }
+    spdlog::set_level(level);
+    std::filesystem::remove(path);
+}
@@ -0,0 +1,272 @@
+/* Copyright (c) 2023 Pirmin Pfeifer */
+#include <catch2/catch.hpp>
+
+#include <rayloader/RayTrace.h>
+#include <spdlog/spdlog.h>
+
+#include "HeapUsage.h"
+#include "TestTraces.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace {
+    /// Version 1 layout, all rays in the data of the trace chunk
+    void SaveV1(const RayTrace& trace, rdf::ChunkFileWriter& writer)
+    {
+        const RayTraceHeaderV1 header = {trace.traceId};
+        writer.BeginChunk(RAY_TRACE_CHUNK_ID, sizeof(RayTraceHeaderV1), &header, rdfCompressionZstd, 1);
+        writer.AppendToChunk(trace.rays.size() * sizeof(Ray), trace.rays.data());
+        writer.EndChunk();
+    }
+
+    /// How RayTrace::LoadFrom read version 1 traces before decoding into the rays directly, kept as the baseline
+    bool PreviousLoadFrom(rdf::ChunkFile& chunkfile, RayTrace& target, const size_t chunkIdx)
+    {
+        RayTraceHeaderV1 header;
+        chunkfile.ReadChunkHeaderToBuffer(RAY_TRACE_CHUNK_ID, chunkIdx, &header);
+        target.traceId = header.traceId;
+
+        bool loaded = false;
+        chunkfile.ReadChunkData(RAY_TRACE_CHUNK_ID, chunkIdx, [&target, &loaded](int64_t dataSize, const void* data) {
+            const size_t        rayCount = dataSize / sizeof(Ray);
+            const std::uint8_t* ptr      = reinterpret_cast<const std::uint8_t*>(data);
+            for (size_t i = 0; i < rayCount; i++) {
+                Ray ray;
+                std::memcpy(&ray, ptr + i * sizeof(Ray), sizeof(Ray));
+                target.rays.push_back(ray);
+            }
+            loaded = true;
+        });
+        return loaded;
+    }
+
+    /// Trace chunk of version 2 whose index lists blocks of the given first ray and ray count, without block chunks
+    bool ReadsBlockIndex(const std::uint64_t                                          rayCount,
+                         const std::vector<std::pair<std::uint64_t, std::uint32_t>>& ranges)
+    {
+        std::vector<RayBlockInfo> blocks;
+        for (const auto& [firstRay, blockRayCount] : ranges) {
+            RayBlockInfo block = {};
+            block.firstRay     = firstRay;
+            block.rayCount     = blockRayCount;
+            block.chunkIdx     = static_cast<std::uint32_t>(blocks.size());
+            blocks.push_back(block);
+        }
+        const RayTraceHeader header = {0, static_cast<std::uint32_t>(blocks.size()), rayCount};
+
+        auto stream = rdf::Stream::CreateMemoryStream();
+        {
+            rdf::ChunkFileWriter writer(stream);
+            writer.BeginChunk(
+                RAY_TRACE_CHUNK_ID, sizeof(RayTraceHeader), &header, rdfCompressionZstd, RAY_TRACE_VERSION);
+            writer.AppendToChunk(blocks.size() * sizeof(RayBlockInfo), blocks.data());
+            writer.EndChunk();
+            writer.Close();
+        }
+        rdf::ChunkFile chunkfile(stream);
+
+        std::vector<RayBlockInfo> read;
+        return RayTrace::ReadBlockIndex(chunkfile, 0, read);
+    }
+
+    std::string MegaBytes(const size_t bytes)
+    {
+        return std::to_string(bytes / (1024 * 1024)) + " MB";
+    }
+
+    /// Size of the trace saved into a memory stream
+    size_t SavedBytes(const RayTrace& trace, const int compressionLevel, const int workerCount)
+    {
+        auto stream = rdf::Stream::CreateMemoryStream();
+        {
+            rdf::ChunkFileWriter writer(stream);
+            writer.SetCompressionOptions(compressionLevel, workerCount);
+            trace.Save(writer);
+            writer.Close();
+        }
+        return static_cast<size_t>(stream.GetSize());
+    }
+
+    std::string Ratio(const size_t rayBytes, const size_t savedBytes)
+    {
+        char ratio[16];
+        std::snprintf(ratio, sizeof(ratio), "%.2f", static_cast<double>(rayBytes) / savedBytes);
+        return ratio;
+    }
+}  // namespace
+
+TEST_CASE("RayTrace::LoadFrom decodes version 1 traces into the rays", "[RayTrace]")
+{
+    const RayTrace trace = MakeTrace(7, 100003);
+
+    auto stream = rdf::Stream::CreateMemoryStream();
+    {
+        rdf::ChunkFileWriter writer(stream);
+        SaveV1(trace, writer);
+        writer.Close();
+    }
+    rdf::ChunkFile chunkfile(stream);
+
+    RayTrace loaded;
+    REQUIRE(RayTrace::LoadFrom(chunkfile, loaded, 0));
+    CHECK(loaded.traceId == trace.traceId);
+    CHECK(SameRays(loaded.rays, trace.rays));
+    // Sized once from the chunk, the vector never grew
+    CHECK(loaded.rays.capacity() == trace.rays.size());
+}
+
+TEST_CASE("RayTrace::Save and LoadFrom round trip", "[RayTrace]")
+{
+    // The last block is only partially filled
+    const RayTrace          trace     = MakeTrace(3, 3 * RAY_BLOCK_RAY_COUNT + 123);
+    const RayBlockTransform transform = GENERATE(RayBlockTransform::None, RayBlockTransform::Shuffle);
+    INFO("Transform " << static_cast<std::uint32_t>(transform));
+
+    auto stream = rdf::Stream::CreateMemoryStream();
+    {
+        rdf::ChunkFileWriter writer(stream);
+        REQUIRE(trace.Save(writer, transform));
+        writer.Close();
+    }
+    rdf::ChunkFile chunkfile(stream);
+
+    RayTrace loaded;
+    REQUIRE(RayTrace::LoadFrom(chunkfile, loaded, 0));
+    CHECK(loaded.traceId == trace.traceId);
+    CHECK(SameRays(loaded.rays, trace.rays));
+
+    RayTrace loadedParallel;
+    REQUIRE(RayTrace::LoadFromParallel(chunkfile, loadedParallel, 0));
+    CHECK(SameRays(loadedParallel.rays, trace.rays));
+
+    std::vector<RayBlockInfo> blocks;
+    REQUIRE(RayTrace::ReadBlockIndex(chunkfile, 0, blocks));
+    CHECK(blocks.size() == 4);
+    std::vector<Ray> blockRays(trace.rays.size());
+    for (const RayBlockInfo& block : blocks) {
+        REQUIRE(RayTrace::LoadBlock(chunkfile, block, blockRays.data() + block.firstRay));
+    }
+    CHECK(SameRays(blockRays, trace.rays));
+}
+
+TEST_CASE("RayTrace::ReadBlockIndex only accepts blocks covering every ray once", "[RayTrace]")
+{
+    CHECK(ReadsBlockIndex(300, {{0, 100}, {100, 100}, {200, 100}}));
+    CHECK(ReadsBlockIndex(300, {{200, 100}, {0, 100}, {100, 100}}));
+    CHECK(ReadsBlockIndex(0, {}));
+
+    // Gap, overlap, a block listed twice, rays left at the end and a block beyond the end
+    CHECK_FALSE(ReadsBlockIndex(300, {{0, 100}, {150, 150}}));
+    CHECK_FALSE(ReadsBlockIndex(300, {{0, 150}, {100, 200}}));
+    CHECK_FALSE(ReadsBlockIndex(300, {{0, 100}, {100, 100}, {100, 100}, {200, 100}}));
+    CHECK_FALSE(ReadsBlockIndex(300, {{0, 100}, {100, 100}}));
+    CHECK_FALSE(ReadsBlockIndex(300, {{0, 100}, {100, 100}, {200, 101}}));
+    CHECK_FALSE(ReadsBlockIndex(300, {}));
+}
+
+TEST_CASE("RayTrace::LoadFrom benchmark", "[RayTrace][!benchmark]")
+{
+    constexpr size_t rayCount = size_t(1) << 22;
+    const size_t     rayBytes = rayCount * sizeof(Ray);
+
+    auto stream = rdf::Stream::CreateMemoryStream();
+    {
+        rdf::ChunkFileWriter writer(stream);
+        SaveV1(MakeTrace(1, rayCount), writer);
+        writer.Close();
+    }
+    rdf::ChunkFile chunkfile(stream);
+
+    const auto peakBytes = [&chunkfile](const bool previous) {
+        const size_t before = CurrentHeapBytes();
+        ResetPeakHeapBytes();
+        {
+            RayTrace trace;
+            previous ? PreviousLoadFrom(chunkfile, trace, 0) : RayTrace::LoadFrom(chunkfile, trace, 0);
+        }
+        return PeakHeapBytes() - before;
+    };
+    const size_t peak         = peakBytes(false);
+    const size_t previousPeak = peakBytes(true);
+    spdlog::info("RayTrace::LoadFrom benchmark: {} of rays, peak heap {} (previous {})",
+                 MegaBytes(rayBytes),
+                 MegaBytes(peak),
+                 MegaBytes(previousPeak));
+    CHECK(peak < previousPeak);
+
+    // Divide the size in the names by the mean time for the throughput
+    const auto level = spdlog::get_level();
+    spdlog::set_level(spdlog::level::warn);
+    BENCHMARK("RayTrace::LoadFrom, " + MegaBytes(rayBytes))
+    {
+        RayTrace trace;
+        RayTrace::LoadFrom(chunkfile, trace, 0);
+        return trace.rays.size();
+    };
+    BENCHMARK("Previous per ray copy, " + MegaBytes(rayBytes))
+    {
+        RayTrace trace;
+        PreviousLoadFrom(chunkfile, trace, 0);
+        return trace.rays.size();
+    };
+    spdlog::set_level(level);
+}
+
+TEST_CASE("RayTrace::Save benchmark", "[RayTrace][!benchmark]")
+{
+    const RayTrace trace    = MakeTrace(1, size_t(1) << 20);
+    const size_t   rayBytes = trace.rays.size() * sizeof(Ray);
+
+    // Divide the size in the names by the mean time for the throughput, the ratio is uncompressed / saved bytes
+    const auto level = spdlog::get_level();
+    spdlog::set_level(spdlog::level::warn);
+    // 0 compresses on the calling thread
+    std::vector<int> workerCounts = {0};
+    for (int workerCount = 2; workerCount <= static_cast<int>(std::thread::hardware_concurrency()); workerCount *= 2) {
+        workerCounts.push_back(workerCount);
+    }
+    for (const int compressionLevel : {1, 3, 9}) {
+        for (const int workerCount : workerCounts) {
+            const std::string ratio = Ratio(rayBytes, SavedBytes(trace, compressionLevel, workerCount));
+            BENCHMARK("RayTrace::Save, level " + std::to_string(compressionLevel) + ", " + std::to_string(workerCount) +
+                      " workers, " + MegaBytes(rayBytes) + ", ratio " + ratio)
+            {
+                return SavedBytes(trace, compressionLevel, workerCount);
+            };
+        }
+    }
+    spdlog::set_level(level);
+}
+
+TEST_CASE("RayBlockTransform benchmark", "[RayTrace][!benchmark]")
+{
+    const RayTrace trace    = MakeTrace(1, size_t(1) << 22);
+    const size_t   rayBytes = trace.rays.size() * sizeof(Ray);
+
+    // Divide the size in the names by the mean time for the decode throughput
+    const auto level = spdlog::get_level();
+    spdlog::set_level(spdlog::level::warn);
+    for (const RayBlockTransform transform : {RayBlockTransform::None, RayBlockTransform::Shuffle}) {
+        auto stream = rdf::Stream::CreateMemoryStream();
+        {
+            rdf::ChunkFileWriter writer(stream);
+            trace.Save(writer, transform);
+            writer.Close();
+        }
+        const std::string ratio = Ratio(rayBytes, static_cast<size_t>(stream.GetSize()));
+        rdf::ChunkFile    chunkfile(stream);
+        BENCHMARK(std::string("RayTrace::LoadFrom, ") + (transform == RayBlockTransform::Shuffle ? "shuffled" : "raw") +
+                  " blocks, " + MegaBytes(rayBytes) + ", ratio " + ratio)
+        {
+            RayTrace loaded;
+            RayTrace::LoadFrom(chunkfile, loaded, 0);
+            return loaded.rays.size();
+        };
+    }
+    spdlog::set_level(level);
+}
@@ -0,0 +1,574 @@
+/* Copyright (c) 2023 Pirmin Pfeifer */
+#include <catch2/catch.hpp>
+
+#include <rayloader/VolumetricSampler.h>
+#include <rayvis-utils/CpuRaytracing.h>
+#include <rayvis-utils/FastVoxelTraverse.h>
+#include <spdlog/spdlog.h>
+
+#include "TestTraces.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+    using ChunkData = VolumetricSampler::ChunkData;
+
+    /// Sampler of 16^3 chunks of unit cells over a trace of MakeSceneTrace, without a ray length limit
+    std::unique_ptr<VolumetricSampler> MakeSampler(RayTrace& trace)
+    {
+        auto sampler = std::make_unique<VolumetricSampler>(&trace, 16, 1.f, std::nullopt);
+        sampler->SetWorkerCount(4);
+        return sampler;
+    }
+
+    /// Samples on the background job like the renderer does, every preview is taken over. Returns the number of
+    /// previews.
+    size_t SampleInBackground(VolumetricSampler& sampler)
+    {
+        size_t previews = 0;
+        sampler.SampleAsync();
+        while (sampler.IsDirty()) {
+            if (!sampler.IsSampleReady()) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                continue;
+            }
+            previews += sampler.IsSampling() ? 1 : 0;
+            sampler.FinishSampleAsync();
+        }
+        return previews;
+    }
+
+    template <typename T>
+    bool SameCells(const BrickGrid<T>& a, const BrickGrid<T>& b)
+    {
+        const std::vector<T> denseA = a.ToDense();
+        const std::vector<T> denseB = b.ToDense();
+        return denseA.size() == denseB.size() &&
+               std::memcmp(denseA.data(), denseB.data(), denseA.size() * sizeof(T)) == 0;
+    }
+
+    /// The exported chunks are equal bit for bit
+    bool SameVolume(const std::vector<ChunkData>& a, const std::vector<ChunkData>& b)
+    {
+        if (a.size() != b.size()) {
+            return false;
+        }
+        for (size_t i = 0; i < a.size(); i++) {
+            if (a[i].chunkIdx != b[i].chunkIdx || a[i].min != b[i].min || a[i].max != b[i].max ||
+                a[i].maxRays != b[i].maxRays || a[i].rayCount != b[i].rayCount || a[i].missedRays != b[i].missedRays ||
+                !SameCells(a[i].rayDensity, b[i].rayDensity) || !SameCells(a[i].directions, b[i].directions) ||
+                !SameCells(a[i].packedDirections, b[i].packedDirections)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    /// The exported chunks are equal bit for bit, except for exact directions summed up in a different order
+    bool SameSummedVolume(const std::vector<ChunkData>& a, const std::vector<ChunkData>& b)
+    {
+        if (a.size() != b.size()) {
+            return false;
+        }
+        size_t mismatches = 0;
+        for (size_t i = 0; i < a.size(); i++) {
+            mismatches += a[i].chunkIdx != b[i].chunkIdx || a[i].min != b[i].min || a[i].max != b[i].max ||
+                          a[i].maxRays != b[i].maxRays || a[i].rayCount != b[i].rayCount ||
+                          a[i].missedRays != b[i].missedRays || !SameCells(a[i].rayDensity, b[i].rayDensity);
+            a[i].rayDensity.ForEachOccupied([&](const Int3& cell, const VolumetricSampler::rdType density) {
+                const Float3 direction = a[i].directions.Get(cell);
+                mismatches += density != 0 && linalg::dot(direction, b[i].directions.Get(cell)) < 1.f - 1e-5f;
+            });
+        }
+        return mismatches == 0;
+    }
+
+    struct PreviousChunk {
+        std::vector<VolumetricSampler::rdType> densities;
+        std::vector<Double3>                   directions;  // Unnormalized sums
+        size_t                                 crossingRays = 0;
+    };
+
+    /// How Step 3 filled a chunk before the rays were binned per chunk, every ray of the trace is intersected with the
+    /// chunk. Without a ray length limit, densities are clamped like the exported ones.
+    PreviousChunk PreviousFillChunk(const RayTrace& trace, const ChunkData& chunk, const float cellSize)
+    {
+        const auto    size       = static_cast<int32_t>(chunk.chunkSize);
+        constexpr int maxDensity = std::numeric_limits<VolumetricSampler::rdType>::max() - 1;
+
+        PreviousChunk    previous;
+        std::vector<int> rays(chunk.chunkSize * chunk.chunkSize * chunk.chunkSize);
+        previous.directions.resize(rays.size(), Double3(0.));
+        for (const Ray& ray : trace.rays) {
+            const float  tMax   = ray.tHitOrTMax();
+            const Float2 minMax = IntersectAABB(ray.origin, ray.direction, chunk.min, chunk.max);
+            if (!HitAABB(minMax, tMax)) {
+                continue;
+            }
+            previous.crossingRays++;
+            const Double3 start = ray.origin + ray.direction * static_cast<double>(std::max(minMax.x, ray.tMin));
+            const Double3 end   = ray.origin + ray.direction * static_cast<double>(std::min(minMax.y, tMax));
+            const auto    visit = [&](const Int3& cell) {
+                rays[(cell.x * size + cell.y) * size + cell.z]++;
+                previous.directions[(cell.x * size + cell.y) * size + cell.z] += Double3(ray.direction);
+            };
+            VoxelTraceClipped((start - chunk.min) / cellSize, (end - chunk.min) / cellSize, size, visit);
+        }
+        for (const int cellRays : rays) {
+            previous.densities.push_back(static_cast<VolumetricSampler::rdType>(std::min(cellRays, maxDensity)));
+        }
+        return previous;
+    }
+}  // namespace
+
+TEST_CASE("VolumetricSampler traces the binned rays of each chunk like all rays of the trace", "[VolumetricSampler]")
+{
+    RayTrace   trace   = MakeSceneTrace(4, size_t(1) << 16);
+    const auto sampler = MakeSampler(trace);
+    sampler->Sample();
+    REQUIRE(1 < sampler->ChunkCount());
+    CHECK(sampler->GetCoverage().keptChunks == sampler->ChunkCount());
+
+    size_t mismatches = 0;
+    for (const ChunkData& chunk : *sampler->Data()) {
+        const PreviousChunk previous = PreviousFillChunk(trace, chunk, sampler->CellSize());
+        mismatches += chunk.rayCount - chunk.missedRays != previous.crossingRays;
+        mismatches += chunk.rayDensity.ToDense() != previous.densities;
+    }
+    CHECK(mismatches == 0);
+}
+
+TEST_CASE("VolumetricSampler samples the same volume progressively and in a single pass", "[VolumetricSampler]")
+{
+    // Progressive runs need at least 2^20 rays
+    RayTrace   trace     = MakeSceneTrace(1, size_t(1) << 20);
+    const auto reference = MakeSampler(trace);
+    reference->Sample();
+    const size_t chunkCount = reference->ChunkCount();
+    REQUIRE(16 < chunkCount);
+
+    // Room for all chunks and the sums of a progressive run, and room for only half of the chunks
+    reference->SetProgressive(true);
+    const size_t fittingBudget = chunkCount * reference->ChunkByteSize() + reference->TaskByteSize();
+    const size_t halfBudget    = chunkCount / 2 * reference->ChunkByteSize();
+
+    for (const size_t budget : {VolumetricSampler::UnlimitedMemoryBudget, fittingBudget, halfBudget}) {
+        INFO("Budget " << budget);
+        std::unique_ptr<VolumetricSampler> samplers[2];
+        size_t                             previews[2];
+        for (const bool progressive : {false, true}) {
+            samplers[progressive] = MakeSampler(trace);
+            samplers[progressive]->SetMemoryBudget(budget);
+            samplers[progressive]->SetProgressive(progressive);
+            previews[progressive] = SampleInBackground(*samplers[progressive]);
+        }
+        CHECK(previews[false] == 0);
+        CHECK(SameVolume(*samplers[true]->Data(), *samplers[false]->Data()));
+
+        const VolumetricSampler::Coverage& coverage = samplers[true]->GetCoverage();
+        if (budget == halfBudget) {
+            // Without room for the sums of every chunk the budget keeps the chunks of a single pass
+            CHECK(coverage.keptChunks < chunkCount);
+            CHECK(previews[true] == 0);
+        } else {
+            CHECK(coverage.keptChunks == chunkCount);
+            CHECK(0 < previews[true]);
+            CHECK(SameVolume(*samplers[true]->Data(), *reference->Data()));
+        }
+    }
+}
+
+TEST_CASE("VolumetricSampler::Cancel stops the background job and keeps the published volume", "[VolumetricSampler]")
+{
+    // The setters cancel the job as well, also the ones that do not make the sampler dirty
+    const auto stop = GENERATE(as<std::string>(), "Cancel", "SetFilter", "SetCellSize");
+    INFO("Stopped by " << stop);
+
+    RayTrace   trace     = MakeSceneTrace(2, size_t(1) << 20);
+    const auto reference = MakeSampler(trace);
+    reference->Sample();
+    const auto sampler = MakeSampler(trace);
+    sampler->Sample();
+
+    sampler->MarkDirty();
+    sampler->SampleAsync();
+    CHECK(sampler->IsSampling());
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+    const auto begin = std::chrono::steady_clock::now();
+    if (stop == "Cancel") {
+        sampler->Cancel();
+    } else if (stop == "SetFilter") {
+        sampler->SetFilter(RayFilter::IncludeAllRays);
+    } else {
+        sampler->SetCellSize(sampler->CellSize());
+    }
+    const auto latency = std::chrono::steady_clock::now() - begin;
+    CHECK(latency < std::chrono::milliseconds(500));
+
+    CHECK_FALSE(sampler->IsSampling());
+    CHECK_FALSE(sampler->IsSampleReady());
+    CHECK_FALSE(sampler->FinishSampleAsync());
+    CHECK(sampler->IsDirty());
+    CHECK(SameVolume(*sampler->Data(), *reference->Data()));
+}
+
+TEST_CASE("VolumetricSampler::Cancel benchmark", "[VolumetricSampler][!benchmark]")
+{
+    constexpr size_t rayCount = size_t(1) << 20;
+    RayTrace         trace    = MakeSceneTrace(1, rayCount);
+    const auto       sampler  = MakeSampler(trace);
+
+    // The latency Cancel reports, for jobs stopped at different steps of sampling
+    const auto               level = spdlog::get_level();
+    std::vector<std::string> results;
+    spdlog::set_level(spdlog::level::warn);
+    for (const int delay : {0, 10, 50, 200}) {
+        constexpr size_t          repetitions = 10;
+        std::chrono::microseconds total(0);
+        std::chrono::microseconds longest(0);
+        for (size_t i = 0; i < repetitions; i++) {
+            sampler->SampleAsync();
+            std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+            const std::chrono::microseconds latency = sampler->Cancel();
+            total += latency;
+            longest = std::max(longest, latency);
+        }
+        results.push_back(fmt::format("cancelled after {}ms, mean {:.2f}ms, max {:.2f}ms",
+                                      delay,
+                                      total.count() / 1000.f / repetitions,
+                                      longest.count() / 1000.f));
+    }
+    spdlog::set_level(level);
+    for (const std::string& result : results) {
+        spdlog::info("VolumetricSampler::Cancel benchmark: {} rays, {}", rayCount, result);
+    }
+}
+
+TEST_CASE("VolumetricSampler::PackDirection is at most 1 degree off", "[VolumetricSampler]")
+{
+    // Uniformly distributed directions, the axes and the folds of the octahedron on the lower hemisphere
+    std::mt19937                    rng(1);
+    std::normal_distribution<float> coordinate;
+    std::vector<Float3>             directions;
+    for (size_t i = 0; i < 1000000; i++) {
+        directions.push_back(linalg::normalize(Float3(coordinate(rng), coordinate(rng), coordinate(rng))));
+    }
+    for (const float x : {-1.f, -0.5f, 0.f, 0.5f, 1.f}) {
+        for (const float y : {-1.f, -0.5f, 0.f, 0.5f, 1.f}) {
+            for (const float z : {-1.f, -0.01f, 0.f, 0.01f, 1.f}) {
+                if (Float3(x, y, z) != Float3(0.f)) {
+                    directions.push_back(linalg::normalize(Float3(x, y, z)));
+                }
+            }
+        }
+    }
+
+    double maxError  = 0.;
+    double meanError = 0.;
+    for (const Float3& direction : directions) {
+        const auto   packed  = VolumetricSampler::PackDirection(direction);
+        const auto   decoded = Double3(VolumetricSampler::UnpackDirection(packed));
+        const double cosine  = linalg::dot(Double3(direction), decoded) / linalg::length(decoded);
+        const double error   = std::acos(std::clamp(cosine, -1., 1.)) * 180. / 3.14159265358979323846;
+        maxError             = std::max(maxError, error);
+        meanError += error / directions.size();
+    }
+    INFO("Mean error " << meanError << " degrees");
+    CHECK(maxError <= 1.);
+    CHECK(meanError < 0.35);
+}
+
+TEST_CASE("VolumetricSampler composes the hit and miss layers into the volume of all rays", "[VolumetricSampler]")
+{
+    RayTrace   trace   = MakeSceneTrace(3, size_t(1) << 16);
+    const auto sampler = MakeSampler(trace);
+    sampler->Sample();
+
+    struct Composed {
+        std::vector<VolumetricSampler::rdType> densities;
+        size_t                                 crossingRays = 0;
+    };
+    const auto compose = [&sampler](const RayFilter filter) {
+        sampler->SetFilter(filter);
+        std::unordered_map<Int3, Composed> chunks;
+        for (const ChunkData& chunk : *sampler->Data()) {
+            chunks[chunk.chunkIdx] = {chunk.rayDensity.ToDense(), chunk.rayCount - chunk.missedRays};
+        }
+        return chunks;
+    };
+    const auto all  = compose(RayFilter::IncludeAllRays);
+    const auto hit  = compose(RayFilter::IncludeHitRays);
+    const auto miss = compose(RayFilter::IncludeMissRays);
+    REQUIRE(!hit.empty());
+    REQUIRE(!miss.empty());
+
+    // Chunks only crossed by one kind of rays are left out of the volume of the other kind, every chunk of a layer is
+    // part of the volume of all rays
+    const std::vector<VolumetricSampler::rdType> empty(16 * 16 * 16);
+    size_t                                       mismatches = 0;
+    for (const auto& [chunkIdx, chunk] : all) {
+        const auto   hitChunk      = hit.find(chunkIdx);
+        const auto   missChunk     = miss.find(chunkIdx);
+        const auto&  hitDensities  = hitChunk != hit.end() ? hitChunk->second.densities : empty;
+        const auto&  missDensities = missChunk != miss.end() ? missChunk->second.densities : empty;
+        const size_t hitRays       = hitChunk != hit.end() ? hitChunk->second.crossingRays : 0;
+        const size_t missRays      = missChunk != miss.end() ? missChunk->second.crossingRays : 0;
+        mismatches += chunk.crossingRays != hitRays + missRays;
+        for (size_t cell = 0; cell < chunk.densities.size(); cell++) {
+            mismatches += chunk.densities[cell] != hitDensities[cell] + missDensities[cell];
+        }
+    }
+    for (const auto* layer : {&hit, &miss}) {
+        for (const auto& [chunkIdx, chunk] : *layer) {
+            mismatches += !all.contains(chunkIdx);
+        }
+    }
+    CHECK(mismatches == 0);
+}
+
+TEST_CASE("VolumetricSampler reports the coverage kept within the chunk budget", "[VolumetricSampler]")
+{
+    RayTrace   trace     = MakeSceneTrace(5, size_t(1) << 16);
+    const auto reference = MakeSampler(trace);
+    reference->Sample();
+    const VolumetricSampler::Coverage& all = reference->GetCoverage();
+    REQUIRE(8 <= all.chunkCount);
+    CHECK(all.keptChunks == all.chunkCount);
+    CHECK(all.keptCrossings == all.crossings);
+    CHECK(all.Ratio() == 1.f);
+    CHECK(reference->ChunkCount() == all.chunkCount);
+
+    std::unordered_map<Int3, const ChunkData*> referenceChunks;
+    for (const ChunkData& chunk : *reference->Data()) {
+        referenceChunks[chunk.chunkIdx] = &chunk;
+    }
+
+    // A quarter of the chunks by count, and a budget of a quarter of the chunks with all bricks allocated
+    const bool byCount = GENERATE(true, false);
+    INFO((byCount ? "Chunk count limit" : "Memory budget"));
+    const auto   sampler = MakeSampler(trace);
+    const size_t limit   = all.chunkCount / 4;
+    const size_t budget  = limit * sampler->ChunkByteSize() + sampler->TaskByteSize();
+    if (byCount) {
+        sampler->SetMaxChunkCount(limit);
+    } else {
+        sampler->SetMemoryBudget(budget);
+    }
+    sampler->Sample();
+
+    const VolumetricSampler::Coverage& kept = sampler->GetCoverage();
+    CHECK(kept.chunkCount == all.chunkCount);
+    CHECK(kept.crossings == all.crossings);
+    CHECK(kept.keptChunks == sampler->ChunkCount());
+    CHECK(kept.keptChunks < kept.chunkCount);
+    CHECK(kept.keptCrossings < kept.crossings);
+    CHECK(kept.Ratio() == static_cast<float>(kept.keptCrossings) / kept.crossings);
+    if (byCount) {
+        CHECK(kept.keptChunks == limit);
+    } else {
+        CHECK(limit <= kept.keptChunks);
+        CHECK(sampler->DataByteSize() + sampler->TaskByteSize() <= budget);
+    }
+
+    // The kept chunks are sampled as without a budget
+    size_t mismatches = 0;
+    for (const ChunkData& chunk : *sampler->Data()) {
+        const auto previous = referenceChunks.find(chunk.chunkIdx);
+        mismatches += previous == referenceChunks.end() || !SameCells(chunk.rayDensity, previous->second->rayDensity);
+    }
+    CHECK(mismatches == 0);
+}
+
+TEST_CASE("VolumetricSampler discovers the same chunks on any number of partials", "[VolumetricSampler]")
+{
+    // Each partial of the discovery takes at least 2^14 rays, 2^16 rays are split across up to 4 partials. There are
+    // more chunks than workers, so the rays of a chunk are traced by a single slice on any worker count.
+    RayTrace   trace  = MakeSceneTrace(6, size_t(1) << 16);
+    const auto serial = MakeSampler(trace);
+    serial->SetWorkerCount(1);
+    serial->Sample();
+    REQUIRE(8 < serial->ChunkCount());
+
+    const size_t workerCount = GENERATE(2, 3, 4, 8);
+    INFO("Workers " << workerCount);
+    const auto parallel = MakeSampler(trace);
+    parallel->SetWorkerCount(workerCount);
+    parallel->Sample();
+    CHECK(parallel->GetCoverage().crossings == serial->GetCoverage().crossings);
+    CHECK(SameVolume(*parallel->Data(), *serial->Data()));
+}
+
+TEST_CASE("VolumetricSampler allocates only crossed bricks and exports them like dense chunks", "[VolumetricSampler]")
+{
+    // A thin fan of camera rays crosses few of the 8^3 bricks of each chunk
+    constexpr size_t chunkSize = 64;
+    RayTrace         trace     = MakeTrace(7, size_t(1) << 16);
+
+    VolumetricSampler sampler(&trace, chunkSize, 0.25f, std::nullopt);
+    sampler.SetDirectionEncoding(VolumetricSampler::DirectionEncoding::Exact);
+    sampler.Sample();
+    REQUIRE(0 < sampler.ChunkCount());
+
+    constexpr size_t brickSize     = BrickGrid<VolumetricSampler::rdType>::BrickSize;
+    constexpr size_t bricksPerAxis = chunkSize / brickSize;
+    size_t           mismatches    = 0;
+    size_t           occupied      = 0;
+    for (const ChunkData& chunk : *sampler.Data()) {
+        const PreviousChunk previous = PreviousFillChunk(trace, chunk, sampler.CellSize());
+        mismatches += chunk.rayDensity.ToDense() != previous.densities;
+
+        // Only bricks holding cells crossed by rays are allocated, the other cells read as empty
+        std::vector<bool> crossedBricks(BrickGrid<VolumetricSampler::rdType>::BricksFor(chunkSize));
+        for (size_t x = 0; x < chunkSize; x++) {
+            for (size_t y = 0; y < chunkSize; y++) {
+                for (size_t z = 0; z < chunkSize; z++) {
+                    const size_t   cell      = (x * chunkSize + y) * chunkSize + z;
+                    const Double3& direction = previous.directions[cell];
+                    if (previous.densities[cell] == 0) {
+                        mismatches += chunk.Directions(x, y, z) != Float3(0.f);
+                        continue;
+                    }
+                    crossedBricks[((x / brickSize) * bricksPerAxis + y / brickSize) * bricksPerAxis + z / brickSize] =
+                        true;
+                    mismatches += linalg::dot(Double3(chunk.Directions(x, y, z)), linalg::normalize(direction)) <
+                                  1. - 1e-5;
+                }
+            }
+        }
+        const size_t crossed = std::count(crossedBricks.begin(), crossedBricks.end(), true);
+        mismatches += chunk.rayDensity.OccupiedBricks() != crossed;
+        mismatches += chunk.directions.OccupiedBricks() != crossed;
+        occupied += crossed;
+    }
+    CHECK(mismatches == 0);
+    INFO("Occupied bricks " << occupied);
+    CHECK(occupied < sampler.ChunkCount() * BrickGrid<VolumetricSampler::rdType>::BricksFor(chunkSize) / 4);
+}
+
+TEST_CASE("VolumetricSampler splits the rays of few chunks across threads", "[VolumetricSampler]")
+{
+    // With more workers than chunks the rays of each chunk are traced in up to 2^16 / MinRaysPerSlice slices
+    RayTrace trace = MakeTrace(8, size_t(1) << 16);
+    std::unique_ptr<VolumetricSampler> samplers[2];
+    for (const bool split : {false, true}) {
+        samplers[split] = std::make_unique<VolumetricSampler>(&trace, 64, 0.25f, std::nullopt);
+        samplers[split]->SetWorkerCount(split ? 16 : 1);
+        samplers[split]->SetDirectionEncoding(VolumetricSampler::DirectionEncoding::Exact);
+        samplers[split]->Sample();
+    }
+    const std::vector<ChunkData>& unsplit = *samplers[false]->Data();
+    const std::vector<ChunkData>& split   = *samplers[true]->Data();
+    REQUIRE(0 < unsplit.size());
+    REQUIRE(unsplit.size() < 16);
+    REQUIRE(split.size() == unsplit.size());
+
+    CHECK(SameSummedVolume(split, unsplit));
+}
+
+TEST_CASE("VolumetricSampler moves the rays changing class like sampling again", "[VolumetricSampler]")
+{
+    // From the default tolerance of 0.1 to one moving hitting rays into the miss layer and one moving missing rays into
+    // the hit layer. The hit margins of the trace are spread over [0, 2), few enough rays change class to be moved.
+    const float missTolerance = GENERATE(0.3f, 0.f);
+    INFO("Miss tolerance " << missTolerance);
+
+    // The moved rays stay on the grid of the previous tolerance. A missing ray across the scene fixes the bounds of the
+    // rays, so sampling again starts the grid at the same origin.
+    RayTrace trace   = MakeSceneTrace(9, size_t(1) << 16);
+    Ray      bounds  = {};
+    bounds.origin    = Float3(-64.f);
+    bounds.direction = linalg::normalize(Float3(1.f));
+    bounds.tMax      = linalg::length(Float3(192.f));
+    trace.rays.push_back(bounds);
+
+    const auto sampler = MakeSampler(trace);
+    sampler->SetDirectionEncoding(VolumetricSampler::DirectionEncoding::Exact);
+    sampler->Sample();
+    sampler->SetMissTolerance(missTolerance);
+    CHECK(sampler->IsMovePending());
+    sampler->Sample();
+    CHECK_FALSE(sampler->IsDirty());
+
+    const auto fresh = MakeSampler(trace);
+    fresh->SetDirectionEncoding(VolumetricSampler::DirectionEncoding::Exact);
+    fresh->SetMissTolerance(missTolerance);
+    fresh->Sample();
+    for (const RayFilter filter : {RayFilter::IncludeAllRays, RayFilter::IncludeHitRays, RayFilter::IncludeMissRays}) {
+        INFO("Filter " << static_cast<int>(filter));
+        sampler->SetFilter(filter);
+        fresh->SetFilter(filter);
+        CHECK(SameSummedVolume(*sampler->Data(), *fresh->Data()));
+    }
+}
+
+TEST_CASE("VolumetricSampler composes power of two cell sizes from the pyramid", "[VolumetricSampler]")
+{
+    RayTrace   trace   = MakeSceneTrace(10, size_t(1) << 16);
+    const auto sampler = MakeSampler(trace);
+    sampler->Sample();
+    std::unordered_map<Int3, std::vector<VolumetricSampler::rdType>> sampled;
+    for (const ChunkData& chunk : *sampler->Data()) {
+        sampled[chunk.chunkIdx] = chunk.rayDensity.ToDense();
+    }
+
+    const int32_t level = GENERATE(1, 2, 3);
+    INFO("Level " << level);
+    const float cellSize = static_cast<float>(1 << level);
+    sampler->SetCellSize(cellSize);
+    CHECK_FALSE(sampler->IsDirty());
+    CHECK(sampler->CellSize() == cellSize);
+
+    const auto fresh = MakeSampler(trace);
+    fresh->SetCellSize(cellSize);
+    fresh->Sample();
+    std::unordered_map<Int3, const ChunkData*> freshChunks;
+    for (const ChunkData& chunk : *fresh->Data()) {
+        freshChunks[chunk.chunkIdx] = &chunk;
+    }
+    REQUIRE(sampler->ChunkCount() == fresh->ChunkCount());
+
+    // The chunks of the level are the ones of sampling at its cell size, each cell sums the cells it covers on level 0.
+    // Only the rays crossing one of the merged chunks are known, missedRays is an upper bound.
+    constexpr int32_t size       = 16;
+    constexpr int     maxDensity = std::numeric_limits<VolumetricSampler::rdType>::max() - 1;
+    const int32_t     scale      = 1 << level;
+    size_t            mismatches = 0;
+    for (const ChunkData& chunk : *sampler->Data()) {
+        const auto freshChunk = freshChunks.find(chunk.chunkIdx);
+        if (freshChunk == freshChunks.end()) {
+            mismatches++;
+            continue;
+        }
+        mismatches += chunk.min != freshChunk->second->min || chunk.max != freshChunk->second->max;
+        mismatches += chunk.rayCount != freshChunk->second->rayCount;
+        mismatches += chunk.missedRays < freshChunk->second->missedRays;
+
+        const std::vector<VolumetricSampler::rdType> densities = chunk.rayDensity.ToDense();
+        for (int32_t cell = 0; cell < size * size * size; cell++) {
+            const Int3 coarse = chunk.chunkIdx * size + Int3(cell / (size * size), cell / size % size, cell % size);
+            int        rays   = 0;
+            for (int32_t i = 0; i < scale * scale * scale; i++) {
+                const Int3 fine = coarse * scale + Int3(i / (scale * scale), i / scale % scale, i % scale);
+                const Int3 sampledIdx(fine.x / size, fine.y / size, fine.z / size);
+                const Int3 sampledCell  = fine - sampledIdx * size;
+                const auto sampledChunk = sampled.find(sampledIdx);
+                if (sampledChunk != sampled.end()) {
+                    rays += sampledChunk->second[(sampledCell.x * size + sampledCell.y) * size + sampledCell.z];
+                }
+            }
+            mismatches += densities[cell] != std::min(rays, maxDensity);
+        }
+    }
+    CHECK(mismatches == 0);
+}
@@ -0,0 +1,230 @@
+/* Copyright (c) 2023 Pirmin Pfeifer */
+#include "CpuRaytracing.h"
+
+#include <atomic>
+#include <vector>
+
+#if defined(_M_X64) || defined(__x86_64__)
+#define RAYVIS_X64 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+
+// MSVC accepts intrinsics of every instruction set, gcc and clang need them enabled per function
+#if defined(__GNUC__) || defined(__clang__)
+#define RAYVIS_TARGET(isa) __attribute__((target(isa)))
+#else
+#define RAYVIS_TARGET(isa)
+#endif
+
+namespace {
+    void IntersectScalar(
+        const RayPacket& rays, const size_t count, const Float3& boxMin, const Float3& boxMax, RayPacketHits& hits)
+    {
+        hits.hitMask = 0;
+        for (size_t i = 0; i < count; i++) {
+            const Float3 origin(rays.originX[i], rays.originY[i], rays.originZ[i]);
+            const Float3 dir(rays.dirX[i], rays.dirY[i], rays.dirZ[i]);
+            const Float2 minMax = IntersectAABB(origin, dir, boxMin, boxMax);
+            hits.tNear[i]       = minMax.x;
+            hits.tFar[i]        = minMax.y;
+            hits.hitMask |= static_cast<std::uint32_t>(HitAABB(minMax, rays.tMax[i])) << i;
+        }
+    }
+
+#ifdef RAYVIS_X64
+    // The operand order of min and max matches linalg::min (a < b ? a : b) and linalg::max (a < b ? b : a),
+    // so lanes with NaN or signed zero slabs give the same result as the scalar version.
+    // Lanes beyond count are computed as well and masked out afterwards.
+
+    void IntersectSSE(
+        const RayPacket& rays, const size_t count, const Float3& boxMin, const Float3& boxMax, RayPacketHits& hits)
+    {
+        const __m128  one  = _mm_set1_ps(1.f);
+        const __m128  zero = _mm_setzero_ps();
+        std::uint32_t mask = 0;
+        for (size_t i = 0; i < RayPacket::Width; i += 4) {
+            const __m128 originX = _mm_load_ps(rays.originX + i);
+            const __m128 originY = _mm_load_ps(rays.originY + i);
+            const __m128 originZ = _mm_load_ps(rays.originZ + i);
+            const __m128 fracX   = _mm_div_ps(one, _mm_load_ps(rays.dirX + i));
+            const __m128 fracY   = _mm_div_ps(one, _mm_load_ps(rays.dirY + i));
+            const __m128 fracZ   = _mm_div_ps(one, _mm_load_ps(rays.dirZ + i));
+
+            const __m128 lowerX = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(boxMin.x), originX), fracX);
+            const __m128 lowerY = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(boxMin.y), originY), fracY);
+            const __m128 lowerZ = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(boxMin.z), originZ), fracZ);
+            const __m128 upperX = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(boxMax.x), originX), fracX);
+            const __m128 upperY = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(boxMax.y), originY), fracY);
+            const __m128 upperZ = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(boxMax.z), originZ), fracZ);
+
+            const __m128 tNear = _mm_max_ps(_mm_min_ps(lowerZ, upperZ),
+                                            _mm_max_ps(_mm_min_ps(lowerY, upperY), _mm_min_ps(lowerX, upperX)));
+            const __m128 tFar  = _mm_min_ps(_mm_min_ps(_mm_max_ps(upperX, lowerX), _mm_max_ps(upperY, lowerY)),
+                                           _mm_max_ps(upperZ, lowerZ));
+            _mm_store_ps(hits.tNear + i, tNear);
+            _mm_store_ps(hits.tFar + i, tFar);
+
+            const __m128 missed = _mm_or_ps(
+                _mm_or_ps(_mm_cmplt_ps(tFar, tNear), _mm_cmple_ps(_mm_load_ps(rays.tMax + i), tNear)),
+                _mm_cmplt_ps(tFar, zero));
+            mask |= static_cast<std::uint32_t>(~_mm_movemask_ps(missed) & 0xF) << i;
+        }
+        hits.hitMask = mask & ((1U << count) - 1);
+    }
+
+    RAYVIS_TARGET("avx2")
+    void IntersectAVX2(
+        const RayPacket& rays, const size_t count, const Float3& boxMin, const Float3& boxMax, RayPacketHits& hits)
+    {
+        const __m256  one  = _mm256_set1_ps(1.f);
+        const __m256  zero = _mm256_setzero_ps();
+        std::uint32_t mask = 0;
+        for (size_t i = 0; i < RayPacket::Width; i += 8) {
+            const __m256 originX = _mm256_load_ps(rays.originX + i);
+            const __m256 originY = _mm256_load_ps(rays.originY + i);
+            const __m256 originZ = _mm256_load_ps(rays.originZ + i);
+            const __m256 fracX   = _mm256_div_ps(one, _mm256_load_ps(rays.dirX + i));
+            const __m256 fracY   = _mm256_div_ps(one, _mm256_load_ps(rays.dirY + i));
+            const __m256 fracZ   = _mm256_div_ps(one, _mm256_load_ps(rays.dirZ + i));
+
+            const __m256 lowerX = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(boxMin.x), originX), fracX);
+            const __m256 lowerY = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(boxMin.y), originY), fracY);
+            const __m256 lowerZ = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(boxMin.z), originZ), fracZ);
+            const __m256 upperX = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(boxMax.x), originX), fracX);
+            const __m256 upperY = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(boxMax.y), originY), fracY);
+            const __m256 upperZ = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(boxMax.z), originZ), fracZ);
+
+            const __m256 tNear = _mm256_max_ps(
+                _mm256_min_ps(lowerZ, upperZ),
+                _mm256_max_ps(_mm256_min_ps(lowerY, upperY), _mm256_min_ps(lowerX, upperX)));
+            const __m256 tFar = _mm256_min_ps(
+                _mm256_min_ps(_mm256_max_ps(upperX, lowerX), _mm256_max_ps(upperY, lowerY)),
+                _mm256_max_ps(upperZ, lowerZ));
+            _mm256_store_ps(hits.tNear + i, tNear);
+            _mm256_store_ps(hits.tFar + i, tFar);
+
+            const __m256 missed = _mm256_or_ps(
+                _mm256_or_ps(_mm256_cmp_ps(tFar, tNear, _CMP_LT_OQ),
+                             _mm256_cmp_ps(_mm256_load_ps(rays.tMax + i), tNear, _CMP_LE_OQ)),
+                _mm256_cmp_ps(tFar, zero, _CMP_LT_OQ));
+            mask |= static_cast<std::uint32_t>(~_mm256_movemask_ps(missed) & 0xFF) << i;
+        }
+        hits.hitMask = mask & ((1U << count) - 1);
+    }
+
+    RAYVIS_TARGET("avx512f")
+    void IntersectAVX512(
+        const RayPacket& rays, const size_t count, const Float3& boxMin, const Float3& boxMax, RayPacketHits& hits)
+    {
+        static_assert(RayPacket::Width == 16);
+        const __m512 one     = _mm512_set1_ps(1.f);
+        const __m512 originX = _mm512_load_ps(rays.originX);
+        const __m512 originY = _mm512_load_ps(rays.originY);
+        const __m512 originZ = _mm512_load_ps(rays.originZ);
+        const __m512 fracX   = _mm512_div_ps(one, _mm512_load_ps(rays.dirX));
+        const __m512 fracY   = _mm512_div_ps(one, _mm512_load_ps(rays.dirY));
+        const __m512 fracZ   = _mm512_div_ps(one, _mm512_load_ps(rays.dirZ));
+
+        const __m512 lowerX = _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(boxMin.x), originX), fracX);
+        const __m512 lowerY = _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(boxMin.y), originY), fracY);
+        const __m512 lowerZ = _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(boxMin.z), originZ), fracZ);
+        const __m512 upperX = _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(boxMax.x), originX), fracX);
+        const __m512 upperY = _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(boxMax.y), originY), fracY);
+        const __m512 upperZ = _mm512_mul_ps(_mm512_sub_ps(_mm512_set1_ps(boxMax.z), originZ), fracZ);
+
+        const __m512 tNear = _mm512_max_ps(
+            _mm512_min_ps(lowerZ, upperZ), _mm512_max_ps(_mm512_min_ps(lowerY, upperY), _mm512_min_ps(lowerX, upperX)));
+        const __m512 tFar = _mm512_min_ps(
+            _mm512_min_ps(_mm512_max_ps(upperX, lowerX), _mm512_max_ps(upperY, lowerY)), _mm512_max_ps(upperZ, lowerZ));
+        _mm512_store_ps(hits.tNear, tNear);
+        _mm512_store_ps(hits.tFar, tFar);
+
+        const __mmask16 missed = _mm512_cmp_ps_mask(tFar, tNear, _CMP_LT_OQ) |
+                                 _mm512_cmp_ps_mask(_mm512_load_ps(rays.tMax), tNear, _CMP_LE_OQ) |
+                                 _mm512_cmp_ps_mask(tFar, _mm512_setzero_ps(), _CMP_LT_OQ);
+        hits.hitMask = static_cast<std::uint32_t>(~missed & 0xFFFF) & ((1U << count) - 1);
+    }
+
+    bool SupportsAVX2(bool& avx512)
+    {
+#ifdef _MSC_VER
+        int info[4];
+        __cpuid(info, 0);
+        if (info[0] < 7) {
+            return false;
+        }
+        __cpuid(info, 1);
+        const bool osxsave = (info[2] >> 27) & 1;
+        const bool avx     = (info[2] >> 28) & 1;
+        if (!osxsave || !avx) {
+            return false;
+        }
+        // The OS has to save the ymm (and zmm) registers on context switches
+        const unsigned long long xcr0 = _xgetbv(0);
+        __cpuidex(info, 7, 0);
+        avx512 = ((xcr0 & 0xE6) == 0xE6) && ((info[1] >> 16) & 1);
+        return ((xcr0 & 0x6) == 0x6) && ((info[1] >> 5) & 1);
+#else
+        __builtin_cpu_init();
+        avx512 = __builtin_cpu_supports("avx512f");
+        return __builtin_cpu_supports("avx2");
+#endif
+    }
+#endif
+
+    const std::vector<IntersectAABBKernel>& SupportedKernels()
+    {
+        static const std::vector<IntersectAABBKernel> kernels = [] {
+            std::vector<IntersectAABBKernel> supported = {{IntersectScalar, "scalar"}};
+#ifdef RAYVIS_X64
+            supported.push_back({IntersectSSE, "SSE"});
+            bool avx512 = false;
+            if (SupportsAVX2(avx512)) {
+                supported.push_back({IntersectAVX2, "AVX2"});
+                if (avx512) {
+                    supported.push_back({IntersectAVX512, "AVX-512"});
+                }
+            }
+#endif
+            return supported;
+        }();
+        return kernels;
+    }
+
+    std::atomic<const IntersectAABBKernel*>& SelectedKernel()
+    {
+        static std::atomic<const IntersectAABBKernel*> selected = &SupportedKernels().back();
+        return selected;
+    }
+}  // namespace
+
+void IntersectAABB(
+    const RayPacket& rays, const size_t count, const Float3& boxMin, const Float3& boxMax, RayPacketHits& hits)
+{
+    assert(count <= RayPacket::Width);
+    SelectedKernel().load(std::memory_order_relaxed)->intersect(rays, count, boxMin, boxMax, hits);
+}
+
+std::span<const IntersectAABBKernel> IntersectAABBKernels()
+{
+    return SupportedKernels();
+}
+
+bool SelectIntersectAABBKernel(const std::string_view name)
+{
+    for (const IntersectAABBKernel& kernel : SupportedKernels()) {
+        if (name == kernel.name) {
+            SelectedKernel() = &kernel;
+            return true;
+        }
+    }
+    return false;
+}
+
+const char* IntersectAABBKernelName()
+{
+    return SelectedKernel().load(std::memory_order_relaxed)->name;
+}
@@ -0,0 +1,163 @@
+/* Copyright (c) 2023 Pirmin Pfeifer */
+#include "TaskPool.h"
+
+#include <algorithm>
+#include <cassert>
+#include <numeric>
+
+struct TaskPool::Batch {
+    Batch(const Task& task, const Progress& progress, const size_t count)
+        : task(task), progress(progress), count(count), remaining(count)
+    {
+    }
+
+    const Task&        task;
+    const Progress&    progress;
+    const size_t       count;
+    std::atomic_size_t remaining;
+
+    std::mutex              mutex;
+    std::condition_variable done;
+    std::exception_ptr      error  = nullptr;
+    std::atomic_bool        failed = false;
+
+    std::mutex progressMutex;  /// Serializes the progress calls, they run without holding mutex
+    size_t     finished = 0;
+};
+
+TaskPool::TaskPool(const size_t workerCount)
+{
+    const size_t count = 0 < workerCount ? workerCount : std::max(std::thread::hardware_concurrency(), 1U);
+    for (size_t i = 0; i < count; i++) {
+        queues_.push_back(std::make_unique<Queue>());
+    }
+    workers_.reserve(count - 1);
+    for (size_t i = 0; i + 1 < count; i++) {
+        workers_.emplace_back([this, i]() { WorkerLoop(i); });
+    }
+}
+
+TaskPool::~TaskPool()
+{
+    {
+        std::lock_guard lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    workers_.clear();
+}
+
+size_t TaskPool::WorkerCount() const
+{
+    return queues_.size();
+}
+
+void TaskPool::ParallelFor(const size_t            count,
+                           const Task&             task,
+                           std::span<const size_t> costs,
+                           const Progress&         progress)
+{
+    assert(costs.empty() || costs.size() == count);
+    if (count == 0) {
+        return;
+    }
+
+    std::vector<size_t> order(count);
+    std::iota(order.begin(), order.end(), 0);
+    if (!costs.empty()) {
+        std::stable_sort(order.begin(), order.end(), [&costs](const size_t a, const size_t b) {
+            return costs[b] < costs[a];
+        });
+    }
+
+    Batch batch(task, progress, count);
+
+    // Raised before any item can be taken, so taking an item never drops the count below the queued items
+    {
+        std::lock_guard lock(mutex_);
+        pending_ += count;
+    }
+    // Dealing the tasks out in order leaves the most expensive ones at the front of every queue
+    for (size_t i = 0; i < count; i++) {
+        Queue&          queue = *queues_[i % queues_.size()];
+        std::lock_guard lock(queue.mutex);
+        queue.items.push_back({&batch, order[i]});
+    }
+    wake_.notify_all();
+
+    const size_t callerQueue = queues_.size() - 1;
+    while (batch.remaining != 0) {
+        if (!TryRunNext(callerQueue)) {
+            // Everything is taken, the remaining tasks of the batch run on other threads
+            std::unique_lock lock(batch.mutex);
+            batch.done.wait(lock, [&batch]() { return batch.remaining == 0; });
+        }
+    }
+    // The last task may still hold the lock of the batch
+    std::lock_guard lock(batch.mutex);
+
+    if (batch.error) {
+        std::rethrow_exception(batch.error);
+    }
+}
+
+bool TaskPool::TryRunNext(const size_t queueIdx)
+{
+    for (size_t i = 0; i < queues_.size(); i++) {
+        Queue& queue = *queues_[(queueIdx + i) % queues_.size()];
+        Item   item;
+        {
+            std::lock_guard lock(queue.mutex);
+            if (queue.items.empty()) {
+                continue;
+            }
+            item = queue.items.front();
+            queue.items.pop_front();
+        }
+        pending_--;
+        Run(item);
+        return true;
+    }
+    return false;
+}
+
+void TaskPool::Run(const Item& item)
+{
+    Batch& batch = *item.batch;
+    if (!batch.failed) {
+        try {
+            batch.task(item.index);
+        } catch (...) {
+            std::lock_guard lock(batch.mutex);
+            if (!batch.error) {
+                batch.error  = std::current_exception();
+                batch.failed = true;
+            }
+        }
+    }
+
+    if (batch.progress) {
+        std::lock_guard lock(batch.progressMutex);
+        batch.progress(++batch.finished, batch.count);
+    }
+
+    std::lock_guard lock(batch.mutex);
+    // The waiting caller may destroy the batch right after the counter reaches zero, so it is done under the lock
+    if (--batch.remaining == 0) {
+        batch.done.notify_all();
+    }
+}
+
+void TaskPool::WorkerLoop(const size_t queueIdx)
+{
+    while (true) {
+        if (TryRunNext(queueIdx)) {
+            continue;
+        }
+        std::unique_lock lock(mutex_);
+        wake_.wait(lock, [this]() { return stop_ || pending_ != 0; });
+        if (stop_ && pending_ == 0) {
+            return;
+        }
+    }
+}
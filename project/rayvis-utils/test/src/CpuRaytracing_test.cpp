@@ -0,0 +1,144 @@
+/* Copyright (c) 2023 Pirmin Pfeifer */
+#include <catch2/catch.hpp>
+
+#include "rayvis-utils/CpuRaytracing.h"
+
+#include <array>
+#include <bitset>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+    struct Box {
+        Float3 min;
+        Float3 max;
+    };
+
+    const std::vector<Box> boxes = {
+        {Float3(0.f), Float3(1.f)},
+        {Float3(-4.f, 2.f, -1.f), Float3(-2.f, 3.f, 7.f)},
+        {Float3(0.25f, 0.5f, 0.75f), Float3(0.25f, 0.5f, 0.75f)},  // Degenerate box
+    };
+
+    /// Rays through and around the boxes, including axis parallel directions (infinite slabs), signed zeros and
+    /// origins on the box planes (NaN slabs)
+    std::vector<RayPacket> MakePackets(const size_t packetCount)
+    {
+        std::mt19937                          rng(42);
+        std::uniform_real_distribution<float> coordinate(-6.f, 8.f);
+        std::uniform_real_distribution<float> component(-1.f, 1.f);
+        std::uniform_int_distribution<int>    special(0, 7);
+        const std::array<float, 6>            planes = {0.f, 1.f, -4.f, -2.f, 0.5f, 7.f};
+
+        std::vector<RayPacket> packets(packetCount);
+        for (RayPacket& packet : packets) {
+            for (size_t lane = 0; lane < RayPacket::Width; lane++) {
+                Float3 origin(coordinate(rng), coordinate(rng), coordinate(rng));
+                Float3 dir(component(rng), component(rng), component(rng));
+                for (int axis = 0; axis < 3; axis++) {
+                    const int kind = special(rng);
+                    if (kind < 2) {
+                        dir[axis] = kind == 0 ? 0.f : -0.f;
+                    }
+                    if (special(rng) < 2) {
+                        origin[axis] = planes[rng() % planes.size()];
+                    }
+                }
+                if (dir == Float3(0.f)) {
+                    dir.x = 1.f;
+                }
+                const float tMax = special(rng) == 0 ? 0.f : coordinate(rng) + 6.f;
+                packet.Set(lane, origin, dir, tMax);
+            }
+        }
+        return packets;
+    }
+}  // namespace
+
+TEST_CASE("IntersectAABB packet kernels match the scalar version", "[CpuRaytracing]")
+{
+    const std::vector<RayPacket> packets = MakePackets(4096);
+
+    const auto kernels = IntersectAABBKernels();
+    REQUIRE(!kernels.empty());
+    CHECK(std::strcmp(kernels.back().name, IntersectAABBKernelName()) == 0);
+
+    for (const IntersectAABBKernel& kernel : kernels) {
+        INFO("Kernel " << kernel.name);
+        size_t mismatches = 0;
+        for (const Box& box : boxes) {
+            for (size_t p = 0; p < packets.size(); p++) {
+                const RayPacket& packet = packets[p];
+                const size_t     count  = p % (RayPacket::Width + 1);
+
+                RayPacketHits hits;
+                kernel.intersect(packet, count, box.min, box.max, hits);
+                std::uint32_t expectedMask = 0;
+                for (size_t lane = 0; lane < count; lane++) {
+                    const Float3 origin(packet.originX[lane], packet.originY[lane], packet.originZ[lane]);
+                    const Float3 dir(packet.dirX[lane], packet.dirY[lane], packet.dirZ[lane]);
+                    const Float2 expected = IntersectAABB(origin, dir, box.min, box.max);
+                    expectedMask |= static_cast<std::uint32_t>(HitAABB(expected, packet.tMax[lane])) << lane;
+                    // Bitwise, so NaN lanes and signed zeros are compared as well
+                    if (std::memcmp(&expected.x, hits.tNear + lane, sizeof(float)) != 0 ||
+                        std::memcmp(&expected.y, hits.tFar + lane, sizeof(float)) != 0)
+                    {
+                        mismatches++;
+                    }
+                }
+                if (expectedMask != hits.hitMask) {
+                    mismatches++;
+                }
+            }
+        }
+        CHECK(mismatches == 0);
+    }
+}
+
+TEST_CASE("SelectIntersectAABBKernel switches between the supported kernels", "[CpuRaytracing]")
+{
+    const auto kernels = IntersectAABBKernels();
+    REQUIRE(std::strcmp(kernels.front().name, "scalar") == 0);
+
+    for (const IntersectAABBKernel& kernel : kernels) {
+        CHECK(SelectIntersectAABBKernel(kernel.name));
+        CHECK(std::strcmp(IntersectAABBKernelName(), kernel.name) == 0);
+    }
+    CHECK_FALSE(SelectIntersectAABBKernel("unknown"));
+    CHECK(std::strcmp(IntersectAABBKernelName(), kernels.back().name) == 0);
+}
+
+TEST_CASE("IntersectAABB benchmark", "[CpuRaytracing][!benchmark]")
+{
+    const std::vector<RayPacket> packets  = MakePackets(1 << 16);
+    const std::string            rayCount = std::to_string(packets.size() * RayPacket::Width) + " rays";
+    const Box&                   box      = boxes[1];
+
+    // Divide the ray count in the names by the mean time for the throughput
+    BENCHMARK("Scalar IntersectAABB per ray, " + rayCount)
+    {
+        size_t hitCount = 0;
+        for (const RayPacket& packet : packets) {
+            for (size_t lane = 0; lane < RayPacket::Width; lane++) {
+                const Float3 origin(packet.originX[lane], packet.originY[lane], packet.originZ[lane]);
+                const Float3 dir(packet.dirX[lane], packet.dirY[lane], packet.dirZ[lane]);
+                hitCount += HitAABB(IntersectAABB(origin, dir, box.min, box.max), packet.tMax[lane]);
+            }
+        }
+        return hitCount;
+    };
+    for (const IntersectAABBKernel& kernel : IntersectAABBKernels()) {
+        BENCHMARK(std::string("Packet kernel ") + kernel.name + ", " + rayCount)
+        {
+            size_t        hitCount = 0;
+            RayPacketHits hits;
+            for (const RayPacket& packet : packets) {
+                kernel.intersect(packet, RayPacket::Width, box.min, box.max, hits);
+                hitCount += std::bitset<RayPacket::Width>(hits.hitMask).count();
+            }
+            return hitCount;
+        };
+    }
+}
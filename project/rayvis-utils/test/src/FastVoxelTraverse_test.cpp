@@ -0,0 +1,219 @@
+/* Copyright (c) 2023 Pirmin Pfeifer */
+#include <catch2/catch.hpp>
+
+#include "rayvis-utils/FastVoxelTraverse.h"
+
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace {
+    /// The std::function based traversal VoxelTrace replaced, kept as the reference
+    void PreviousVoxelTrace(const Double3& start, const Double3& end, std::function<void(const Int3& voxel)> visit)
+    {
+        double tMax[3];
+        double tDelta[3];
+        int    step[3];
+        Int3   voxel;
+        for (int axis = 0; axis < 3; axis++) {
+            const double from = start[axis];
+            const double to   = end[axis];
+            step[axis]        = to - from > 0 ? 1 : (to - from < 0 ? -1 : 0);
+            tDelta[axis]      = step[axis] != 0 ? std::fmin(step[axis] / (to - from), 10000000.0) : 10000000.0;
+            tMax[axis]        = tDelta[axis] * (step[axis] > 0 ? 1 - from + std::floor(from) : from - std::floor(from));
+            voxel[axis]       = static_cast<int>(from);
+        }
+
+        visit(voxel);
+        while (true) {
+            const int axis = tMax[0] < tMax[1] ? (tMax[0] < tMax[2] ? 0 : 2) : (tMax[1] < tMax[2] ? 1 : 2);
+            voxel[axis] += step[axis];
+            tMax[axis] += tDelta[axis];
+            if (tMax[0] > 1 && tMax[1] > 1 && tMax[2] > 1) {
+                break;
+            }
+            visit(voxel);
+        }
+    }
+
+    template <typename T>
+    std::vector<Int3> Trace(const linalg::vec<T, 3>& start, const linalg::vec<T, 3>& end)
+    {
+        std::vector<Int3> voxels;
+        VoxelTrace(start, end, [&voxels](const Int3& voxel) { voxels.push_back(voxel); });
+        return voxels;
+    }
+
+    std::vector<Int3> PreviousTrace(const Double3& start, const Double3& end)
+    {
+        std::vector<Int3> voxels;
+        PreviousVoxelTrace(start, end, [&voxels](const Int3& voxel) { voxels.push_back(voxel); });
+        return voxels;
+    }
+
+    /// Random segments in a 64^3 grid, a quarter of the segments are parallel to an axis. With onBoundaries a
+    /// quarter of the coordinates lie on voxel boundaries.
+    std::vector<VoxelSegment<double>> MakeSegments(const size_t count, const bool onBoundaries = true)
+    {
+        std::mt19937                           rng(42);
+        std::uniform_real_distribution<double> coordinate(0.0, 64.0);
+        std::uniform_int_distribution<int>     special(0, 3);
+
+        std::vector<VoxelSegment<double>> segments(count);
+        for (VoxelSegment<double>& segment : segments) {
+            for (int axis = 0; axis < 3; axis++) {
+                segment.start[axis] = coordinate(rng);
+                segment.end[axis]   = coordinate(rng);
+                if (onBoundaries && special(rng) == 0) {
+                    segment.start[axis] = std::floor(segment.start[axis]);
+                }
+                if (onBoundaries && special(rng) == 0) {
+                    segment.end[axis] = std::floor(segment.end[axis]);
+                }
+            }
+            if (special(rng) == 0) {
+                const int axis    = static_cast<int>(rng() % 3);
+                segment.end[axis] = segment.start[axis];
+            }
+        }
+        return segments;
+    }
+
+    bool IsConnectedPath(const std::vector<Int3>& voxels)
+    {
+        for (size_t i = 1; i < voxels.size(); i++) {
+            const Int3 delta = linalg::abs(voxels[i] - voxels[i - 1]);
+            if (delta.x + delta.y + delta.z != 1) {
+                return false;
+            }
+        }
+        return true;
+    }
+}  // namespace
+
+TEST_CASE("VoxelTrace visits the voxels of the previous traversal", "[FastVoxelTraverse]")
+{
+    size_t mismatches = 0;
+    for (const VoxelSegment<double>& segment : MakeSegments(100000)) {
+        mismatches += Trace(segment.start, segment.end) != PreviousTrace(segment.start, segment.end);
+    }
+    CHECK(mismatches == 0);
+}
+
+TEST_CASE("VoxelTrace repeats the start voxel of an axis parallel segment on a voxel boundary", "[FastVoxelTraverse]")
+{
+    // The tMax of the parallel axis starts at 0, so the first step along it stays in the start voxel. Kept as is,
+    // the sampler counts these rays twice in the start voxel just like it did before.
+    const Double3           start(2.0, 3.5, 1.25);
+    const Double3           end(2.0, 6.5, 1.25);
+    const std::vector<Int3> expected = {Int3(2, 3, 1), Int3(2, 3, 1), Int3(2, 4, 1), Int3(2, 5, 1)};
+    CHECK(PreviousTrace(start, end) == expected);
+    CHECK(Trace(start, end) == expected);
+    CHECK(Trace(Float3(start), Float3(end)) == expected);
+
+    // Starting on a boundary of the stepped axis as well, the voxel holding end is visited too
+    const Double3 boundaryStart(60.0, 57.0, 49.25);
+    const Double3 boundaryEnd(60.0, 56.5, 49.75);
+    CHECK(PreviousTrace(boundaryStart, boundaryEnd) == std::vector<Int3>{Int3(60, 57, 49), Int3(60, 56, 49)});
+    CHECK(Trace(boundaryStart, boundaryEnd) == PreviousTrace(boundaryStart, boundaryEnd));
+}
+
+TEST_CASE("VoxelTrace in float precision follows the double traversal", "[FastVoxelTraverse]")
+{
+    // Both traverse the same float endpoints. An end on a voxel boundary is reached at t == 1 exactly, whether that
+    // voxel is visited depends on the rounding of tDelta, so such segments are left out. What remains are near ties
+    // between two axes, measured at 15 of 100000 segments.
+    constexpr size_t count      = 100000;
+    size_t           mismatches = 0;
+    size_t           broken     = 0;
+    for (const VoxelSegment<double>& segment : MakeSegments(count, false)) {
+        const Float3            start(segment.start);
+        const Float3            end(segment.end);
+        const std::vector<Int3> voxels = Trace(start, end);
+        mismatches += voxels != Trace(Double3(start), Double3(end));
+        broken += voxels.empty() || voxels.front() != Int3(start) || !IsConnectedPath(voxels);
+    }
+    CHECK(mismatches <= count / 1000);
+    CHECK(broken == 0);
+}
+
+TEMPLATE_TEST_CASE("VoxelTraceClipped keeps the voxels inside the grid", "[FastVoxelTraverse]", float, double)
+{
+    using Vec = linalg::vec<TestType, 3>;
+
+    for (const int32_t size : {1, 8, 32, 128}) {
+        INFO("Grid size " << size);
+        const TestType    edge = static_cast<TestType>(size);
+        std::vector<Int3> voxels;
+        const auto        collect = [&voxels](const Int3& voxel) { voxels.push_back(voxel); };
+
+        // Points on the upper boundary belong to the last voxel
+        VoxelTraceClipped(Vec(edge), Vec(edge), size, collect);
+        CHECK(voxels == std::vector<Int3>{Int3(size - 1)});
+
+        // Points beyond the grid are clamped to size - 0.001
+        voxels.clear();
+        VoxelTraceClipped(Vec(edge + 5, TestType(0.5), TestType(0.5)), Vec(TestType(-3), TestType(0.5), TestType(0.5)),
+                          size,
+                          collect);
+        REQUIRE(!voxels.empty());
+        CHECK(voxels.front() == Int3(size - 1, 0, 0));
+
+        voxels.clear();
+        VoxelTraceClipped(Vec(TestType(-2)), Vec(edge * 3), size, collect);
+        REQUIRE(!voxels.empty());
+        CHECK(voxels.front() == Int3(0));
+        for (const Int3& voxel : voxels) {
+            CHECK((0 <= linalg::minelem(voxel) && linalg::maxelem(voxel) < size));
+        }
+    }
+}
+
+TEST_CASE("VoxelTraceBatch passes the segment index", "[FastVoxelTraverse]")
+{
+    const std::vector<VoxelSegment<double>> segments = MakeSegments(1000);
+
+    std::vector<std::vector<Int3>> voxels(segments.size());
+    VoxelTraceBatch(segments, [&voxels](const size_t segment, const Int3& voxel) { voxels[segment].push_back(voxel); });
+    for (size_t i = 0; i < segments.size(); i++) {
+        CHECK(voxels[i] == Trace(segments[i].start, segments[i].end));
+    }
+}
+
+TEST_CASE("VoxelTrace benchmark", "[FastVoxelTraverse][!benchmark]")
+{
+    const std::vector<VoxelSegment<double>> segments = MakeSegments(10000);
+    std::vector<VoxelSegment<float>>        floatSegments;
+    for (const VoxelSegment<double>& segment : segments) {
+        floatSegments.push_back({Float3(segment.start), Float3(segment.end)});
+    }
+    const auto countVoxels = [](const auto& batch) {
+        size_t count = 0;
+        VoxelTraceBatch(batch, [&count](size_t, const Int3&) { count++; });
+        return std::to_string(count) + " voxels";
+    };
+
+    // Divide the voxel count in the names by the mean time for the voxels per second
+    const std::string voxels = countVoxels(segments);
+    BENCHMARK("Previous std::function traversal, " + voxels)
+    {
+        Int3 sum(0);
+        for (const VoxelSegment<double>& segment : segments) {
+            PreviousVoxelTrace(segment.start, segment.end, [&sum](const Int3& voxel) { sum += voxel; });
+        }
+        return sum;
+    };
+    BENCHMARK("VoxelTrace<double>, " + voxels)
+    {
+        Int3 sum(0);
+        VoxelTraceBatch(segments, [&sum](size_t, const Int3& voxel) { sum += voxel; });
+        return sum;
+    };
+    BENCHMARK("VoxelTrace<float>, " + countVoxels(floatSegments))
+    {
+        Int3 sum(0);
+        VoxelTraceBatch(floatSegments, [&sum](size_t, const Int3& voxel) { sum += voxel; });
+        return sum;
+    };
+}
@@ -0,0 +1,102 @@
+/* Copyright (c) 2023 Pirmin Pfeifer */
+#include <catch2/catch.hpp>
+
+#include "rayvis-utils/TaskPool.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+TEST_CASE("TaskPool::ParallelFor runs every task once before it returns", "[TaskPool]")
+{
+    constexpr size_t count       = 1000;
+    const size_t     workerCount = GENERATE(1, 2, 4);
+    INFO("Workers " << workerCount);
+
+    TaskPool                               pool(workerCount);
+    std::vector<std::atomic_int>           runs(count);
+    std::vector<std::pair<size_t, size_t>> progress;
+    pool.ParallelFor(
+        count,
+        [&runs](const size_t i) { runs[i]++; },
+        {},
+        [&progress](const size_t finished, const size_t total) { progress.emplace_back(finished, total); });
+
+    for (size_t i = 0; i < count; i++) {
+        CHECK(runs[i] == 1);
+    }
+    // Serialized calls, one per finished task in increasing order
+    REQUIRE(progress.size() == count);
+    for (size_t i = 0; i < count; i++) {
+        CHECK(progress[i] == std::make_pair(i + 1, count));
+    }
+}
+
+TEST_CASE("TaskPool::ParallelFor can be nested inside of tasks", "[TaskPool]")
+{
+    TaskPool        pool(4);
+    std::atomic_int runs = 0;
+    pool.ParallelFor(16, [&pool, &runs](const size_t) {
+        pool.ParallelFor(16, [&runs](const size_t) { runs++; });
+    });
+    CHECK(runs == 16 * 16);
+}
+
+TEST_CASE("TaskPool::ParallelFor starts the most expensive tasks first", "[TaskPool]")
+{
+    // Without workers the calling thread runs the tasks in the order they are dealt out
+    TaskPool                  pool(1);
+    const std::vector<size_t> costs = {3, 9, 1, 9, 5, 0};
+    std::vector<size_t>       order;
+    pool.ParallelFor(costs.size(), [&order](const size_t i) { order.push_back(i); }, costs);
+
+    // Equal costs keep the order of their indices
+    CHECK(order == std::vector<size_t>{1, 3, 4, 0, 2, 5});
+}
+
+TEST_CASE("TaskPool steals the tasks queued behind a blocked task", "[TaskPool]")
+{
+    // The tasks are dealt out alternately to the worker and the calling thread. Whichever of them runs task 0 blocks
+    // until all other tasks finished, which only happens when the other thread takes the tasks from both queues.
+    constexpr size_t count = 64;
+
+    TaskPool                pool(2);
+    std::mutex              mutex;
+    std::condition_variable othersDone;
+    size_t                  finished = 0;
+    bool                    stolen   = false;
+    pool.ParallelFor(count, [&](const size_t i) {
+        std::unique_lock lock(mutex);
+        if (i == 0) {
+            const auto othersFinished = [&finished]() { return finished == count - 1; };
+            stolen                    = othersDone.wait_for(lock, std::chrono::seconds(10), othersFinished);
+        } else if (++finished == count - 1) {
+            othersDone.notify_all();
+        }
+    });
+    CHECK(stolen);
+}
+
+TEST_CASE("TaskPool::ParallelFor rethrows the first exception of a task", "[TaskPool]")
+{
+    TaskPool        pool(4);
+    std::atomic_int runs = 0;
+    CHECK_THROWS_AS(pool.ParallelFor(100,
+                                     [&runs](const size_t i) {
+                                         runs++;
+                                         if (i == 10) {
+                                             throw std::runtime_error("task failed");
+                                         }
+                                     }),
+                    std::runtime_error);
+    CHECK(0 < runs);
+
+    // The pool keeps working after a failed batch
+    runs = 0;
+    pool.ParallelFor(100, [&runs](const size_t) { runs++; });
+    CHECK(runs == 100);
+}
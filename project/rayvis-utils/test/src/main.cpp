@@ -0,0 +1,3 @@
+/* Copyright (c) 2023 Pirmin Pfeifer */
+#define CATCH_CONFIG_MAIN
+#include <catch2/catch.hpp>